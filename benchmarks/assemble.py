@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+"""
+throughput of the assembler and the Zz codec on a generated source
+
+Parser keeps an Instruction per line and lays sections out again in
+to_object(), StreamAssembler encodes while it reads. Both must build the
+same image. The codec is measured against the per-byte bin() encoder it
+replaced
+
+usage: python3 benchmarks/assemble.py [functions]
+"""
+
+import io
+import os
+import random
+import sys
+import time
+
+ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), '..'))
+sys.path.append(os.path.join(ROOT, 'lib', 'python'))
+
+from zzvm import Parser, StreamAssembler, ObjectCache, encode
+
+def generate(functions):
+    """
+    straight-line code with local loops and calls back to earlier functions,
+    and a data section of tables and strings
+    """
+    rng = random.Random(1)
+    text = [ '.sect text' ]
+    data = [ '.sect data' ]
+    for f in range(functions):
+        text.append('func_%d:' % f)
+        text.append('movi r1, $table_%d' % f)
+        text.append('movi r2, %d' % rng.randrange(1, 100))
+        text.append('loop_%d:' % f)
+        for i in range(rng.randrange(4, 12)):
+            text.append(rng.choice([
+                'addr ra, ra, r%d' % rng.randrange(1, 6),
+                'addi r3, r3, 0x%x' % rng.randrange(0x10000),
+                'ldr r4, r1, r2',
+                'xori r5, r5, %d' % rng.randrange(-128, 128),
+            ]))
+        text.append('jnc r3, %d, $skip_%d' % (rng.randrange(-128, 128), f))
+        if f:
+            text.append('call $func_%d' % rng.randrange(f))
+        text.append('skip_%d:' % f)
+        text.append('loop r2, $loop_%d' % f)
+        text.append('ret')
+        data.append('table_%d:' % f)
+        data.append('.db ' + ', '.join('%02x' % rng.randrange(256) for i in range(8)))
+        data.append('.str "func %d"' % f)
+    return '\n'.join(text + data) + '\n'
+
+def old_encode(data):
+    return b''.join(bin(b)[2:].zfill(8).translate(str.maketrans('10', 'Zz')).encode()
+                    for b in data)
+
+def timed(func, *args):
+    start = time.perf_counter()
+    result = func(*args)
+    return result, time.perf_counter() - start
+
+def rate(size, seconds):
+    return '%8.2f MB/s' % (size / seconds / 1e6)
+
+def main():
+    functions = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+    source = generate(functions)
+    size = len(source)
+    lines = source.count('\n')
+    print('source: %d lines, %.2f MB' % (lines, size / 1e6))
+
+    _, old_time = timed(lambda: Parser(source).to_object())
+    _, new_time = timed(lambda: StreamAssembler(source).to_object())
+    print('%-16s %8.3f s %s' % ('Parser', old_time, rate(size, old_time)))
+    print('%-16s %8.3f s %s  %.1fx' % ('StreamAssembler', new_time, rate(size, new_time),
+                                       old_time / new_time))
+
+    # a guest image is at most 64K, check a slice of the source which fits
+    sample = generate(min(functions, 200))
+    cache = ObjectCache(None)
+    image = cache.link(StreamAssembler(sample).to_object())[0]
+    if cache.link(Parser(sample).to_object())[0] != image:
+        print('images differ!')
+        return 1
+
+    # repeat the image up to a few megabytes so the codec dominates
+    payload = image * max(1, (4 << 20) // len(image))
+    zz, old_time = timed(old_encode, payload)
+    new_zz, new_time = timed(encode.zz_encode_data, payload)
+    print('%-16s %8.3f s %s' % ('bin() encode', old_time, rate(len(payload), old_time)))
+    print('%-16s %8.3f s %s  %.1fx' % ('table encode', new_time, rate(len(payload), new_time),
+                                       old_time / new_time))
+
+    out = io.BytesIO()
+    _, decode_time = timed(encode.zz_decode_stream, io.BytesIO(new_zz), out)
+    print('%-16s %8.3f s %s' % ('table decode', decode_time, rate(len(payload), decode_time)))
+
+    if zz != new_zz or out.getvalue() != payload:
+        print('codec mismatch!')
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
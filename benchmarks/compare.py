@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+"""
+compare code generated by zzcc against hand-written assembly using zstdlib
+
+every benchmark runs under `zzvm trace`, executed instructions are counted
+from the trace and the output of both programs must be identical
+
+usage: python3 benchmarks/compare.py
+"""
+
+import os
+import sys
+import subprocess
+import tempfile
+
+ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), '..'))
+ZZVM = os.path.join(ROOT, 'zzvm', 'zzvm')
+ZZASSEMBLER = os.path.join(ROOT, 'utils', 'zzassembler')
+ZZCC = os.path.join(ROOT, 'utils', 'zzcc')
+
+# name, hand-written source, compiled source, stdin
+BENCHMARKS = [
+    ('gets_n', 'benchmarks/gets_n.zasm', 'benchmarks/gets_n.zc',
+     b'first line\nsecond\n\na much longer line that keeps on going for a while\n'),
+    ('puts', 'benchmarks/puts.zasm', 'benchmarks/puts.zc', b''),
+    ('loop_sum', 'samples/loop_sum.zasm', 'benchmarks/loop_sum.zc', b''),
+]
+
+def build(tool, source, output):
+    subprocess.check_call([ tool, source, output ], cwd=ROOT,
+                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+def measure(image, stdin):
+    p = subprocess.run([ ZZVM, 'trace', image ], input=stdin, cwd=ROOT,
+                       stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    count = sum(1 for line in p.stderr.splitlines() if line.startswith(b'[TRACE]'))
+    # trace mode dumps registers to stdout, take the output from a plain run
+    p = subprocess.run([ ZZVM, 'run', image ], input=stdin, cwd=ROOT,
+                       stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    return count, p.stdout
+
+def main():
+    if not os.path.exists(ZZVM):
+        print('build zzvm first: make -C zzvm', file=sys.stderr)
+        return 1
+
+    print('%-10s %12s %12s %8s' % ('benchmark', 'hand', 'zzcc', 'ratio'))
+    failed = False
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, asm, c, stdin in BENCHMARKS:
+            hand_image = os.path.join(tmp, name + '-hand.zz')
+            cc_image = os.path.join(tmp, name + '-cc.zz')
+            build(ZZASSEMBLER, asm, hand_image)
+            build(ZZCC, c, cc_image)
+
+            hand, hand_out = measure(hand_image, stdin)
+            cc, cc_out = measure(cc_image, stdin)
+            note = ''
+            if hand_out != cc_out:
+                note = '  output differs!'
+                failed = True
+            print('%-10s %12d %12d %8.2f%s' % (name, hand, cc, cc / hand, note))
+
+    return 1 if failed else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""
+wall time of zzvm run with and without the decoded tier
+
+every benchmark runs a few times in each mode, the fastest run counts. Both
+modes must print the same output and execute the same number of
+instructions
+
+usage: python3 benchmarks/tiering.py [runs]
+"""
+
+import json
+import os
+import sys
+import subprocess
+import tempfile
+import time
+
+ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), '..'))
+ZZVM = os.path.join(ROOT, 'zzvm', 'zzvm')
+ZZCC = os.path.join(ROOT, 'utils', 'zzcc')
+
+# name, compiled source
+BENCHMARKS = [
+    ('sieve', 'benchmarks/sieve.zc'),
+]
+
+def run(image, tier):
+    start = time.perf_counter()
+    p = subprocess.run([ ZZVM, 'run', '--stats', '--tier=' + tier, image ], cwd=ROOT,
+                       stdout=subprocess.PIPE, stderr=subprocess.PIPE, check=True)
+    elapsed = time.perf_counter() - start
+    return elapsed, p.stdout, json.loads(p.stderr)
+
+def main():
+    runs = int(sys.argv[1]) if len(sys.argv) > 1 else 5
+    if not os.path.exists(ZZVM):
+        print('build zzvm first: make -C zzvm', file=sys.stderr)
+        return 1
+
+    print('%-10s %12s %10s %10s %8s %10s' % ('benchmark', 'insns', 'off', 'tiered',
+                                             'speedup', 'decoded'))
+    failed = False
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, source in BENCHMARKS:
+            image = os.path.join(tmp, name + '.zz')
+            subprocess.check_call([ ZZCC, source, image ], cwd=ROOT,
+                                  stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+            fastest = lambda tier: min((run(image, tier) for i in range(runs)),
+                                       key=lambda result: result[0])
+            off = fastest('off')
+            tiered = fastest('64,16')
+            note = ''
+            if off[1] != tiered[1] or off[2]['instructions'] != tiered[2]['instructions']:
+                note = '  results differ!'
+                failed = True
+            stats = tiered[2]
+            print('%-10s %12d %9.3fs %9.3fs %7.2fx %9.1f%%%s' % (
+                name, stats['instructions'], off[0], tiered[0], off[0] / tiered[0],
+                100.0 * stats['decoded_instructions'] / stats['instructions'], note))
+
+    return 1 if failed else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
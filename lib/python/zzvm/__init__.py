@@ -2,6 +2,14 @@ from .instruction import Instruction
 from .registers import Registers
 from .opcode import Opcodes
 from .parser import Parser
+from .assembler import StreamAssembler
+from .objfile import ObjectFile
+from .linker import Linker
+from .cache import ObjectCache
+from . import runtime
+from . import client
 from . import encode
 
-__all__ = [ 'Instruction', 'Registers', 'Opcodes', 'Parser', 'encode' ]
+__all__ = [ 'Instruction', 'Registers', 'Opcodes', 'Parser', 'StreamAssembler',
+            'ObjectFile', 'Linker', 'ObjectCache', 'encode', 'runtime',
+            'client' ]
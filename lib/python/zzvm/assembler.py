@@ -0,0 +1,273 @@
+import collections
+import hashlib
+import io
+import struct
+
+from .instruction import compose_c_imm
+from .objfile import ObjectFile, ObjectSection, Relocation
+from .opcode import name_to_opcode_mapping
+from .parser import QueueReader, resolve_source_path, unescape_str_to_bytes
+from .registers import name_to_reg_mapping
+
+__all__ = [ 'StreamAssembler' ]
+
+# opcode name: (code, type, required registers)
+OPCODES = { name: (op.code, op.type_, op.regs) for name, op in name_to_opcode_mapping.items() }
+REGISTERS = { name: reg.code for name, reg in name_to_reg_mapping.items() }
+
+pack_instruction = struct.Struct('<BBH').pack
+
+def parse_int(s):
+    s = s.strip()
+    if s[:2] == '0x':
+        return int(s, 16)
+    elif s[0] == '#':
+        return int(s[1:], 10)
+    else:
+        return int(s)
+
+class StreamSection(object):
+    """
+    section body under construction, references to labels are kept as
+    (offset, kind, symbol, addend, is_relative) until the section is done
+    """
+    def __init__(self, addr):
+        self.addr = addr
+        self.body = bytearray()
+        self.labels = {}
+        self.refs = []
+        self.alignment = 1      # of every write from now on
+        self.max_alignment = 1
+
+    def pad(self, n):
+        self.body += bytes(-(self.addr + len(self.body)) % n)
+
+    def write(self, data):
+        self.body += data
+        if self.alignment > 1:
+            self.pad(self.alignment)
+
+    def align(self, n):
+        self.alignment = n
+        if n > 1:
+            self.pad(n)
+            self.max_alignment = max(self.max_alignment, n)
+
+    def finish(self, name, inherited):
+        """
+        back-patch relative references to labels of this section, which do
+        not move at link time, and leave the rest to the linker
+        """
+        relocs = []
+        for offset, kind, symbol, addend, is_relative in self.refs:
+            if not is_relative or symbol not in self.labels:
+                relocs.append(Relocation(offset, kind, symbol, addend, is_relative))
+                continue
+
+            value = self.labels[symbol] + addend - offset - 4
+            if kind == 'C':
+                try:
+                    imm = compose_c_imm(struct.unpack_from('<b', self.body, offset + 3)[0], value)
+                except ValueError as e:
+                    raise ValueError('%s (%s)' % (e, symbol))
+            else:
+                imm = value & 0xffff
+            struct.pack_into('<H', self.body, offset + 2, imm)
+
+        sect = ObjectSection(name, None if inherited else self.addr,
+                             self.body, self.max_alignment)
+        sect.labels = self.labels
+        sect.relocs = relocs
+        return sect
+
+class StreamAssembler(object):
+    """
+    single pass assembler for large sources, instructions are encoded as
+    lines are read and no per-instruction objects are kept. Produces the
+    same objects as Parser.to_object(), minus the relocations it can
+    resolve itself, but can not run the peephole optimizer
+    """
+    def __init__(self, fin, section=None):
+        """
+        fin		source file or string
+        section	name of the section code goes to before any `.sect`
+        """
+        self.entry = None
+        self.imports = []
+        self.depends = {}
+        self.initial_section = section.upper() if section else None
+        self.sections = collections.OrderedDict()
+        self.section_bodies = {}
+        # line: (encoded instruction, reference or None), generated code
+        # repeats the same lines over and over
+        self.encoded = {}
+
+        if type(fin) is str:
+            fin = io.StringIO(fin)
+        self.reader = QueueReader(fin)
+        self.obj = self.assemble()
+
+    def assemble(self):
+        sections = self.sections
+        current = None
+        current_name = None
+
+        if self.initial_section:
+            current_name = self.initial_section
+            current = sections[current_name] = StreamSection(0)
+
+        while True:
+            raw = self.reader.readline()
+            if not raw:
+                break
+            line = raw.split(';')[0].strip()
+            if not line:
+                continue
+
+            if line[-1] == ':':
+                current.labels[line[:-1]] = len(current.body)
+            elif line[0] != '.':
+                self.emit(current, line)
+            elif line.startswith('.sect'):
+                args = line.split(maxsplit=1)[1].split(' ')
+                current_name = args[0].upper()
+                if len(args) > 1:
+                    addr = int(args[1], 16)
+                else:
+                    addr = 0x4000 if current_name == 'TEXT' else 0x6000
+                current = sections[current_name] = StreamSection(addr)
+            elif line.startswith('.include'):
+                filename = resolve_source_path(line.split(maxsplit=1)[1].strip())
+                with open(filename) as f:
+                    source = f.read()
+                self.depends[filename] = hashlib.sha256(source.encode()).hexdigest()
+                self.reader.insert_file(io.StringIO(source))
+            elif line.startswith('.import'):
+                filename = resolve_source_path(line.split(maxsplit=1)[1].strip())
+                if (filename, current_name) not in self.imports:
+                    self.imports.append((filename, current_name))
+            elif line.startswith('.entry'):
+                entry = self.immediate(line.split()[1])
+                self.entry = entry[0] if type(entry) is tuple else entry
+            elif line.startswith('.align'):
+                current.align(parse_int(line.split()[1]))
+            elif line.startswith('.db'):
+                current.write(bytes(int(i.strip(), 16) for i in line[3:].split(',')))
+            elif line.startswith('.zero'):
+                data = line[5:].strip()
+                current.write(bytes(int(data, 16) if data.startswith('0x') else int(data)))
+            elif line.startswith('.str'):
+                data = line[4:].strip()
+                current.write(unescape_str_to_bytes(data[1:-1]) + b'\0\0')
+            else:
+                self.emit(current, line)
+
+        obj = ObjectFile()
+        obj.imports = self.imports
+        obj.depends = self.depends
+        obj.entry = self.entry
+        obj.sections = [ sect.finish(name, name == self.initial_section)
+                         for name, sect in sections.items() ]
+        return obj
+
+    def immediate(self, val):
+        """
+        int, or (symbol, addend) for `$label` and `$label+addend`
+        """
+        if val[0] == '$':
+            if '+' in val:
+                name, offset = val[1:].split('+')
+                return (name, parse_int(offset))
+            return (val[1:], 0)
+        try:
+            return parse_int(val)
+        except ValueError:
+            return None
+
+    def emit(self, section, line):
+        try:
+            data, ref = self.encoded[line]
+        except KeyError:
+            data, ref = self.encoded[line] = self.instruction(line)
+        if ref:
+            section.refs.append((len(section.body),) + ref)
+        section.write(data)
+
+    def instruction(self, line):
+        """
+        encoded bytes and (kind, symbol, addend, is_relative) of the label
+        it refers to, or None
+        """
+        parts = line.split(maxsplit=1)
+        name = parts[0].upper()
+        args = [ i.strip() for i in parts[1].split(',') ] if len(parts) > 1 else []
+
+        if name == 'JMP':
+            name = 'ADDI'
+            args = [ 'IP', 'IP', args[0] ]
+            rel = True
+        else:
+            rel = bool(args) and (name[0] == 'J' or name in ('CALL', 'LOOP'))
+
+        try:
+            code, type_, required = OPCODES[name]
+        except KeyError:
+            raise ValueError('Unknown instruction: %r' % parts[0])
+
+        imm = None
+        regs = args
+        if args:
+            imm = self.immediate(args[-1])
+            if imm is None:
+                if rel:
+                    raise ValueError('jump instruction must have target\nline: %r' % line)
+            else:
+                regs = args[:-1]
+
+        if type_ == 'C':
+            if len(regs) != 2:
+                raise ValueError('expect register, constant and target\nline: %r' % line)
+            const = parse_int(regs[1])
+            regs = regs[:1]
+
+        if len(regs) > 3:
+            raise ValueError('too many registers\nline: %r' % line)
+        codes = [ REGISTERS.get(r.upper()) for r in regs ]
+        if len(codes) < required or None in codes[:required]:
+            raise ValueError('required register is missing\nline: %r' % line)
+        codes = [ c or 0 for c in codes ] + [ 0, 0, 0 ]
+
+        ref = None
+        if type(imm) is tuple:
+            ref = ('C' if type_ == 'C' else 'I', imm[0], imm[1], rel)
+            imm = compose_c_imm(const, 0) if type_ == 'C' else 0
+        elif type_ == 'C':
+            try:
+                imm = compose_c_imm(const, imm)
+            except ValueError as e:
+                raise ValueError('%s\nline: %r' % (e, line))
+        elif type_ == 'I':
+            if imm is None:
+                raise ValueError('missing immediate\nline: %r' % line)
+            imm &= 0xffff
+        elif type_ == 'R':
+            imm = codes[2]
+        else:
+            imm = 0
+
+        return pack_instruction(code, codes[0] << 4 | codes[1], imm), ref
+
+    def to_object(self):
+        return self.obj
+
+    def build(self, cache=None):
+        """
+        link with imported objects into an image
+        """
+        from .cache import ObjectCache
+
+        if cache is None:
+            cache = ObjectCache(None)
+        image, linker = cache.link(self.obj)
+        self.section_bodies = linker.section_bodies
+        return image
@@ -0,0 +1,133 @@
+import hashlib
+import os
+
+from .linker import Linker
+from .objfile import ObjectFile
+
+__all__ = [ 'ObjectCache' ]
+
+ASSEMBLER_VERSION = b'zzasm-2'
+ZZCODE_PATH = os.path.abspath(os.path.join(os.path.dirname(__file__),
+                                           '../../../zzvm/zzcode.h'))
+
+def default_cache_dir():
+    """
+    $ZZ_CACHE_DIR, or ~/.cache/zzvm/objects, empty string disables caching
+    """
+    path = os.environ.get('ZZ_CACHE_DIR')
+    if path is None:
+        path = os.path.join(os.path.expanduser('~'), '.cache', 'zzvm', 'objects')
+    return path or None
+
+def sha256_file(filename):
+    with open(filename, 'rb') as f:
+        return hashlib.sha256(f.read()).hexdigest()
+
+class ObjectCache(object):
+    """
+    objects of imported files keyed by content hash, a cached object is
+    used only if every file it includes is unchanged as well
+    """
+    def __init__(self, directory=None, optimize=False):
+        self.directory = directory
+        self.optimize = optimize
+        self.memory = {}
+        self.hits = 0
+        self.misses = 0
+
+        with open(ZZCODE_PATH, 'rb') as f:
+            self.isa_hash = hashlib.sha256(f.read()).digest()
+
+    def key(self, source, section):
+        h = hashlib.sha256()
+        h.update(ASSEMBLER_VERSION)
+        h.update(self.isa_hash)
+        h.update(b'O' if self.optimize else b'-')
+        h.update((section or '').encode() + b'\0')
+        h.update(source)
+        return h.hexdigest()
+
+    def _valid(self, obj):
+        try:
+            return all(sha256_file(f) == h for f, h in obj.depends.items())
+        except OSError:
+            return False
+
+    def _load(self, key):
+        if key in self.memory:
+            return self.memory[key]
+        if not self.directory:
+            return None
+        try:
+            with open(os.path.join(self.directory, key + '.zo'), 'rb') as f:
+                return ObjectFile.from_bytes(f.read())
+        except (OSError, ValueError):
+            return None
+
+    def _store(self, key, obj):
+        self.memory[key] = obj
+        if not self.directory:
+            return
+        os.makedirs(self.directory, exist_ok=True)
+        path = os.path.join(self.directory, key + '.zo')
+        tmp = '%s.%d.tmp' % (path, os.getpid())
+        with open(tmp, 'wb') as f:
+            f.write(obj.to_bytes())
+        os.replace(tmp, path)
+
+    def compile(self, filename, section=None):
+        """
+        return object of filename, assembling it only on cache miss
+        """
+        from .assembler import StreamAssembler
+        from .parser import Parser
+
+        with open(filename, 'rb') as f:
+            source = f.read()
+
+        key = self.key(source, section)
+        obj = self._load(key)
+        if obj is not None and self._valid(obj):
+            self.hits += 1
+            self.memory[key] = obj
+            return obj
+
+        self.misses += 1
+        if self.optimize:
+            parser = Parser(source.decode(), section=section)
+            parser.optimize()
+            obj = parser.to_object()
+        else:
+            obj = StreamAssembler(source.decode(), section=section).to_object()
+        self._store(key, obj)
+        return obj
+
+    def link(self, obj):
+        """
+        link obj with everything it imports, returns the image and the linker
+        """
+        linker = Linker()
+        linker.add_object(obj)
+        for imported in self.load_imports(obj):
+            linker.add_object(imported)
+        return linker.link(), linker
+
+    def load_imports(self, obj):
+        """
+        objects of every file imported by obj, transitively, in import order
+        """
+        seen = set()
+        objects = []
+        queue = list(obj.imports)
+
+        while queue:
+            filename, section = queue.pop(0)
+            if (filename, section) in seen:
+                continue
+            seen.add((filename, section))
+
+            imported = self.compile(filename, section)
+            objects.append(imported)
+            queue.extend(tuple(i) for i in imported.imports)
+
+        return objects
@@ -0,0 +1,124 @@
+"""
+client of `zzvm serve`, runs images on a pool of warm vms
+
+    with ServeClient('/tmp/zzvm.sock') as client:
+        key = client.upload(Parser(open('samples/echo.zasm')).build())
+        output, result = client.run(key, b'hello\\n')
+
+an uploaded image is decoded once and cached by the server under its
+SHA-256, later runs only send that key
+"""
+
+import hashlib
+import socket
+import struct
+
+__all__ = [ 'ServeClient', 'ServeError', 'RunResult' ]
+
+FRAME_IMAGE = b'I'
+FRAME_RUN = b'R'
+FRAME_STATS = b'S'
+FRAME_HASH = b'H'
+FRAME_OUTPUT = b'O'
+FRAME_RESULT = b'X'
+FRAME_ERROR = b'E'
+
+class ServeError(Exception):
+    pass
+
+class RunResult(object):
+    def __init__(self, status, stop_reason, registers):
+        self.status = status
+        self.stop_reason = stop_reason
+        self.registers = registers
+
+    def __repr__(self):
+        return 'RunResult(status=%d, stop_reason=%d, registers=%r)' % (
+            self.status, self.stop_reason, self.registers)
+
+class ServeClient(object):
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+
+    def _send(self, kind, payload):
+        self.sock.sendall(kind + struct.pack('<I', len(payload)) + payload)
+
+    def _recv_exact(self, size):
+        chunks = []
+        while size > 0:
+            chunk = self.sock.recv(size)
+            if not chunk:
+                raise ServeError('connection closed')
+            chunks.append(chunk)
+            size -= len(chunk)
+        return b''.join(chunks)
+
+    def _recv(self):
+        header = self._recv_exact(5)
+        kind, size = header[:1], struct.unpack('<I', header[1:])[0]
+        payload = self._recv_exact(size)
+        if kind == FRAME_ERROR:
+            raise ServeError(payload.decode(errors='replace'))
+        return kind, payload
+
+    def upload(self, image):
+        """
+        send a raw image from Parser.build(), returns its cache key, the
+        SHA-256 of the image
+        """
+        image = bytes(image)
+        self._send(FRAME_IMAGE, image)
+        kind, payload = self._recv()
+        if kind != FRAME_HASH:
+            raise ServeError('unexpected reply %r' % kind)
+        if payload != hashlib.sha256(image).digest():
+            raise ServeError('server returned a key of another image')
+        return payload
+
+    def run_stream(self, key, stdin=b'', limit=0):
+        """
+        run a cached image, yields chunks of guest stdout and finally a
+        RunResult, limit is the instruction budget (0 for none)
+        """
+        self._send(FRAME_RUN, bytes(key) + struct.pack('<Q', limit) + bytes(stdin))
+        while True:
+            kind, payload = self._recv()
+            if kind == FRAME_OUTPUT:
+                yield payload
+            elif kind == FRAME_RESULT:
+                status, stop_reason = struct.unpack('<ii', payload[:8])
+                registers = struct.unpack('<8H', payload[8:24])
+                yield RunResult(status, stop_reason, registers)
+                return
+            else:
+                raise ServeError('unexpected reply %r' % kind)
+
+    def run(self, key, stdin=b'', limit=0):
+        """
+        run a cached image, returns (stdout, RunResult)
+        """
+        output = []
+        for item in self.run_stream(key, stdin, limit):
+            if isinstance(item, RunResult):
+                return b''.join(output), item
+            output.append(item)
+
+    def stats(self):
+        """
+        counters of every job the server finished, as Prometheus text
+        """
+        self._send(FRAME_STATS, b'')
+        kind, payload = self._recv()
+        if kind != FRAME_STATS:
+            raise ServeError('unexpected reply %r' % kind)
+        return payload.decode()
+
+    def close(self):
+        self.sock.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
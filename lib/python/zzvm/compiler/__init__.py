@@ -0,0 +1,31 @@
+"""
+compiler for a small C-like language targeting ZZVM assembly
+
+    int counter;
+    int table[16] = { 1, 2, 3 };
+
+    int sum(int n) {
+        int s = 0;
+        for (; n; n = n - 1)    // counted loop, becomes LOOP
+            s += table[n & 15];
+        return s;
+    }
+
+every value is a 16-bit word, `a[i]` addresses words, `*p` reads a word and
+`peekb`/`pokeb` access single bytes. Builtins that map onto syscalls of the
+default handler: getchar, putchar, write, memcpy, memset, memcmp, strlen,
+xor, malloc, free, realloc, the extended memory calls xmap, xunmap, xseek,
+xread and xwrite, rand and halt. Other calls use the stack convention of zstdlib, so
+`import "zstdlib/stdlib.zasm";` together with `extern int puts(int s);`
+calls into assembly code.
+"""
+
+from .lexer import CompileError
+from .syntax import parse
+from .codegen import Module
+
+def compile_source(source, optimize=True):
+    """
+    compile source text into assembly text for zzassembler
+    """
+    return Module(parse(source), optimize=optimize).compile()
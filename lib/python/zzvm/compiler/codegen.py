@@ -0,0 +1,492 @@
+from .lexer import CompileError
+from .syntax import Function, Global, Extern, Import
+from .transform import fold_function, hoist_invariants
+from .ir import Imm, FunctionBuilder, BUILTINS, uses_defs
+from .regalloc import Slot, allocate
+
+__all__ = [ 'Module' ]
+
+OPS_R = { 'add': 'addr', 'mul': 'mulr', 'and': 'andr', 'or': 'orr', 'xor': 'xorr', 'shr': 'shrr' }
+OPS_I = { 'add': 'addi', 'mul': 'muli', 'and': 'andi', 'or': 'ori', 'xor': 'xori', 'shr': 'shri' }
+BRANCH = { 'e': 'jei', 'n': 'jni', 'gu': 'jgi', 'gs': 'jsgi' }
+BRANCH_C = { 'e': ('jec', 'jnc'), 'n': ('jnc', 'jec') }
+
+# unsigned 16-bit division by shift and subtract
+RUNTIME = '''
+__udiv:
+    ld r1, sp, 2
+    ld r2, sp, 4
+    call $__udivmod
+    ret
+
+__umod:
+    ld r1, sp, 2
+    ld r2, sp, 4
+    call $__udivmod
+    movr ra, r1
+    ret
+
+; r1 / r2, quotient in ra and remainder in r1
+__udivmod:
+    movi r3, 0
+    movi r4, 16
+__udivmod_loop:
+    shri r5, r3, 15     ; bit shifted out of the remainder
+    addr r3, r3, r3
+    shri ra, r1, 15
+    orr r3, r3, ra      ; remainder = remainder << 1 | top bit of dividend
+    addr r1, r1, r1     ; quotient bits enter from the bottom
+    jnc r5, 0, $__udivmod_sub
+    jgi r2, r3, $__udivmod_next
+__udivmod_sub:
+    neg r5, r2
+    addr r3, r3, r5
+    ori r1, r1, 1
+__udivmod_next:
+    loop r4, $__udivmod_loop
+    movr ra, r1
+    movr r1, r3
+    ret'''
+
+def fmt_imm(v):
+    return '%#x' % (v & 0xffff)
+
+class Module(object):
+    """
+    translation unit: functions, globals and the string pool
+    """
+    def __init__(self, items, optimize=True):
+        self.optimize = optimize
+        self.functions = {}
+        self.externs = set()
+        self.globals = {}
+        self.imports = []
+        self.strings = {}
+        self.runtime = False
+
+        for item in items:
+            t = type(item)
+            if t is Function:
+                self.define(self.functions, item)
+            elif t is Global:
+                self.define(self.globals, item)
+            elif t is Extern:
+                self.externs.add(item.name)
+            elif t is Import:
+                self.imports.append(item.path)
+
+        if 'main' not in self.functions:
+            raise CompileError('no main function')
+
+    def define(self, table, item):
+        if item.name in self.functions or item.name in self.globals or \
+                item.name in BUILTINS:
+            raise CompileError('redefinition of %s' % item.name, item.line)
+        table[item.name] = item
+
+    def is_array(self, name):
+        return self.globals[name].array
+
+    def string(self, data):
+        if data not in self.strings:
+            self.strings[data] = '__str_%d' % len(self.strings)
+        return self.strings[data]
+
+    def compile(self):
+        lines = [ '.sect text' ]
+        lines += [ '.import %s' % path for path in self.imports ]
+        lines += [ '', 'start:', '    call $main', '    hlt' ]
+
+        for name in self.functions:
+            func = self.functions[name]
+            if self.optimize:
+                func = hoist_invariants(fold_function(func), self.globals)
+            code = FunctionBuilder(self, func).build()
+            lines.append('')
+            lines += Emitter(name, code).emit()
+
+        if self.runtime:
+            lines += RUNTIME.split('\n')
+        lines += self.data()
+        return '\n'.join(lines) + '\n'
+
+    def data(self):
+        if not self.globals and not self.strings:
+            return []
+
+        lines = [ '', '.sect data' ]
+        for name, g in self.globals.items():
+            lines.append('%s:' % name)
+            if g.init is None:
+                lines.append('    .zero %d' % (g.size * 2))
+                continue
+            if type(g.init) is bytes:
+                raw = g.init
+            else:
+                raw = b''.join(bytes((v & 0xff, v >> 8 & 0xff)) for v in g.init)
+            raw += bytes(g.size * 2 - len(raw))
+            lines.append('    .db ' + ', '.join('%#x' % b for b in raw))
+
+        for data, label in self.strings.items():
+            lines.append('%s:' % label)
+            lines.append('    .db ' + ', '.join('%#x' % b for b in data + b'\0\0'))
+        return lines
+
+class Emitter(object):
+    """
+    turn allocated IR into assembly text
+
+    frame layout, from the stack pointer upwards: saved registers around a
+    call (depth bytes), spill slots, return address, arguments
+    """
+    def __init__(self, name, code):
+        self.name = name
+        self.code = code
+        self.alloc, self.slots, self.scratch, self.live_out = allocate(code)
+        self.depth = 0
+        self.args_in_place()
+        self.items = []
+
+    def emit(self):
+        self.items.append(('label', self.name))
+        if self.slots:
+            self.ins('addi sp, sp, %s' % fmt_imm(-2 * self.slots))
+
+        epilogue = '__%s_ret' % self.name
+        for i, ins in enumerate(self.code):
+            if ins[0] == 'ret':
+                last = all(c[0] == 'label' for c in self.code[i + 1:])
+                self.ret(ins[1], None if last else epilogue)
+            else:
+                getattr(self, 'ir_' + ins[0])(i, *ins[1:])
+
+        self.items.append(('label', epilogue))
+        if self.slots:
+            self.ins('addi sp, sp, %s' % fmt_imm(2 * self.slots))
+        self.ins('ret')
+        return self.layout()
+
+    def args_in_place(self):
+        """
+        a spilled parameter that is never reassigned is read from the
+        caller's argument slot, remaining slots are renumbered
+        """
+        defs = {}
+        for ins in self.code:
+            for v in uses_defs(ins)[1]:
+                defs[v] = defs.get(v, 0) + 1
+
+        for ins in self.code:
+            if ins[0] == 'ldarg' and type(self.alloc[ins[1]]) is Slot and \
+                    defs[ins[1]] == 1:
+                self.alloc[ins[1]] = Slot(None, ins[2])
+
+        used = sorted({ loc.index for loc in self.alloc.values()
+                        if type(loc) is Slot and loc.arg is None })
+        renumber = { old: new for new, old in enumerate(used) }
+        for v, loc in self.alloc.items():
+            if type(loc) is Slot and loc.arg is None:
+                loc.index = renumber[loc.index]
+        self.slots = len(used)
+
+    # ---- helpers ----
+
+    def ins(self, text):
+        self.items.append(('ins', text))
+
+    def slot_offset(self, slot):
+        if slot.arg is not None:
+            return fmt_imm(self.depth + 2 * self.slots + 2 + 2 * slot.arg)
+        return fmt_imm(self.depth + 2 * slot.index)
+
+    def src(self, v, n=0):
+        """
+        register holding v, spilled values are loaded into scratch n
+        """
+        loc = self.alloc[v]
+        if type(loc) is Slot:
+            reg = self.scratch[n]
+            self.ins('ld %s, sp, %s' % (reg, self.slot_offset(loc)))
+            return reg
+        return loc
+
+    def dst(self, v):
+        loc = self.alloc[v]
+        return self.scratch[0] if type(loc) is Slot else loc
+
+    def writeback(self, v, reg):
+        loc = self.alloc[v]
+        if type(loc) is Slot:
+            self.ins('st %s, sp, %s' % (reg, self.slot_offset(loc)))
+        elif loc != reg:
+            self.ins('movr %s, %s' % (loc, reg))
+
+    def result(self, i, d):
+        # value returned in RA, dropped when nobody reads it
+        if d in self.live_out[i]:
+            self.writeback(d, 'ra')
+
+    def load_into(self, reg, operand):
+        if type(operand) is Imm:
+            self.ins('movi %s, %s' % (reg, fmt_imm(operand.value)))
+            return
+        loc = self.alloc[operand]
+        if type(loc) is Slot:
+            self.ins('ld %s, sp, %s' % (reg, self.slot_offset(loc)))
+        elif loc != reg:
+            self.ins('movr %s, %s' % (reg, loc))
+
+    def live_regs(self, i, exclude):
+        regs = []
+        for v in sorted(self.live_out[i]):
+            loc = self.alloc[v]
+            if v != exclude and type(loc) is not Slot and loc not in regs:
+                regs.append(loc)
+        return regs
+
+    def save(self, regs):
+        for r in regs:
+            self.ins('push %s' % r)
+            self.depth += 2
+
+    def restore(self, regs):
+        for r in reversed(regs):
+            self.ins('pop %s' % r)
+            self.depth -= 2
+
+    def imm(self, value):
+        if type(value) is str:
+            return value
+        return fmt_imm(value)
+
+    # ---- IR instructions ----
+
+    def ir_label(self, i, name):
+        self.items.append(('label', name))
+
+    def ir_jmp(self, i, label):
+        self.ins('jmp $%s' % label)
+
+    def ir_li(self, i, d, value):
+        reg = self.dst(d)
+        self.ins('movi %s, %s' % (reg, fmt_imm(value)))
+        self.writeback(d, reg)
+
+    def ir_la(self, i, d, name, offset):
+        reg = self.dst(d)
+        self.ins('movi %s, $%s' % (reg, name + ('+%d' % offset if offset else '')))
+        self.writeback(d, reg)
+
+    def ir_mov(self, i, d, s):
+        loc = self.alloc[d]
+        if type(loc) is Slot:
+            self.writeback(d, self.src(s))
+        else:
+            self.load_into(loc, s)
+
+    def ir_op(self, i, op, d, a, b):
+        ra, rb = self.src(a, 0), self.src(b, 1)
+        reg = self.dst(d)
+        self.ins('%s %s, %s, %s' % (OPS_R[op], reg, ra, rb))
+        self.writeback(d, reg)
+
+    def ir_opi(self, i, op, d, a, value):
+        ra = self.src(a)
+        reg = self.dst(d)
+        self.ins('%s %s, %s, %s' % (OPS_I[op], reg, ra, fmt_imm(value)))
+        self.writeback(d, reg)
+
+    def ir_neg(self, i, d, a):
+        ra = self.src(a)
+        reg = self.dst(d)
+        self.ins('neg %s, %s' % (reg, ra))
+        self.writeback(d, reg)
+
+    def ir_not(self, i, d, a):
+        ra = self.src(a)
+        reg = self.dst(d)
+        self.ins('not %s, %s' % (reg, ra))
+        self.writeback(d, reg)
+
+    def ir_ld(self, i, d, base, offset):
+        rb = self.src(base)
+        reg = self.dst(d)
+        self.ins('ld %s, %s, %s' % (reg, rb, self.imm(offset)))
+        self.writeback(d, reg)
+
+    def ir_ldr(self, i, d, base, index):
+        rb, ri = self.src(base, 0), self.src(index, 1)
+        reg = self.dst(d)
+        self.ins('ldr %s, %s, %s' % (reg, rb, ri))
+        self.writeback(d, reg)
+
+    def ir_st(self, i, s, base, offset):
+        rs, rb = self.src(s, 0), self.src(base, 1)
+        self.ins('st %s, %s, %s' % (rs, rb, self.imm(offset)))
+
+    def ir_str(self, i, s, base, index):
+        spilled = [ v for v in (s, base, index) if type(self.alloc[v]) is Slot ]
+        if len(spilled) <= 2:
+            n = iter(range(2))
+            regs = [ self.src(v, next(n)) if v in spilled else self.alloc[v]
+                     for v in (s, base, index) ]
+            self.ins('str %s, %s, %s' % tuple(regs))
+            return
+        a, b = self.scratch
+        self.src(base, 0)
+        self.src(index, 1)
+        self.ins('addr %s, %s, %s' % (a, a, b))
+        self.src(s, 1)
+        self.ins('st %s, %s, 0' % (b, a))
+
+    def ir_br(self, i, cc, a, b, label):
+        ra, rb = self.src(a, 0), self.src(b, 1)
+        self.ins('%s %s, %s, $%s' % (BRANCH[cc], ra, rb, label))
+
+    def ir_brz(self, i, a, label):
+        self.ins('jzi %s, $%s' % (self.src(a), label))
+
+    def ir_brc(self, i, cc, a, const, label):
+        self.items.append(('brc', BRANCH_C[cc], self.src(a), const, label))
+
+    def ir_loop(self, i, v, label):
+        loc = self.alloc[v]
+        if type(loc) is not Slot:
+            self.ins('loop %s, $%s' % (loc, label))
+            return
+        reg = self.src(v)
+        self.ins('addi %s, %s, 0xffff' % (reg, reg))
+        self.writeback(v, reg)
+        self.items.append(('brc', BRANCH_C['n'], reg, 0, label))
+
+    def ir_ldarg(self, i, d, index):
+        if type(self.alloc[d]) is Slot and self.alloc[d].arg is not None:
+            return
+        reg = self.dst(d)
+        offset = self.depth + 2 * self.slots + 2 + 2 * index
+        self.ins('ld %s, sp, %s' % (reg, fmt_imm(offset)))
+        self.writeback(d, reg)
+
+    def ir_halt(self, i):
+        self.ins('hlt')
+
+    def ir_rand(self, i, d):
+        saved = [ r for r in self.live_regs(i, d) if r == 'ra' ]
+        self.save(saved)
+        self.ins('rand')
+        self.result(i, d)
+        self.restore(saved)
+
+    def ir_call(self, i, d, name, args):
+        saved = self.live_regs(i, d)
+        self.save(saved)
+        for arg in reversed(args):
+            if type(arg) is Imm:
+                self.ins('pusi %s' % fmt_imm(arg.value))
+            else:
+                self.ins('push %s' % self.src(arg))
+            self.depth += 2
+        self.ins('call $%s' % name)
+        if args:
+            self.ins('addi sp, sp, %s' % fmt_imm(2 * len(args)))
+            self.depth -= 2 * len(args)
+        self.result(i, d)
+        self.restore(saved)
+
+    def ir_sys(self, i, d, number, args):
+        targets = [ 'r1', 'r2', 'r3' ][:len(args)]
+        clobbered = set(targets) | { 'ra' }
+        saved = [ r for r in self.live_regs(i, d) if r in clobbered ]
+        self.save(saved)
+        self.parallel_move(list(zip(targets, args)))
+        self.ins('movi ra, %s' % fmt_imm(number))
+        self.ins('sys')
+        self.result(i, d)
+        self.restore(saved)
+
+    def ret(self, value, epilogue):
+        if value is not None:
+            self.load_into('ra', value)
+        if epilogue:
+            self.ins('jmp $%s' % epilogue)
+
+    def parallel_move(self, moves):
+        """
+        load operands into target registers without clobbering a source
+        that is still needed
+        """
+        def source(operand):
+            if type(operand) is Imm:
+                return None
+            loc = self.alloc[operand]
+            return None if type(loc) is Slot else loc
+
+        pending = [ (t, v) for t, v in moves if source(v) != t ]
+        while pending:
+            blocked = { source(v) for _, v in pending }
+            for k, (t, v) in enumerate(pending):
+                if t not in blocked:
+                    self.load_into(t, v)
+                    del pending[k]
+                    break
+            else:
+                # cycle between registers, rotate through the stack
+                t, v = pending.pop(0)
+                self.ins('push %s' % source(v))
+                self.depth += 2
+                self.parallel_move(pending)
+                self.ins('pop %s' % t)
+                self.depth -= 2
+                return
+
+    # ---- output ----
+
+    def layout(self):
+        """
+        C-type branches reach 127 instructions, longer ones are split into an
+        inverted branch over a jmp
+        """
+        far = set()
+        while True:
+            pos, labels = 0, {}
+            for k, item in enumerate(self.items):
+                if item[0] == 'label':
+                    labels[item[1]] = pos
+                else:
+                    pos += 2 if k in far else 1
+            grown = False
+            pos = 0
+            for k, item in enumerate(self.items):
+                if item[0] == 'label':
+                    continue
+                if item[0] == 'brc' and k not in far:
+                    rel = labels[item[4]] - (pos + 1)
+                    if not -128 <= rel <= 127:
+                        far.add(k)
+                        grown = True
+                pos += 2 if k in far else 1
+            if not grown:
+                break
+
+        lines = []
+        skips = 0
+        for k, item in enumerate(self.items):
+            nxt = self.items[k + 1] if k + 1 < len(self.items) else None
+            if item[0] == 'ins' and nxt and nxt[0] == 'label' and \
+                    item[1] == 'jmp $%s' % nxt[1]:
+                continue
+            if item[0] == 'label':
+                lines.append('%s:' % item[1])
+            elif item[0] == 'ins':
+                lines.append('    ' + item[1])
+            elif k in far:
+                (_, inverse), reg, const = item[1], item[2], item[3]
+                skips += 1
+                skip = '__%s_far%d' % (self.name, skips)
+                lines.append('    %s %s, %d, $%s' % (inverse, reg, const, skip))
+                lines.append('    jmp $%s' % item[4])
+                lines.append('%s:' % skip)
+            else:
+                (branch, _), reg, const = item[1], item[2], item[3]
+                lines.append('    %s %s, %d, $%s' % (branch, reg, const, item[4]))
+        return lines
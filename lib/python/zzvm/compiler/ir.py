@@ -0,0 +1,588 @@
+from .lexer import CompileError
+from .syntax import *
+from .transform import to_signed
+
+__all__ = [ 'Imm', 'FunctionBuilder', 'BUILTINS', 'uses_defs', 'successors' ]
+
+class Imm(object):
+    def __init__(self, value):
+        self.value = value & 0xffff
+
+    def __repr__(self):
+        return 'Imm(%#x)' % self.value
+
+# builtin name: (syscall number of default handler, argument count)
+SYSCALLS = {
+    'getchar': (0, 0),
+    'putchar': (1, 1),
+    'write':   (2, 2),
+    'memcpy':  (3, 3),
+    'memset':  (4, 3),
+    'memcmp':  (5, 3),
+    'strlen':  (6, 1),
+    'xor':     (7, 3),
+    'malloc':  (8, 1),
+    'free':    (9, 1),
+    'realloc': (10, 2),
+    'xmap':    (11, 3),
+    'xunmap':  (12, 1),
+    'xseek':   (13, 3),
+    'xread':   (14, 2),
+    'xwrite':  (15, 2),
+}
+
+BUILTINS = set(SYSCALLS) | { 'peekb', 'pokeb', 'halt', 'rand' }
+
+ALU = { '+': 'add', '*': 'mul', '&': 'and', '|': 'or', '^': 'xor' }
+INVERT = { '==': '!=', '!=': '==', '<': '>=', '>=': '<', '>': '<=', '<=': '>' }
+MIRROR = { '==': '==', '!=': '!=', '<': '>', '>': '<', '<=': '>=', '>=': '<=' }
+
+def is_int8(v):
+    return -128 <= to_signed(v) <= 127
+
+def is_decrement(stmt, name):
+    """
+    `name = name - 1` after folding
+    """
+    if type(stmt) is not ExprStmt or type(stmt.expr) is not Assign:
+        return False
+    target, value = stmt.expr.target, stmt.expr.value
+    return (type(target) is Var and target.name == name and
+            type(value) is Binary and value.op == '+' and
+            type(value.left) is Var and value.left.name == name and
+            type(value.right) is Num and value.right.value == 0xffff)
+
+def counter_of(cond):
+    """
+    variable tested by `v` or `v != 0`
+    """
+    if type(cond) is Var:
+        return cond.name
+    if type(cond) is Binary and cond.op == '!=' and type(cond.left) is Var and \
+            type(cond.right) is Num and cond.right.value == 0:
+        return cond.left.name
+
+def has_continue(stmt):
+    t = type(stmt)
+    if t is Continue:
+        return True
+    if t is Block:
+        return any(has_continue(s) for s in stmt.stmts)
+    if t is If:
+        return has_continue(stmt.then) or (stmt.otherwise is not None and
+                                           has_continue(stmt.otherwise))
+    return False
+
+class FunctionBuilder(object):
+    """
+    lower a function into a linear IR over virtual registers
+
+    every IR instruction is a tuple, the first item names the operation
+    """
+    def __init__(self, module, func):
+        self.module = module
+        self.func = func
+        self.code = []
+        self.locals = {}
+        self.nvregs = 0
+        self.nlabels = 0
+        self.loops = []
+        self.consts = []
+
+    def new_vreg(self):
+        self.nvregs += 1
+        return self.nvregs - 1
+
+    def new_label(self):
+        self.nlabels += 1
+        return '__%s_%d' % (self.func.name, self.nlabels)
+
+    def emit(self, *ins):
+        self.code.append(ins)
+
+    def build(self):
+        for i, name in enumerate(self.func.params):
+            v = self.local(name)
+            self.emit('ldarg', v, i)
+        self.stmt(self.func.body)
+        self.emit('ret', None)
+        return self.code
+
+    def local(self, name, line=None):
+        if name not in self.locals:
+            self.locals[name] = self.new_vreg()
+        return self.locals[name]
+
+    # ---- statements ----
+
+    def stmt(self, s):
+        t = type(s)
+        if t is Block:
+            for child in s.stmts:
+                self.stmt(child)
+        elif t is Decl:
+            v = self.local(s.name)
+            if s.init is not None:
+                self.expr(s.init, v)
+        elif t is ExprStmt:
+            self.expr(s.expr)
+        elif t is If and s.otherwise is None and type(s.then) in (Break, Continue) \
+                and self.loops:
+            # `if (c) break;` jumps straight out
+            exit_ = self.loops[-1][0 if type(s.then) is Break else 1]
+            self.cjump(s.cond, exit_, True)
+        elif t is If:
+            l_else, l_end = self.new_label(), self.new_label()
+            self.cjump(s.cond, l_else, False)
+            self.stmt(s.then)
+            if s.otherwise is not None:
+                self.emit('jmp', l_end)
+                self.emit('label', l_else)
+                self.stmt(s.otherwise)
+                self.emit('label', l_end)
+            else:
+                self.emit('label', l_else)
+        elif t is While:
+            self.loop(s.cond, None, s.body, s.line)
+        elif t is For:
+            if s.init is not None:
+                self.stmt(s.init)
+            self.loop(s.cond, s.step, s.body, s.line)
+        elif t is Return:
+            self.emit('ret', self.expr(s.value) if s.value is not None else None)
+        elif t is Break:
+            if not self.loops:
+                raise CompileError('break outside loop', s.line)
+            self.emit('jmp', self.loops[-1][0])
+        elif t is Continue:
+            if not self.loops:
+                raise CompileError('continue outside loop', s.line)
+            self.emit('jmp', self.loops[-1][1])
+        else:
+            raise CompileError('unsupported statement %r' % s, s.line)
+
+    def loop(self, cond, step, body, line):
+        l_body, l_cont, l_end = self.new_label(), self.new_label(), self.new_label()
+
+        # counted loop: `for (...; v; v = v - 1)` or a while loop ending
+        # with the decrement becomes a single LOOP instruction
+        name = counter_of(cond) if cond is not None else None
+        if name is not None and name in self.locals:
+            if step is None and type(body) is Block and body.stmts and \
+                    is_decrement(body.stmts[-1], name) and not has_continue(body):
+                body = Block(body.stmts[:-1], line=body.line)
+                counted = True
+            else:
+                counted = step is not None and is_decrement(step, name)
+
+            if counted:
+                v = self.locals[name]
+                if not self.known_nonzero(v):
+                    self.emit('brz', v, l_end)
+                self.emit('label', l_body)
+                self.loops.append((l_end, l_cont))
+                self.stmt(body)
+                self.loops.pop()
+                self.emit('label', l_cont)
+                self.emit('loop', v, l_body)
+                self.emit('label', l_end)
+                return
+
+        l_cond = self.new_label()
+        forever = cond is None or (type(cond) is Num and cond.value)
+        consts = {}
+        if not forever:
+            # constant operand of the exit test is loaded once
+            if type(cond) is Binary and cond.op in INVERT and \
+                    type(cond.right) is Num and cond.right.value != 0 and \
+                    not (cond.op in ('==', '!=') and is_int8(cond.right.value)):
+                value = cond.right.value
+                consts[value] = self.new_vreg()
+                self.emit('li', consts[value], value)
+            self.emit('jmp', l_cond)
+        self.emit('label', l_body)
+        self.loops.append((l_end, l_cont))
+        self.stmt(body)
+        self.loops.pop()
+        self.emit('label', l_cont)
+        if step is not None:
+            self.stmt(step)
+        self.emit('label', l_cond)
+        if forever:
+            self.emit('jmp', l_body)
+        else:
+            self.consts.append(consts)
+            self.cjump(cond, l_body, True)
+            self.consts.pop()
+        self.emit('label', l_end)
+
+    def known_nonzero(self, v):
+        # v was set to a non-zero constant since the last control transfer
+        for ins in reversed(self.code):
+            if ins[0] in ('label', 'jmp', 'br', 'brz', 'brc', 'loop', 'ret'):
+                return False
+            if v in uses_defs(ins)[1]:
+                return ins[0] == 'li' and ins[2] != 0
+        return False
+
+    # ---- conditions ----
+
+    def cjump(self, e, label, when):
+        """
+        jump to label if truth value of e equals when
+        """
+        t = type(e)
+        if t is Num:
+            if bool(e.value) == when:
+                self.emit('jmp', label)
+        elif t is Unary and e.op == '!':
+            self.cjump(e.operand, label, not when)
+        elif t is Logical:
+            if (e.op == '&&') == when:
+                skip = self.new_label()
+                self.cjump(e.left, skip, not when)
+                self.cjump(e.right, label, when)
+                self.emit('label', skip)
+            else:
+                self.cjump(e.left, label, when)
+                self.cjump(e.right, label, when)
+        elif t is Binary and e.op in INVERT:
+            op = e.op if when else INVERT[e.op]
+            self.compare_jump(op, e.left, e.right, label)
+        else:
+            v = self.reg(self.expr(e))
+            if when:
+                self.emit('brc', 'n', v, 0, label)
+            else:
+                self.emit('brz', v, label)
+
+    def compare_jump(self, op, left, right, label):
+        a, b = self.expr(left), self.expr(right)
+        if type(a) is Imm and type(b) is not Imm:
+            a, b, op = b, a, MIRROR[op]
+        if type(a) is Imm:
+            a = self.reg(a)
+
+        if op in ('==', '!='):
+            cc = 'e' if op == '==' else 'n'
+            if type(b) is Imm and b.value == 0 and op == '==':
+                self.emit('brz', a, label)
+            elif type(b) is Imm and is_int8(b.value):
+                self.emit('brc', cc, a, to_signed(b.value), label)
+            else:
+                self.emit('br', cc, a, self.reg(b), label)
+        elif op == '>':
+            self.emit('br', 'gs', a, self.reg(b), label)
+        elif op == '<':
+            self.emit('br', 'gs', self.reg(b), a, label)
+        elif op == '>=' and type(b) is Imm and to_signed(b.value) > -0x8000:
+            self.emit('br', 'gs', a, self.reg(Imm(b.value - 1)), label)
+        elif op == '<=' and type(b) is Imm and to_signed(b.value) < 0x7fff:
+            self.emit('br', 'gs', self.reg(Imm(b.value + 1)), a, label)
+        else:
+            # a >= b is !(b > a), a <= b is !(a > b)
+            skip = self.new_label()
+            if op == '>=':
+                self.emit('br', 'gs', self.reg(b), a, skip)
+            else:
+                self.emit('br', 'gs', a, self.reg(b), skip)
+            self.emit('jmp', label)
+            self.emit('label', skip)
+
+    # ---- expressions ----
+
+    def reg(self, operand):
+        if type(operand) is Imm:
+            if self.consts and operand.value in self.consts[-1]:
+                return self.consts[-1][operand.value]
+            v = self.new_vreg()
+            self.emit('li', v, operand.value)
+            return v
+        return operand
+
+    def target(self, dst):
+        return self.new_vreg() if dst is None else dst
+
+    def move(self, operand, dst):
+        if dst is None:
+            return operand
+        if type(operand) is Imm:
+            self.emit('li', dst, operand.value)
+        elif operand != dst:
+            self.emit('mov', dst, operand)
+        return dst
+
+    def expr(self, e, dst=None):
+        """
+        generate e, the result is an Imm or a vreg (dst if given)
+        """
+        t = type(e)
+        m = self.module
+
+        if t is Num:
+            return self.move(Imm(e.value), dst)
+
+        if t is Str:
+            d = self.target(dst)
+            self.emit('la', d, m.string(e.data), 0)
+            return d
+
+        if t is Var:
+            if e.name in self.locals:
+                return self.move(self.locals[e.name], dst)
+            if e.name not in m.globals:
+                raise CompileError('undefined variable %s' % e.name, e.line)
+            d = self.target(dst)
+            self.emit('la', d, e.name, 0)
+            if not m.is_array(e.name):
+                self.emit('ld', d, d, 0)
+            return d
+
+        if t is AddrOf:
+            if e.name not in m.globals and e.name not in m.functions:
+                raise CompileError('can not take address of %s' % e.name, e.line)
+            d = self.target(dst)
+            self.emit('la', d, e.name, 0)
+            return d
+
+        if t in (Index, Deref):
+            base, offset, index = self.address(e)
+            d = self.target(dst)
+            if index is None:
+                self.emit('ld', d, base, offset)
+            else:
+                self.emit('ldr', d, base, index)
+            return d
+
+        if t is Assign:
+            return self.assign(e, dst)
+
+        if t is Unary:
+            if e.op == '!':
+                return self.condition_value(e, dst)
+            a = self.reg(self.expr(e.operand))
+            d = self.target(dst)
+            self.emit('neg' if e.op == '-' else 'not', d, a)
+            return d
+
+        if t is Binary:
+            if e.op in INVERT:
+                return self.condition_value(e, dst)
+            return self.binary(e, dst)
+
+        if t is Logical:
+            return self.condition_value(e, dst)
+
+        if t is Call:
+            return self.call(e, dst)
+
+        raise CompileError('unsupported expression %r' % e, e.line)
+
+    def condition_value(self, e, dst):
+        # dst may be read by e, build the value in a temporary
+        v = self.new_vreg()
+        done = self.new_label()
+        self.emit('li', v, 1)
+        self.cjump(e, done, True)
+        self.emit('li', v, 0)
+        self.emit('label', done)
+        return self.move(v, dst)
+
+    def binary(self, e, dst):
+        op = e.op
+        a, b = self.expr(e.left), self.expr(e.right)
+
+        if type(a) is Imm and op in ALU:
+            a, b = b, a
+        a = self.reg(a)
+
+        if op in ('/', '%'):
+            # no divide instruction, call the runtime routine
+            self.module.runtime = True
+            d = self.target(dst)
+            self.emit('call', d, '__udiv' if op == '/' else '__umod', [a, b])
+            return d
+
+        if op in ALU:
+            d = self.target(dst)
+            if type(b) is Imm:
+                self.emit('opi', ALU[op], d, a, b.value)
+            else:
+                self.emit('op', ALU[op], d, a, b)
+            return d
+
+        if op == '-':
+            if type(b) is Imm:
+                d = self.target(dst)
+                self.emit('opi', 'add', d, a, -b.value)
+                return d
+            n = self.new_vreg()
+            self.emit('neg', n, b)
+            d = self.target(dst)
+            self.emit('op', 'add', d, a, n)
+            return d
+
+        if op in ('<<', '>>'):
+            if type(b) is Imm:
+                d = self.target(dst)
+                self.emit('opi', 'shr', d, a, b.value if op == '>>' else -b.value)
+                return d
+            if op == '<<':
+                n = self.new_vreg()
+                self.emit('neg', n, b)
+                b = n
+            d = self.target(dst)
+            self.emit('op', 'shr', d, a, b)
+            return d
+
+        raise CompileError('unsupported operator %s' % op, e.line)
+
+    def address(self, e):
+        """
+        returns (base vreg, offset, index vreg), offset is an int or a label
+        and only used when there is no index
+        """
+        m = self.module
+        if type(e) is Index:
+            base = e.base
+            index = self.expr(e.index)
+            # global array indexed by a register: ld d, index * 2, $array
+            if type(base) is Var and base.name not in self.locals and \
+                    m.is_array(base.name) and type(index) is not Imm:
+                scaled = self.new_vreg()
+                self.emit('op', 'add', scaled, index, index)
+                return scaled, '$%s' % base.name, None
+            b = self.reg(self.expr(base))
+            if type(index) is Imm:
+                return b, (index.value * 2) & 0xffff, None
+            scaled = self.new_vreg()
+            self.emit('op', 'add', scaled, index, index)
+            return b, 0, scaled
+
+        addr = e.addr
+        if type(addr) is Binary and addr.op == '+':
+            left, right = self.expr(addr.left), self.expr(addr.right)
+            if type(left) is Imm:
+                left, right = right, left
+            left = self.reg(left)
+            if type(right) is Imm:
+                return left, right.value, None
+            return left, 0, right
+        return self.reg(self.expr(addr)), 0, None
+
+    def assign(self, e, dst):
+        target = e.target
+        m = self.module
+
+        if type(target) is Var:
+            if target.name in self.locals:
+                v = self.locals[target.name]
+                self.expr(e.value, v)
+                return self.move(v, dst)
+            if target.name not in m.globals or m.is_array(target.name):
+                raise CompileError('can not assign to %s' % target.name, e.line)
+            value = self.reg(self.expr(e.value))
+            addr = self.new_vreg()
+            self.emit('la', addr, target.name, 0)
+            self.emit('st', value, addr, 0)
+            return self.move(value, dst)
+
+        base, offset, index = self.address(target)
+        value = self.reg(self.expr(e.value))
+        if index is None:
+            self.emit('st', value, base, offset)
+        else:
+            self.emit('str', value, base, index)
+        return self.move(value, dst)
+
+    def call(self, e, dst):
+        name = e.name
+        args = [ self.expr(a) for a in e.args ]
+
+        if name in SYSCALLS:
+            number, argc = SYSCALLS[name]
+            if len(args) != argc:
+                raise CompileError('%s expects %d arguments' % (name, argc), e.line)
+            d = self.target(dst)
+            self.emit('sys', d, number, args)
+            return d
+
+        if name == 'rand':
+            d = self.target(dst)
+            self.emit('rand', d)
+            return d
+
+        if name == 'halt':
+            self.emit('halt')
+            return Imm(0)
+
+        if name == 'peekb':
+            d = self.target(dst)
+            self.emit('ld', d, self.reg(args[0]), 0)
+            self.emit('opi', 'and', d, d, 0xff)
+            return d
+
+        if name == 'pokeb':
+            addr, value = self.reg(args[0]), self.reg(args[1])
+            word, low = self.new_vreg(), self.new_vreg()
+            self.emit('ld', word, addr, 0)
+            self.emit('opi', 'and', word, word, 0xff00)
+            self.emit('opi', 'and', low, value, 0xff)
+            self.emit('op', 'or', word, word, low)
+            self.emit('st', word, addr, 0)
+            return self.move(value, dst)
+
+        if name in self.module.functions:
+            expected = len(self.module.functions[name].params)
+            if expected != len(args):
+                raise CompileError('%s expects %d arguments' % (name, expected), e.line)
+        d = self.target(dst)
+        self.emit('call', d, name, args)
+        return d
+
+def uses_defs(ins):
+    """
+    returns (used vregs, defined vregs) of an IR instruction
+    """
+    op = ins[0]
+    regs = lambda items: [ i for i in items if type(i) is int ]
+    if op in ('li', 'la', 'ldarg', 'rand'):
+        return [], [ins[1]]
+    if op in ('mov', 'neg', 'not'):
+        return regs([ins[2]]), [ins[1]]
+    if op == 'op':
+        return [ins[3], ins[4]], [ins[2]]
+    if op == 'opi':
+        return [ins[3]], [ins[2]]
+    if op == 'ld':
+        return [ins[2]], [ins[1]]
+    if op == 'ldr':
+        return [ins[2], ins[3]], [ins[1]]
+    if op == 'st':
+        return [ins[1], ins[2]], []
+    if op == 'str':
+        return [ins[1], ins[2], ins[3]], []
+    if op == 'br':
+        return [ins[2], ins[3]], []
+    if op in ('brz',):
+        return [ins[1]], []
+    if op == 'brc':
+        return [ins[2]], []
+    if op == 'loop':
+        return [ins[1]], [ins[1]]
+    if op in ('call', 'sys'):
+        return regs(ins[3]), [ins[1]]
+    if op == 'ret':
+        return regs([ins[1]]), []
+    return [], []
+
+def successors(code, i, labels):
+    op = code[i][0]
+    if op == 'jmp':
+        return [labels[code[i][1]]]
+    if op in ('ret', 'halt'):
+        return []
+    nxt = [i + 1] if i + 1 < len(code) else []
+    if op in ('br', 'brz', 'brc', 'loop'):
+        return nxt + [labels[code[i][-1]]]
+    return nxt
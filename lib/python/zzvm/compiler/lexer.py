@@ -0,0 +1,94 @@
+import re
+
+__all__ = [ 'Token', 'tokenize', 'CompileError' ]
+
+class CompileError(Exception):
+    def __init__(self, msg, line=None):
+        if line is not None:
+            msg = 'line %d: %s' % (line, msg)
+        super().__init__(msg)
+
+class Token(object):
+    def __init__(self, kind, value, line):
+        self.kind = kind
+        self.value = value
+        self.line = line
+
+    def __repr__(self):
+        return 'Token(%r, %r, line=%d)' % (self.kind, self.value, self.line)
+
+KEYWORDS = {
+    'int', 'if', 'else', 'while', 'for', 'return', 'break', 'continue',
+    'extern', 'import',
+}
+
+PUNCTUATORS = [
+    '<<=', '>>=',
+    '==', '!=', '<=', '>=', '&&', '||', '<<', '>>', '++', '--',
+    '+=', '-=', '*=', '&=', '|=', '^=',
+    '+', '-', '*', '/', '%', '&', '|', '^', '~', '!', '<', '>', '=',
+    '(', ')', '{', '}', '[', ']', ',', ';',
+]
+
+TOKEN_RE = re.compile(r'''
+    (?P<space>[ \t\r]+)
+  | (?P<newline>\n)
+  | (?P<comment>//[^\n]*|/\*.*?\*/)
+  | (?P<number>0[xX][0-9a-fA-F]+|[0-9]+)
+  | (?P<char>'(?:\\.|[^\\'])')
+  | (?P<string>"(?:\\.|[^\\"])*")
+  | (?P<ident>[A-Za-z_][A-Za-z0-9_]*)
+  | (?P<punct>%s)
+''' % '|'.join(re.escape(p) for p in PUNCTUATORS), re.VERBOSE | re.DOTALL)
+
+ESCAPES = { 'n': 10, 't': 9, 'r': 13, '0': 0, '\\': 92, '\'': 39, '"': 34 }
+
+def unescape(body, line):
+    out = bytearray()
+    i = 0
+    while i < len(body):
+        c = body[i]
+        if c != '\\':
+            out += c.encode()
+            i += 1
+            continue
+        esc = body[i + 1]
+        if esc == 'x':
+            out.append(int(body[i + 2:i + 4], 16))
+            i += 4
+        elif esc in ESCAPES:
+            out.append(ESCAPES[esc])
+            i += 2
+        else:
+            raise CompileError('unknown escape \\%s' % esc, line)
+    return bytes(out)
+
+def tokenize(source):
+    tokens = []
+    line = 1
+    pos = 0
+    while pos < len(source):
+        m = TOKEN_RE.match(source, pos)
+        if not m:
+            raise CompileError('unexpected character %r' % source[pos], line)
+        kind = m.lastgroup
+        text = m.group()
+        pos = m.end()
+
+        if kind == 'newline':
+            line += 1
+        elif kind == 'comment':
+            line += text.count('\n')
+        elif kind == 'number':
+            tokens.append(Token('num', int(text, 0), line))
+        elif kind == 'char':
+            tokens.append(Token('num', unescape(text[1:-1], line)[0], line))
+        elif kind == 'string':
+            tokens.append(Token('str', unescape(text[1:-1], line), line))
+        elif kind == 'ident':
+            tokens.append(Token('kw' if text in KEYWORDS else 'ident', text, line))
+        elif kind == 'punct':
+            tokens.append(Token(text, text, line))
+
+    tokens.append(Token('eof', None, line))
+    return tokens
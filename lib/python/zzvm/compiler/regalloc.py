@@ -0,0 +1,123 @@
+from .ir import uses_defs, successors
+
+__all__ = [ 'REGISTERS', 'Slot', 'liveness', 'allocate' ]
+
+REGISTERS = [ 'r1', 'r2', 'r3', 'r4', 'r5', 'ra' ]
+SCRATCH = [ 'r4', 'r5' ]
+
+class Slot(object):
+    """
+    spilled virtual register, lives in the stack frame
+    """
+    def __init__(self, index, arg=None):
+        self.index = index
+        self.arg = arg  # spilled parameter stays in its argument slot
+
+    def __repr__(self):
+        return 'Slot(%d)' % self.index
+
+def label_map(code):
+    return { ins[1]: i for i, ins in enumerate(code) if ins[0] == 'label' }
+
+def liveness(code):
+    """
+    returns live-out sets for each instruction
+    """
+    labels = label_map(code)
+    info = [ uses_defs(ins) for ins in code ]
+    succ = [ successors(code, i, labels) for i in range(len(code)) ]
+    live_in = [ set() for _ in code ]
+    live_out = [ set() for _ in code ]
+
+    changed = True
+    while changed:
+        changed = False
+        for i in reversed(range(len(code))):
+            out = set()
+            for s in succ[i]:
+                out |= live_in[s]
+            uses, defs = info[i]
+            new_in = (out - set(defs)) | set(uses)
+            if out != live_out[i] or new_in != live_in[i]:
+                live_out[i], live_in[i] = out, new_in
+                changed = True
+    return live_in, live_out
+
+def intervals(code, live_in, live_out):
+    ranges = {}
+    def extend(v, i):
+        lo, hi = ranges.get(v, (i, i))
+        ranges[v] = (min(lo, i), max(hi, i))
+    for i, ins in enumerate(code):
+        uses, defs = uses_defs(ins)
+        for v in uses + defs:
+            extend(v, i)
+        for v in live_in[i] | live_out[i]:
+            extend(v, i)
+    return ranges
+
+def hints(code):
+    """
+    preferred registers: results of calls and syscalls arrive in RA,
+    syscall arguments are passed in R1-R3
+    """
+    prefer = {}
+    for ins in code:
+        if ins[0] in ('call', 'sys', 'rand'):
+            prefer.setdefault(ins[1], 'ra')
+        if ins[0] == 'sys':
+            for reg, arg in zip(('r1', 'r2', 'r3'), ins[3]):
+                if type(arg) is int:
+                    prefer.setdefault(arg, reg)
+    return prefer
+
+def linear_scan(ranges, registers, prefer):
+    alloc = {}
+    active = []  # (end, vreg)
+    free = list(registers)
+    slots = 0
+
+    for v, (start, end) in sorted(ranges.items(), key=lambda item: item[1]):
+        for item in list(active):
+            if item[0] < start:
+                active.remove(item)
+                free.append(alloc[item[1]])
+
+        if free:
+            reg = prefer.get(v)
+            alloc[v] = reg if reg in free else free[0]
+            free.remove(alloc[v])
+            active.append((end, v))
+            continue
+
+        # spill the interval ending last
+        active.sort()
+        last_end, last = active[-1]
+        if last_end > end:
+            alloc[v] = alloc[last]
+            alloc[last] = Slot(slots)
+            active[-1] = (end, v)
+        else:
+            alloc[v] = Slot(slots)
+        slots += 1
+
+    return alloc, slots
+
+def allocate(code):
+    """
+    linear scan over the six general registers, when anything spills the
+    allocation is redone with two registers kept as scratch
+
+    returns (allocation, number of spill slots, scratch registers, live-out)
+    """
+    live_in, live_out = liveness(code)
+    ranges = intervals(code, live_in, live_out)
+
+    prefer = hints(code)
+    alloc, slots = linear_scan(ranges, REGISTERS, prefer)
+    if slots == 0:
+        return alloc, 0, [], live_out
+
+    registers = [ r for r in REGISTERS if r not in SCRATCH ]
+    alloc, slots = linear_scan(ranges, registers, prefer)
+    return alloc, slots, SCRATCH, live_out
@@ -0,0 +1,339 @@
+from .lexer import CompileError, tokenize
+
+class Node(object):
+    FIELDS = ()
+
+    def __init__(self, *args, line=None):
+        for name, value in zip(self.FIELDS, args):
+            setattr(self, name, value)
+        self.line = line
+
+    def __repr__(self):
+        return '%s(%s)' % (type(self).__name__,
+                           ', '.join(repr(getattr(self, f)) for f in self.FIELDS))
+
+# expressions, every value is a 16-bit word
+class Num(Node):     FIELDS = ('value',)
+class Str(Node):     FIELDS = ('data',)
+class Var(Node):     FIELDS = ('name',)
+class AddrOf(Node):  FIELDS = ('name',)
+class Index(Node):   FIELDS = ('base', 'index')  # word at base + 2 * index
+class Deref(Node):   FIELDS = ('addr',)          # word at addr
+class Unary(Node):   FIELDS = ('op', 'operand')
+class Binary(Node):  FIELDS = ('op', 'left', 'right')
+class Logical(Node): FIELDS = ('op', 'left', 'right')
+class Assign(Node):  FIELDS = ('target', 'value')
+class Call(Node):    FIELDS = ('name', 'args')
+
+# statements
+class Block(Node):    FIELDS = ('stmts',)
+class Decl(Node):     FIELDS = ('name', 'init')
+class ExprStmt(Node): FIELDS = ('expr',)
+class If(Node):       FIELDS = ('cond', 'then', 'otherwise')
+class While(Node):    FIELDS = ('cond', 'body')
+class For(Node):      FIELDS = ('init', 'cond', 'step', 'body')
+class Return(Node):   FIELDS = ('value',)
+class Break(Node):    FIELDS = ()
+class Continue(Node): FIELDS = ()
+
+# top level
+class Function(Node): FIELDS = ('name', 'params', 'body')
+class Global(Node):   FIELDS = ('name', 'size', 'init', 'array')
+class Extern(Node):   FIELDS = ('name',)
+class Import(Node):   FIELDS = ('path',)
+
+COMPARISONS = ('==', '!=', '<', '>', '<=', '>=')
+
+# binary operators by precedence, lowest first
+PRECEDENCE = [
+    ('|',),
+    ('^',),
+    ('&',),
+    ('==', '!='),
+    ('<', '>', '<=', '>='),
+    ('<<', '>>'),
+    ('+', '-'),
+    ('*', '/', '%'),
+]
+
+COMPOUND_ASSIGN = {
+    '+=': '+', '-=': '-', '*=': '*', '&=': '&', '|=': '|', '^=': '^',
+    '<<=': '<<', '>>=': '>>',
+}
+
+class SyntaxParser(object):
+    def __init__(self, source):
+        self.tokens = tokenize(source)
+        self.pos = 0
+
+    def peek(self, offset=0):
+        return self.tokens[self.pos + offset]
+
+    def next(self):
+        tok = self.tokens[self.pos]
+        self.pos += 1
+        return tok
+
+    def check(self, kind, value=None):
+        tok = self.peek()
+        return tok.kind == kind and (value is None or tok.value == value)
+
+    def accept(self, kind, value=None):
+        if self.check(kind, value):
+            return self.next()
+
+    def expect(self, kind, value=None):
+        tok = self.accept(kind, value)
+        if tok is None:
+            got = self.peek()
+            raise CompileError('expect %s, got %r' % (value or kind, got.value), got.line)
+        return tok
+
+    def program(self):
+        items = []
+        while not self.check('eof'):
+            items.append(self.top_level())
+        return items
+
+    def top_level(self):
+        line = self.peek().line
+        if self.accept('kw', 'import'):
+            path = self.expect('str').value.decode()
+            self.expect(';')
+            return Import(path, line=line)
+
+        if self.accept('kw', 'extern'):
+            self.expect('kw', 'int')
+            name = self.expect('ident').value
+            self.expect('(')
+            while not self.accept(')'):
+                self.next()
+            self.expect(';')
+            return Extern(name, line=line)
+
+        self.expect('kw', 'int')
+        name = self.expect('ident').value
+
+        if self.accept('('):
+            params = []
+            if not self.check(')'):
+                while True:
+                    self.expect('kw', 'int')
+                    params.append(self.expect('ident').value)
+                    if not self.accept(','):
+                        break
+            self.expect(')')
+            return Function(name, params, self.block(), line=line)
+
+        size = None
+        if self.accept('['):
+            size = self.expect('num').value if self.check('num') else 0
+            self.expect(']')
+
+        init = None
+        if self.accept('='):
+            if self.check('str'):
+                init = self.next().value
+            elif self.accept('{'):
+                init = []
+                while not self.accept('}'):
+                    init.append(self.const_expr())
+                    self.accept(',')
+            else:
+                init = [self.const_expr()]
+        self.expect(';')
+
+        array = size is not None or type(init) is bytes
+        if size is None:
+            size = 1
+        if type(init) is bytes:
+            size = max(size, (len(init) + 2) // 2)
+        elif init is not None:
+            size = max(size, len(init))
+        return Global(name, size, init, array, line=line)
+
+    def const_expr(self):
+        from .transform import fold
+        tok = self.peek()
+        expr = fold(self.expression())
+        if type(expr) is not Num:
+            raise CompileError('initializer must be constant', tok.line)
+        return expr.value
+
+    def block(self):
+        line = self.expect('{').line
+        stmts = []
+        while not self.accept('}'):
+            stmts.append(self.statement())
+        return Block(stmts, line=line)
+
+    def statement(self):
+        tok = self.peek()
+        line = tok.line
+
+        if self.check('{'):
+            return self.block()
+
+        if self.accept('kw', 'int'):
+            decls = []
+            while True:
+                name = self.expect('ident').value
+                init = self.expression() if self.accept('=') else None
+                decls.append(Decl(name, init, line=line))
+                if not self.accept(','):
+                    break
+            self.expect(';')
+            return decls[0] if len(decls) == 1 else Block(decls, line=line)
+
+        if self.accept('kw', 'if'):
+            self.expect('(')
+            cond = self.expression()
+            self.expect(')')
+            then = self.statement()
+            otherwise = self.statement() if self.accept('kw', 'else') else None
+            return If(cond, then, otherwise, line=line)
+
+        if self.accept('kw', 'while'):
+            self.expect('(')
+            cond = self.expression()
+            self.expect(')')
+            return While(cond, self.statement(), line=line)
+
+        if self.accept('kw', 'for'):
+            self.expect('(')
+            if self.check('kw', 'int'):
+                init = self.statement()
+            else:
+                init = None if self.check(';') else ExprStmt(self.expression(), line=line)
+                self.expect(';')
+            cond = None if self.check(';') else self.expression()
+            self.expect(';')
+            step = None if self.check(')') else ExprStmt(self.expression(), line=line)
+            self.expect(')')
+            return For(init, cond, step, self.statement(), line=line)
+
+        if self.accept('kw', 'return'):
+            value = None if self.check(';') else self.expression()
+            self.expect(';')
+            return Return(value, line=line)
+
+        if self.accept('kw', 'break'):
+            self.expect(';')
+            return Break(line=line)
+
+        if self.accept('kw', 'continue'):
+            self.expect(';')
+            return Continue(line=line)
+
+        if self.accept(';'):
+            return Block([], line=line)
+
+        expr = self.expression()
+        self.expect(';')
+        return ExprStmt(expr, line=line)
+
+    def expression(self):
+        return self.assignment()
+
+    def assignment(self):
+        left = self.logical_or()
+        tok = self.peek()
+        if tok.kind == '=' or tok.kind in COMPOUND_ASSIGN:
+            self.next()
+            if type(left) not in (Var, Index, Deref):
+                raise CompileError('can not assign to expression', tok.line)
+            value = self.assignment()
+            if tok.kind != '=':
+                value = Binary(COMPOUND_ASSIGN[tok.kind], left, value, line=tok.line)
+            return Assign(left, value, line=tok.line)
+        return left
+
+    def logical_or(self):
+        left = self.logical_and()
+        while self.check('||'):
+            line = self.next().line
+            left = Logical('||', left, self.logical_and(), line=line)
+        return left
+
+    def logical_and(self):
+        left = self.binary(0)
+        while self.check('&&'):
+            line = self.next().line
+            left = Logical('&&', left, self.binary(0), line=line)
+        return left
+
+    def binary(self, level):
+        if level == len(PRECEDENCE):
+            return self.unary()
+        left = self.binary(level + 1)
+        while self.peek().kind in PRECEDENCE[level]:
+            tok = self.next()
+            left = Binary(tok.kind, left, self.binary(level + 1), line=tok.line)
+        return left
+
+    def unary(self):
+        tok = self.peek()
+        if tok.kind in ('-', '~', '!'):
+            self.next()
+            return Unary(tok.kind, self.unary(), line=tok.line)
+        if tok.kind == '*':
+            self.next()
+            return Deref(self.unary(), line=tok.line)
+        if tok.kind == '&':
+            self.next()
+            return AddrOf(self.expect('ident').value, line=tok.line)
+        if tok.kind in ('++', '--'):
+            self.next()
+            return self.increment(self.unary(), tok)
+        return self.postfix()
+
+    def increment(self, target, tok):
+        """
+        ++x and x++ both evaluate to the updated value
+        """
+        if type(target) not in (Var, Index, Deref):
+            raise CompileError('can not assign to expression', tok.line)
+        op = '+' if tok.kind == '++' else '-'
+        return Assign(target, Binary(op, target, Num(1, line=tok.line), line=tok.line),
+                      line=tok.line)
+
+    def postfix(self):
+        expr = self.primary()
+        while True:
+            tok = self.peek()
+            if tok.kind == '[':
+                self.next()
+                index = self.expression()
+                self.expect(']')
+                expr = Index(expr, index, line=tok.line)
+            elif tok.kind in ('++', '--'):
+                self.next()
+                expr = self.increment(expr, tok)
+            else:
+                return expr
+
+    def primary(self):
+        tok = self.next()
+        if tok.kind == 'num':
+            return Num(tok.value & 0xffff, line=tok.line)
+        if tok.kind == 'str':
+            return Str(tok.value, line=tok.line)
+        if tok.kind == 'ident':
+            if self.accept('('):
+                args = []
+                if not self.check(')'):
+                    while True:
+                        args.append(self.expression())
+                        if not self.accept(','):
+                            break
+                self.expect(')')
+                return Call(tok.value, args, line=tok.line)
+            return Var(tok.value, line=tok.line)
+        if tok.kind == '(':
+            expr = self.expression()
+            self.expect(')')
+            return expr
+        raise CompileError('unexpected %r' % tok.value, tok.line)
+
+def parse(source):
+    return SyntaxParser(source).program()
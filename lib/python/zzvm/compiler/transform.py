@@ -0,0 +1,327 @@
+from .lexer import CompileError
+from .syntax import *
+from .syntax import COMPARISONS
+
+__all__ = [ 'fold', 'fold_function', 'hoist_invariants' ]
+
+COMMUTATIVE = ('+', '*', '&', '|', '^', '==', '!=')
+
+# loop-invariant expressions hoisted out of one loop at most, every one of
+# them keeps a register busy for the whole loop
+MAX_HOISTED = 3
+
+def to_signed(v):
+    v &= 0xffff
+    return v - 0x10000 if v & 0x8000 else v
+
+def log2(v):
+    if v > 0 and v & (v - 1) == 0:
+        return v.bit_length() - 1
+
+def evaluate(op, a, b, line=None):
+    """
+    evaluate binary operator with 16-bit wraparound, int is signed but
+    `>>` is a logical shift like SHR
+    """
+    if op == '+':  return (a + b) & 0xffff
+    if op == '-':  return (a - b) & 0xffff
+    if op == '*':  return (a * b) & 0xffff
+    if op == '&':  return a & b
+    if op == '|':  return a | b
+    if op == '^':  return a ^ b
+    if op == '<<': return (a << b) & 0xffff if b < 16 else 0
+    if op == '>>': return a >> b if b < 16 else 0
+    if op in ('/', '%'):
+        if b == 0:
+            raise CompileError('division by zero', line)
+        return (a // b if op == '/' else a % b) & 0xffff
+    sa, sb = to_signed(a), to_signed(b)
+    return int({
+        '==': sa == sb, '!=': sa != sb, '<': sa < sb,
+        '>': sa > sb, '<=': sa <= sb, '>=': sa >= sb,
+    }[op])
+
+def is_pure(expr):
+    if type(expr) in (Assign, Call):
+        return False
+    return all(is_pure(c) for c in children(expr))
+
+def children(expr):
+    t = type(expr)
+    if t in (Unary,):
+        return [expr.operand]
+    if t in (Binary, Logical):
+        return [expr.left, expr.right]
+    if t is Index:
+        return [expr.base, expr.index]
+    if t is Deref:
+        return [expr.addr]
+    if t is Assign:
+        return [expr.target, expr.value]
+    if t is Call:
+        return list(expr.args)
+    return []
+
+def truth(expr):
+    return Binary('!=', expr, Num(0, line=expr.line), line=expr.line)
+
+def fold(expr):
+    """
+    constant folding and algebraic simplification of an expression
+    """
+    t = type(expr)
+    line = expr.line
+
+    if t is Unary:
+        operand = fold(expr.operand)
+        if type(operand) is Num:
+            v = operand.value
+            if expr.op == '-':
+                return Num(-v & 0xffff, line=line)
+            if expr.op == '~':
+                return Num(~v & 0xffff, line=line)
+            return Num(int(v == 0), line=line)
+        if expr.op == '-' and type(operand) is Unary and operand.op == '-':
+            return operand.operand
+        return Unary(expr.op, operand, line=line)
+
+    if t is Binary:
+        left, right = fold(expr.left), fold(expr.right)
+        op = expr.op
+        if type(left) is Num and type(right) is Num:
+            return Num(evaluate(op, left.value, right.value, line), line=line)
+        if type(left) is Num and op in COMMUTATIVE:
+            left, right = right, left
+        if type(right) is Num:
+            c = right.value
+            if op == '-':
+                op, c = '+', -c & 0xffff
+                right = Num(c, line=line)
+            # (x + c1) + c2 => x + (c1 + c2)
+            if op in ('+', '*', '&', '|', '^') and type(left) is Binary and \
+                    left.op == op and type(left.right) is Num:
+                c = evaluate(op, left.right.value, c)
+                left, right = left.left, Num(c, line=line)
+            if c == 0 and op in ('+', '|', '^', '<<', '>>'):
+                return left
+            if c == 1 and op == '*':
+                return left
+            if c == 0xffff and op == '&':
+                return left
+            if c == 0 and op in ('*', '&') and is_pure(left):
+                return Num(0, line=line)
+            k = log2(c)
+            if k is not None:
+                if op == '*':
+                    return Binary('<<', left, Num(k, line=line), line=line)
+                if op == '/':
+                    return Binary('>>', left, Num(k, line=line), line=line)
+                if op == '%':
+                    return Binary('&', left, Num(c - 1, line=line), line=line)
+        return Binary(op, left, right, line=line)
+
+    if t is Logical:
+        left, right = fold(expr.left), fold(expr.right)
+        if type(left) is Num:
+            if (expr.op == '&&') == (left.value == 0):
+                return Num(int(expr.op == '||'), line=line)
+            return fold(truth(right))
+        return Logical(expr.op, left, right, line=line)
+
+    if t is Index:
+        return Index(fold(expr.base), fold(expr.index), line=line)
+    if t is Deref:
+        return Deref(fold(expr.addr), line=line)
+    if t is Assign:
+        return Assign(fold(expr.target), fold(expr.value), line=line)
+    if t is Call:
+        return Call(expr.name, [ fold(a) for a in expr.args ], line=line)
+    return expr
+
+def fold_stmt(stmt):
+    if stmt is None:
+        return None
+    t = type(stmt)
+    line = stmt.line
+
+    if t is Block:
+        return Block([ fold_stmt(s) for s in stmt.stmts ], line=line)
+    if t is Decl:
+        return Decl(stmt.name, fold(stmt.init) if stmt.init else None, line=line)
+    if t is ExprStmt:
+        return ExprStmt(fold(stmt.expr), line=line)
+    if t is Return:
+        return Return(fold(stmt.value) if stmt.value else None, line=line)
+    if t is If:
+        cond = fold(stmt.cond)
+        then, otherwise = fold_stmt(stmt.then), fold_stmt(stmt.otherwise)
+        if type(cond) is Num:
+            taken = then if cond.value else otherwise
+            return taken or Block([], line=line)
+        return If(cond, then, otherwise, line=line)
+    if t is While:
+        cond = fold(stmt.cond)
+        if type(cond) is Num and cond.value == 0:
+            return Block([], line=line)
+        return While(cond, fold_stmt(stmt.body), line=line)
+    if t is For:
+        init = fold_stmt(stmt.init)
+        cond = fold(stmt.cond) if stmt.cond else None
+        if type(cond) is Num and cond.value == 0:
+            return init or Block([], line=line)
+        return For(init, cond, fold_stmt(stmt.step), fold_stmt(stmt.body), line=line)
+    return stmt
+
+def fold_function(func):
+    return Function(func.name, func.params, fold_stmt(func.body), line=func.line)
+
+class LoopInfo(object):
+    """
+    variables assigned and whether memory may be written inside a loop
+    """
+    def __init__(self, parts):
+        self.assigned = set()
+        self.writes_memory = False
+        for part in parts:
+            self.visit(part)
+
+    def visit(self, node):
+        if node is None:
+            return
+        t = type(node)
+        if t is Decl:
+            self.assigned.add(node.name)
+        elif t is Assign:
+            if type(node.target) is Var:
+                self.assigned.add(node.target.name)
+            else:
+                self.writes_memory = True
+        elif t is Call:
+            self.writes_memory = True
+
+        for name in getattr(node, 'FIELDS', ()):
+            value = getattr(node, name)
+            if isinstance(value, Node):
+                self.visit(value)
+            elif type(value) is list:
+                for v in value:
+                    if isinstance(v, Node):
+                        self.visit(v)
+
+class Hoister(object):
+    """
+    loop-invariant code motion, invariant subexpressions of a loop are
+    computed once into a temporary before the loop
+    """
+    def __init__(self, globals_):
+        self.globals = globals_
+        self.counter = 0
+
+    def invariant(self, expr, info):
+        t = type(expr)
+        if t in (Num, Str, AddrOf):
+            return True
+        if t is Var:
+            if expr.name in self.globals and info.writes_memory:
+                return False
+            return expr.name not in info.assigned
+        if t in (Unary, Binary):
+            return all(self.invariant(c, info) for c in children(expr))
+        if t in (Index, Deref):
+            return not info.writes_memory and \
+                all(self.invariant(c, info) for c in children(expr))
+        return False
+
+    def worth(self, expr):
+        t = type(expr)
+        if t is Var:
+            return expr.name in self.globals
+        return t in (Unary, Binary, Index, Deref)
+
+    def rewrite_expr(self, expr, info, hoisted):
+        if expr is None:
+            return None
+        if len(hoisted) < MAX_HOISTED and self.worth(expr) and self.invariant(expr, info):
+            name = '.licm%d' % self.counter
+            self.counter += 1
+            hoisted.append(Decl(name, expr, line=expr.line))
+            return Var(name, line=expr.line)
+
+        t = type(expr)
+        if t is Unary:
+            return Unary(expr.op, self.rewrite_expr(expr.operand, info, hoisted), line=expr.line)
+        if t in (Binary, Logical):
+            return t(expr.op, self.rewrite_expr(expr.left, info, hoisted),
+                     self.rewrite_expr(expr.right, info, hoisted), line=expr.line)
+        if t is Index:
+            return Index(self.rewrite_expr(expr.base, info, hoisted),
+                         self.rewrite_expr(expr.index, info, hoisted), line=expr.line)
+        if t is Deref:
+            return Deref(self.rewrite_expr(expr.addr, info, hoisted), line=expr.line)
+        if t is Assign:
+            target = expr.target
+            if type(target) is Index:
+                target = Index(self.rewrite_expr(target.base, info, hoisted),
+                               self.rewrite_expr(target.index, info, hoisted), line=target.line)
+            elif type(target) is Deref:
+                target = Deref(self.rewrite_expr(target.addr, info, hoisted), line=target.line)
+            return Assign(target, self.rewrite_expr(expr.value, info, hoisted), line=expr.line)
+        if t is Call:
+            return Call(expr.name, [ self.rewrite_expr(a, info, hoisted) for a in expr.args ],
+                        line=expr.line)
+        return expr
+
+    def rewrite_stmt(self, stmt, info, hoisted):
+        """
+        rewrite statements inside a loop body, nested loops are left alone
+        since they have been processed already
+        """
+        if stmt is None:
+            return None
+        t = type(stmt)
+        line = stmt.line
+        if t is Block:
+            return Block([ self.rewrite_stmt(s, info, hoisted) for s in stmt.stmts ], line=line)
+        if t is Decl:
+            return Decl(stmt.name, self.rewrite_expr(stmt.init, info, hoisted), line=line)
+        if t is ExprStmt:
+            return ExprStmt(self.rewrite_expr(stmt.expr, info, hoisted), line=line)
+        if t is Return:
+            return Return(self.rewrite_expr(stmt.value, info, hoisted), line=line)
+        if t is If:
+            return If(self.rewrite_expr(stmt.cond, info, hoisted),
+                      self.rewrite_stmt(stmt.then, info, hoisted),
+                      self.rewrite_stmt(stmt.otherwise, info, hoisted), line=line)
+        return stmt
+
+    def stmt(self, stmt):
+        if stmt is None:
+            return None
+        t = type(stmt)
+        line = stmt.line
+
+        if t is Block:
+            return Block([ self.stmt(s) for s in stmt.stmts ], line=line)
+        if t is If:
+            return If(stmt.cond, self.stmt(stmt.then), self.stmt(stmt.otherwise), line=line)
+        if t is While:
+            body = self.stmt(stmt.body)
+            info = LoopInfo([stmt.cond, body])
+            hoisted = []
+            cond = self.rewrite_expr(stmt.cond, info, hoisted)
+            body = self.rewrite_stmt(body, info, hoisted)
+            return Block(hoisted + [While(cond, body, line=line)], line=line)
+        if t is For:
+            body = self.stmt(stmt.body)
+            info = LoopInfo([stmt.cond, stmt.step, body])
+            hoisted = []
+            cond = self.rewrite_expr(stmt.cond, info, hoisted)
+            step = self.rewrite_stmt(stmt.step, info, hoisted)
+            body = self.rewrite_stmt(body, info, hoisted)
+            init = [stmt.init] if stmt.init else []
+            return Block(init + hoisted + [For(None, cond, step, body, line=line)], line=line)
+        return stmt
+
+def hoist_invariants(func, globals_):
+    body = Hoister(globals_).stmt(func.body)
+    return Function(func.name, func.params, body, line=func.line)
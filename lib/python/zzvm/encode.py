@@ -1,17 +1,78 @@
-import textwrap
-
 __all__ = [
     'zz_encode_byte',
     'zz_encode_data',
-    'zz_decode_data'
+    'zz_decode_data',
+    'zz_encode_stream',
+    'zz_decode_stream',
+    'CHUNK_SIZE',
 ]
 
+# every byte becomes eight characters, MSB first, 'Z' for 1 and 'z' for 0
+ENCODE_TABLE = tuple(format(b, '08b').translate(str.maketrans('10', 'Zz')).encode()
+                     for b in range(256))
+
+# 256-entry byte tables for bytes.translate, a chunk goes through the binary
+# digits of one big integer, which CPython converts in linear time for base 2.
+# Anything but Z and z decodes to 'x' so int() rejects it
+TO_ZZ = bytes.maketrans(b'10', b'Zz')
+FROM_ZZ = bytes(ord('1') if c == ord('Z') else ord('0') if c == ord('z') else ord('x')
+                for c in range(256))
+
+# bytes of input per chunk, decoding reads eight times as much
+CHUNK_SIZE = 1 << 16
+
 def zz_encode_byte(b):
-    return bin(b)[2:].zfill(8).translate(str.maketrans('10', 'Zz')).encode()
+    return ENCODE_TABLE[b]
+
+def _encode_chunk(chunk):
+    n = len(chunk)
+    return format(int.from_bytes(chunk, 'big'), '0%db' % (n * 8)).encode().translate(TO_ZZ)
+
+def _decode_chunk(chunk):
+    try:
+        return int(bytes(chunk).translate(FROM_ZZ), 2).to_bytes(len(chunk) // 8, 'big')
+    except ValueError:
+        raise ValueError('invalid character in Zz data') from None
 
 def zz_encode_data(data):
-    return b''.join(zz_encode_byte(i) for i in data)
+    view = memoryview(data).cast('B')
+    return b''.join(_encode_chunk(view[i:i + CHUNK_SIZE])
+                    for i in range(0, len(view), CHUNK_SIZE))
 
 def zz_decode_data(data):
-    bindata = data.decode('ascii').translate(str.maketrans('Zz', '10'))
-    return bytes(int(i, 2) for i in textwrap.wrap(bindata, 8))
+    view = memoryview(data).cast('B')
+    if len(view) % 8:
+        raise ValueError('Zz data is not a multiple of 8 characters')
+    size = CHUNK_SIZE * 8
+    return b''.join(_decode_chunk(view[i:i + size]) for i in range(0, len(view), size))
+
+def zz_encode_stream(fin, fout):
+    """
+    encode file fin into fout chunk by chunk
+    """
+    while True:
+        chunk = fin.read(CHUNK_SIZE)
+        if not chunk:
+            return
+        fout.write(_encode_chunk(chunk))
+
+def zz_decode_stream(fin, fout):
+    """
+    decode file fin into fout chunk by chunk, returns the trailing characters
+    which do not make up a whole byte
+    """
+    size = CHUNK_SIZE * 8
+    buffer = bytearray(size)
+    view = memoryview(buffer)
+    filled = 0
+
+    while True:
+        n = fin.readinto(view[filled:])
+        filled += n or 0
+        whole = filled - filled % 8
+        if whole and (filled == size or not n):
+            fout.write(_decode_chunk(view[:whole]))
+            view[:filled - whole] = view[whole:filled]
+            filled -= whole
+        if not n:
+            return bytes(view[:filled])
@@ -4,11 +4,12 @@ from .symbol import Symbol
 import struct
 
 class Instruction(object):
-    def __init__(self, opcode, reg1=None, reg2=None, reg3=None, imm=None):
+    def __init__(self, opcode, reg1=None, reg2=None, reg3=None, imm=None, const=None):
         """
         opcode		type(opcode) in (int, str, Opcode)
         registers	type(reg) in (int, str, Register)
         imm		type(imm) is int
+        const		type(const) is int, compared value of C-type instruction
         """
         self.opcode = Opcodes.normalize(opcode)
         if not self.opcode:
@@ -17,9 +18,10 @@ class Instruction(object):
         self.reg2 = self._reg(reg2)
         self.reg3 = self._reg(reg3)
         self.imm = imm
+        self.const = const
 
     def __repr__(self):
-        ATTR = ('reg1', 'reg2', 'reg3', 'imm')
+        ATTR = ('reg1', 'reg2', 'reg3', 'imm', 'const')
         return 'Instruction(opcode=%r, %s)' % (
             self.opcode.name,
             ', '.join('%s=%r' % (i, getattr(self, i)) for i in ATTR if getattr(self, i) is not None)
@@ -50,7 +52,14 @@ class Instruction(object):
 
         regs_val = self._raw_regs_to_code(op.regs)
 
-        if type(self.imm) is Symbol:
+        if op.type_ == 'C':
+            if type(self.imm) is Symbol:
+                assert offset is not None
+                rel = offset
+            else:
+                rel = self.imm
+            imm = self._compose_c(rel)
+        elif type(self.imm) is Symbol:
             assert offset is not None
             imm = offset & 0xffff
         elif op.type_ == 'I':
@@ -61,3 +70,19 @@ class Instruction(object):
             imm = 0
 
         return struct.pack('<BBH', op.code, regs_val[0] << 4 | regs_val[1], imm)
+
+    def _compose_c(self, rel):
+        try:
+            return compose_c_imm(self.const, rel)
+        except ValueError as e:
+            raise ValueError('%s (%r)' % (e, self))
+
+def compose_c_imm(const, rel):
+    """
+    pack compared constant and relative jump offset of C-type instruction
+    """
+    if rel % 4 != 0 or not -128 <= rel // 4 <= 127:
+        raise ValueError('jump target out of range')
+    if const is None or not -128 <= const <= 127:
+        raise ValueError('constant must fit in signed 8-bit')
+    return (const & 0xff) << 8 | (rel // 4) & 0xff
@@ -0,0 +1,134 @@
+import collections
+import struct
+
+from .instruction import compose_c_imm
+
+__all__ = [ 'Linker' ]
+
+DEFAULT_SECTION_ADDR = { 'TEXT': 0x4000 }
+
+def default_section_addr(name):
+    return DEFAULT_SECTION_ADDR.get(name, 0x6000)
+
+class Linker(object):
+    """
+    lay out sections of object files and resolve symbols into an image
+
+    sections with the same name are concatenated in the order objects are
+    added, starting at the address of the first one which declares it
+    """
+    def __init__(self):
+        self.objects = []
+        self.section_bodies = collections.OrderedDict()
+        self.symbols = {}
+
+    def add_object(self, obj):
+        self.objects.append(obj)
+
+    def layout(self):
+        """
+        returns {name: [base address, [(object section, address)]]}
+        """
+        regions = collections.OrderedDict()
+
+        for obj in self.objects:
+            for sect in obj.sections:
+                if sect.name not in regions:
+                    regions[sect.name] = [sect.addr, []]
+                elif regions[sect.name][0] is None:
+                    regions[sect.name][0] = sect.addr
+
+        for name, region in regions.items():
+            if region[0] is None:
+                region[0] = default_section_addr(name)
+
+        for obj in self.objects:
+            for sect in obj.sections:
+                region = regions[sect.name]
+                if not region[1]:
+                    region[1].append((sect, region[0]))
+                    continue
+
+                # keep padding inside the body valid, it was computed
+                # with the section laid out at its own address
+                last, last_addr = region[1][-1]
+                ptr = last_addr + len(last.body)
+                ptr += ((sect.addr or 0) - ptr) % sect.alignment
+                region[1].append((sect, ptr))
+
+        return regions
+
+    def resolve(self, name):
+        if name not in self.symbols:
+            raise ValueError('Can not resolve symbol %s' % name)
+        return self.symbols[name]
+
+    def link(self):
+        regions = self.layout()
+
+        self.symbols = {}
+        for region in regions.values():
+            for sect, addr in region[1]:
+                for name, offset in sect.labels.items():
+                    if name in self.symbols:
+                        raise ValueError('duplicated symbol %s' % name)
+                    self.symbols[name] = addr + offset
+
+        sections = []
+        bodies = []
+
+        for name, region in regions.items():
+            base = region[0]
+            body = bytearray()
+            for sect, addr in region[1]:
+                body += b'\0' * (addr - base - len(body))
+                start = len(body)
+                body += sect.body
+                for reloc in sect.relocs:
+                    self._apply(body, start + reloc.offset, addr + reloc.offset, reloc)
+
+            body = bytes(body)
+            self.section_bodies[name] = body
+            bodies.append(body)
+            sections.append(struct.pack('<HH',
+                base,      # section_addr
+                len(body), # section_size
+            ))
+
+        header = struct.pack('<ccHHH',
+            b'Z', b'z',       # magic
+            0,                # file_ver
+            self.get_entry(), # entry
+            len(bodies),      # section_count
+        )
+
+        return header + b''.join(sections) + b''.join(bodies)
+
+    def get_entry(self):
+        for obj in self.objects:
+            if type(obj.entry) is str:
+                return self.resolve(obj.entry)
+            elif obj.entry is not None:
+                return obj.entry
+        if 'start' in self.symbols:
+            return self.symbols['start']
+        return 0x4000
+
+    def _apply(self, body, pos, ip, reloc):
+        value = self.resolve(reloc.symbol) + reloc.addend
+        if reloc.is_relative:
+            value -= ip + 4
+
+        if reloc.kind == 'I':
+            struct.pack_into('<H', body, pos + 2, value & 0xffff)
+        elif reloc.kind == 'C':
+            const = struct.unpack_from('<b', body, pos + 3)[0]
+            try:
+                imm = compose_c_imm(const, value)
+            except ValueError as e:
+                raise ValueError('%s (%s)' % (e, reloc.symbol))
+            struct.pack_into('<H', body, pos + 2, imm)
+        elif reloc.kind == 'W':
+            struct.pack_into('<I', body, pos, value & 0xffffffff)
+        else:
+            raise ValueError('unknown relocation %r' % reloc)
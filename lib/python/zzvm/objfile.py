@@ -0,0 +1,118 @@
+import json
+
+__all__ = [ 'Relocation', 'ObjectSection', 'ObjectFile' ]
+
+OBJECT_MAGIC = b'ZZOBJ\n'
+OBJECT_VERSION = 1
+
+class Relocation(object):
+    """
+    a reference to `symbol` which has to be patched at link time
+
+    kind	'I' 16-bit immediate of I-type instruction
+    		'C' 8-bit jump offset of C-type instruction
+    		'W' 32-bit data word
+    """
+    def __init__(self, offset, kind, symbol, addend=0, is_relative=False):
+        self.offset = offset
+        self.kind = kind
+        self.symbol = symbol
+        self.addend = addend
+        self.is_relative = is_relative
+
+    def __repr__(self):
+        return 'Relocation(%s)' % ', '.join(
+            '%s=%r' % (attr, getattr(self, attr))
+            for attr in ('offset', 'kind', 'symbol', 'addend', 'is_relative')
+        )
+
+    def to_dict(self):
+        return {
+            'offset': self.offset,
+            'kind': self.kind,
+            'symbol': self.symbol,
+            'addend': self.addend,
+            'is_relative': self.is_relative,
+        }
+
+    @classmethod
+    def from_dict(class_, d):
+        return class_(d['offset'], d['kind'], d['symbol'], d['addend'], d['is_relative'])
+
+class ObjectSection(object):
+    """
+    relocatable section body, labels are offsets from the section start
+
+    addr is None when the section is inherited from the file importing it
+    """
+    def __init__(self, name, addr=None, body=b'', alignment=1):
+        self.name = name
+        self.addr = addr
+        self.body = bytes(body)
+        self.alignment = alignment
+        self.labels = {}
+        self.relocs = []
+
+    def __repr__(self):
+        return 'ObjectSection(name=%r, addr=%r, size=%d, labels=%d, relocs=%d)' % (
+            self.name, self.addr, len(self.body), len(self.labels), len(self.relocs)
+        )
+
+    def to_dict(self):
+        return {
+            'name': self.name,
+            'addr': self.addr,
+            'body': self.body.hex(),
+            'alignment': self.alignment,
+            'labels': self.labels,
+            'relocs': [ r.to_dict() for r in self.relocs ],
+        }
+
+    @classmethod
+    def from_dict(class_, d):
+        sect = class_(d['name'], d['addr'], bytes.fromhex(d['body']), d['alignment'])
+        sect.labels = dict(d['labels'])
+        sect.relocs = [ Relocation.from_dict(r) for r in d['relocs'] ]
+        return sect
+
+class ObjectFile(object):
+    """
+    output of separate compilation, consumed by Linker
+
+    imports	[(filename, section name)] of `.import` directives
+    depends	{filename: sha256} of every source spliced in by `.include`
+    entry	None, an address or a label name
+    """
+    def __init__(self):
+        self.sections = []
+        self.imports = []
+        self.depends = {}
+        self.entry = None
+
+    def __repr__(self):
+        return 'ObjectFile(sections=%r, imports=%r)' % (self.sections, self.imports)
+
+    def to_bytes(self):
+        payload = {
+            'version': OBJECT_VERSION,
+            'sections': [ s.to_dict() for s in self.sections ],
+            'imports': self.imports,
+            'depends': self.depends,
+            'entry': self.entry,
+        }
+        return OBJECT_MAGIC + json.dumps(payload, sort_keys=True).encode()
+
+    @classmethod
+    def from_bytes(class_, data):
+        if not data.startswith(OBJECT_MAGIC):
+            raise ValueError('not a zz object file')
+        payload = json.loads(data[len(OBJECT_MAGIC):].decode())
+        if payload.get('version') != OBJECT_VERSION:
+            raise ValueError('mismatch object file version')
+
+        obj = class_()
+        obj.sections = [ ObjectSection.from_dict(s) for s in payload['sections'] ]
+        obj.imports = [ tuple(i) for i in payload['imports'] ]
+        obj.depends = payload['depends']
+        obj.entry = payload['entry']
+        return obj
@@ -0,0 +1,204 @@
+from .instruction import Instruction
+from .opcode import Opcodes
+from .registers import Registers
+from .symbol import Symbol
+
+# jumps which have no side effect besides changing IP
+CONDITIONAL_JUMPS = ('JEI', 'JNI', 'JGI', 'JZI', 'JSGI', 'JEC', 'JNC', 'JGC')
+# control transfers with a 16-bit relative target, safe to retarget
+THREADABLE = ('JEI', 'JNI', 'JGI', 'JZI', 'JSGI', 'CALL', 'LOOP')
+
+def is_jmp(ins):
+    return (ins.opcode is Opcodes.ADDI and ins.reg1 is Registers.IP and
+            ins.reg2 is Registers.IP)
+
+def is_relative_transfer(ins):
+    return is_jmp(ins) or ins.opcode.name in THREADABLE + CONDITIONAL_JUMPS
+
+def is_terminator(ins):
+    return is_jmp(ins) or ins.opcode in (Opcodes.HLT, Opcodes.RET)
+
+def zeroed_register(ins):
+    """
+    return register set to zero by ins, or None
+    """
+    if ins.opcode is Opcodes.XORR and ins.reg1 == ins.reg2 == ins.reg3:
+        return ins.reg1
+    if ins.opcode is Opcodes.MOVI and ins.imm == 0:
+        return ins.reg1
+
+def target_of(ins):
+    """
+    return label name of a relative control transfer, or None
+    """
+    if is_relative_transfer(ins) and type(ins.imm) is Symbol and ins.imm.offset == 0:
+        return ins.imm.name
+
+class Optimizer(object):
+    """
+    peephole optimizer working on Section.container before symbols are
+    resolved, labels are kept as container indices and laid out again
+    afterwards, so every relative offset is recomputed by Parser.build()
+    """
+    def __init__(self, sections):
+        self.sections = sections
+
+    def run(self):
+        saved = 0
+        offset_refs = self._offset_references()
+
+        for section in self.sections.values():
+            if not self._safe(section, offset_refs):
+                continue
+
+            while True:
+                removed = self._thread_jumps(section)
+                removed += self._remove_jump_to_next(section)
+                removed += self._remove_dead_code(section)
+                removed += self._remove_redundant_moves(section)
+                if not removed:
+                    break
+                saved += removed
+
+            section.relayout()
+
+        return saved
+
+    def _offset_references(self):
+        """
+        labels referenced with an offset (`$label+4`), code around them
+        must not move
+        """
+        names = set()
+        for section in self.sections.values():
+            for data in section.container:
+                if type(data) is Instruction and type(data.imm) is Symbol:
+                    if data.imm.offset:
+                        names.add(data.imm.name)
+        return names
+
+    def _safe(self, section, offset_refs):
+        if offset_refs & set(section.label_index):
+            return False
+        for data in section.container:
+            # hand-computed relative jumps break when code moves
+            if type(data) is Instruction and is_relative_transfer(data):
+                if type(data.imm) is not Symbol:
+                    return False
+        return True
+
+    def _labels_at(self, section):
+        positions = {}
+        for name, index in section.label_index.items():
+            positions.setdefault(index, []).append(name)
+        return positions
+
+    def _remove(self, section, indices):
+        """
+        drop container items, labels of removed items move to the next one
+        """
+        if not indices:
+            return 0
+
+        new_index = []
+        container = []
+        for i, data in enumerate(section.container):
+            new_index.append(len(container))
+            if i not in indices:
+                container.append(data)
+        new_index.append(len(container))
+
+        section.container = container
+        section.label_index = {
+            name: new_index[index] for name, index in section.label_index.items()
+        }
+        return len(indices)
+
+    def _instruction_at_label(self, name):
+        for section in self.sections.values():
+            index = section.label_index.get(name)
+            if index is not None:
+                if index < len(section.container):
+                    data = section.container[index]
+                    if type(data) is Instruction:
+                        return data
+                return None
+
+    def _thread_jumps(self, section):
+        for data in section.container:
+            if type(data) is not Instruction or data.opcode.type_ == 'C':
+                continue
+            name = target_of(data)
+            if name is None:
+                continue
+
+            seen = set([name])
+            while True:
+                target = self._instruction_at_label(name)
+                if target is None or not is_jmp(target):
+                    break
+                next_name = target_of(target)
+                if next_name is None or next_name in seen:
+                    break
+                seen.add(next_name)
+                name = next_name
+
+            if name != data.imm.name:
+                data.imm = Symbol(name, is_relative=True)
+        # retargeting does not shrink code, jumps left dead are removed later
+        return 0
+
+    def _remove_jump_to_next(self, section):
+        removed = set()
+        for i, data in enumerate(section.container):
+            if type(data) is not Instruction:
+                continue
+            if not (is_jmp(data) or data.opcode.name in CONDITIONAL_JUMPS):
+                continue
+            name = target_of(data)
+            if name is not None and section.label_index.get(name) == i + 1:
+                removed.add(i)
+        return self._remove(section, removed)
+
+    def _remove_dead_code(self, section):
+        labels = self._labels_at(section)
+        removed = set()
+        dead = False
+        for i, data in enumerate(section.container):
+            if i in labels or type(data) is not Instruction:
+                dead = False
+            elif dead:
+                removed.add(i)
+                continue
+
+            if type(data) is Instruction and is_terminator(data):
+                dead = True
+        return self._remove(section, removed)
+
+    def _remove_redundant_moves(self, section):
+        labels = self._labels_at(section)
+        removed = set()
+        prev = None
+        for i, data in enumerate(section.container):
+            if type(data) is not Instruction:
+                prev = None
+                continue
+            if i in labels:
+                prev = None
+
+            if data.opcode is Opcodes.MOVR and data.reg1 is data.reg2:
+                removed.add(i)
+                continue
+
+            if prev is not None:
+                zero = zeroed_register(data)
+                if zero is not None and zero is zeroed_register(prev):
+                    removed.add(i)
+                    continue
+                if (data.opcode is Opcodes.MOVR and prev.opcode is Opcodes.MOVR and
+                        data.reg1 is prev.reg2 and data.reg2 is prev.reg1):
+                    removed.add(i)
+                    continue
+
+            prev = data
+        return self._remove(section, removed)
@@ -1,14 +1,17 @@
 import codecs
 import collections
+import hashlib
 import io
 import os
 import re
 import struct
 
 from .instruction import Instruction
+from .objfile import ObjectFile, ObjectSection, Relocation
 from .opcode import Opcodes
+from .optimizer import Optimizer
 from .registers import Registers
-from .section import Section
+from .section import Align, Section
 from .symbol import Symbol
 
 def p32(v):
@@ -38,11 +41,24 @@ class QueueReader(object):
 
         return ''
 
+def resolve_source_path(filename):
+    if filename.startswith('zstdlib/'):
+        filename = os.path.join(os.path.dirname(__file__), '../../..', filename)
+    return os.path.abspath(filename)
+
 class Parser(object):
-    def __init__(self, fin):
+    def __init__(self, fin, section=None):
+        """
+        fin		source file or string
+        section	name of the section code goes to before any `.sect`,
+        		used to compile an imported file into an object
+        """
         self.sections = None
         self.section_bodies = {}
         self.entry = None
+        self.imports = []
+        self.depends = {}
+        self.initial_section = section
 
         if type(fin) is str:
             fin = io.StringIO(fin)
@@ -53,8 +69,14 @@ class Parser(object):
     def parse(self):
         sections = collections.OrderedDict()
         current_section = None
+        current_name = None
         lineno = 0
 
+        if self.initial_section:
+            current_name = self.initial_section.upper()
+            current_section = Section(0)
+            sections[current_name] = current_section
+
         while True:
             lineno += 1
             raw = self.reader.readline()
@@ -78,14 +100,20 @@ class Parser(object):
                 new_sect = Section(addr)
                 sections[name] = new_sect
                 current_section = new_sect
+                current_name = name
             elif line.startswith('.include'):
-                filename = line.split(maxsplit=1)[1].strip()
-                if filename.startswith('zstdlib/'):
-                    filename = os.path.join(os.path.dirname(__file__), '../../..', filename)
-                self.reader.insert_file(open(filename))
+                filename = resolve_source_path(line.split(maxsplit=1)[1].strip())
+                with open(filename) as f:
+                    source = f.read()
+                self.depends[filename] = hashlib.sha256(source.encode()).hexdigest()
+                self.reader.insert_file(io.StringIO(source))
+            elif line.startswith('.import'):
+                filename = resolve_source_path(line.split(maxsplit=1)[1].strip())
+                if (filename, current_name) not in self.imports:
+                    self.imports.append((filename, current_name))
             elif line.startswith('.entry'):
                 entry = line.split()[1]
-                return self.try_parse_imm(entry)
+                self.entry = self.try_parse_imm(entry)
             elif line.startswith('.align'):
                 current_section.align(self._parse_int(line.split()[1]))
             elif line.startswith('.db'):
@@ -112,64 +140,80 @@ class Parser(object):
 
         self.sections = sections
 
-    def resolve_label(self, name):
-        for section in self.sections.values():
-            addr = section.labels.get(name, None)
-            if addr:
-                return addr
+    def optimize(self):
+        """
+        run peephole optimizer over all sections, returns how many
+        instructions are removed
+        """
+        return Optimizer(self.sections).run()
+
+    def to_object(self):
+        """
+        assemble into a relocatable object, symbols are left to the linker
+        """
+        obj = ObjectFile()
+        obj.imports = list(self.imports)
+        obj.depends = dict(self.depends)
 
-    def get_entry(self):
         if type(self.entry) is Symbol:
-            return self.entry.resolve(self.resolve_label)
-        elif self.entry is not None:
-            return self.entry
-        elif self.resolve_label('start'):
-            return self.resolve_label('start')
+            obj.entry = self.entry.name
         else:
-            return 0x4000
-
-    def build(self):
-        sections = []
-        bodies = []
+            obj.entry = self.entry
 
         for name, section in self.sections.items():
             buff = io.BytesIO()
+            relocs = []
+            alignment = 1
 
             ip = section.addr
             for data in section.container:
+                offset = ip - section.addr
                 if type(data) is Instruction:
                     ins = data
                     if type(ins.imm) is Symbol:
                         sym = ins.imm
-                        buff.write(ins.compose(sym.resolve(self.resolve_label, ip)))
+                        kind = 'C' if ins.opcode.type_ == 'C' else 'I'
+                        relocs.append(Relocation(offset, kind, sym.name, sym.offset, sym.is_relative))
+                        buff.write(ins.compose(0))
                     else:
                         buff.write(ins.compose())
                     ip += 4
                 elif type(data) is Symbol:
-                    val = data.resolve(self.resolve_label, ip)
-                    buff.write(p32(val))
+                    relocs.append(Relocation(offset, 'W', data.name, data.offset, data.is_relative))
+                    buff.write(p32(0))
                     ip += 4
                 elif type(data) is bytes:
                     buff.write(data)
                     ip += len(data)
-
-            body = buff.getvalue()
-            self.section_bodies[name] = body
-
-            bodies.append(body)
-            sections.append(struct.pack('<HH',
-                section.addr, # section_addr
-                len(body),    # section_size
-            ))
-
-        header = struct.pack('<ccHHH',
-            b'Z', b'z',       # magic
-            0,                # file_ver
-            self.get_entry(), # entry
-            len(bodies),      # section_count
-        )
-
-        return header + b''.join(sections) + b''.join(bodies)
+                elif type(data) is Align:
+                    padding = data.padding(ip)
+                    buff.write(b'\0' * padding)
+                    ip += padding
+                    alignment = max(alignment, data.n)
+
+            inherited = self.initial_section and name == self.initial_section.upper()
+            sect = ObjectSection(name, None if inherited else section.addr,
+                                 buff.getvalue(), alignment)
+            sect.labels = {
+                label: addr - section.addr for label, addr in section.labels.items()
+            }
+            sect.relocs = relocs
+            obj.sections.append(sect)
+
+        return obj
+
+    def build(self, cache=None):
+        """
+        assemble and link with imported objects into an image
+        """
+        from .cache import ObjectCache
+
+        if cache is None:
+            cache = ObjectCache(None)
+
+        image, linker = cache.link(self.to_object())
+        self.section_bodies = linker.section_bodies
+        return image
 
     def parse_instruction(self, line):
         try:
@@ -187,7 +231,7 @@ class Parser(object):
             is_jmp = False
 
         if len(args) > 0:
-            if ins_name[0].upper() == 'J' or ins_name.upper() == 'CALL' or is_jmp:
+            if ins_name[0].upper() == 'J' or ins_name.upper() in ('CALL', 'LOOP') or is_jmp:
                 rel = True
             else:
                 rel = False
@@ -199,7 +243,14 @@ class Parser(object):
                 regs = args
             else:
                 regs = args[:-1]
-            yield Instruction(ins_name, *regs, imm=imm)
+
+            op = Opcodes.normalize(ins_name)
+            if op and op.type_ == 'C':
+                if len(regs) != 2:
+                    raise ValueError('expect register, constant and target\nline: %r' % line)
+                yield Instruction(ins_name, regs[0], imm=imm, const=self._parse_int(regs[1]))
+            else:
+                yield Instruction(ins_name, *regs, imm=imm)
         else:
             yield Instruction(ins_name, *args)
 
@@ -0,0 +1,286 @@
+"""
+in-process runtime, ctypes bindings of zzvm/libzzvm.so (make -C zzvm)
+
+    image = Parser(open('samples/echo.zasm')).build()
+    with VM(image) as vm:
+        vm.run()
+        print(vm.regs[Registers.RA])
+
+the library is searched in $ZZVM_LIB first, then next to this package in
+the source tree
+"""
+
+import ctypes
+import json
+import os
+
+__all__ = [ 'VM', 'ZZError', 'load_library', 'global_stats',
+            'ZZ_SUCCESS', 'ZZ_HALT', 'ZZ_SYSCALL_PENDING' ]
+
+# ZZVM API status, see zzvm.h
+ZZ_SYSCALL_PENDING = -6
+ZZ_NO_MEMORY = -5
+ZZ_HALT = -4
+ZZ_INVALID_INSTRUCTION = -3
+ZZ_INVALID_REGISTER = -2
+ZZ_OUT_BOUND = -1
+ZZ_SUCCESS = 0
+ZZ_FAILED = 1
+
+MEM_LIMIT = 0x10000
+
+# ZZ_STATS_* formats of zz_format_stats
+STATS_JSON = 0
+STATS_PROMETHEUS = 1
+
+class ZZError(Exception):
+    pass
+
+class Syscall(ctypes.Structure):
+    _fields_ = [ ('number', ctypes.c_uint16), ('args', ctypes.c_uint16 * 3) ]
+
+class Event(ctypes.Structure):
+    _fields_ = [ ('stop_reason', ctypes.c_int), ('syscall', Syscall),
+                 ('count_left', ctypes.c_int) ]
+
+SYSCALL_HANDLER = ctypes.CFUNCTYPE(ctypes.c_uint16, ctypes.c_void_p)
+
+_lib = None
+
+def load_library(path=None):
+    global _lib
+    if _lib is not None and path is None:
+        return _lib
+
+    if path is None:
+        path = os.environ.get('ZZVM_LIB') or os.path.join(
+            os.path.dirname(os.path.abspath(__file__)), '..', '..', '..', 'zzvm', 'libzzvm.so')
+
+    lib = ctypes.CDLL(path)
+    vp, u16, i32, sz = ctypes.c_void_p, ctypes.c_uint16, ctypes.c_int, ctypes.c_size_t
+
+    def sig(name, restype, *argtypes):
+        func = getattr(lib, name)
+        func.restype = restype
+        func.argtypes = argtypes
+
+    sig('zz_create', i32, ctypes.POINTER(vp))
+    sig('zz_destroy', i32, vp)
+    sig('zz_load_image_raw', i32, ctypes.c_char_p, sz, ctypes.POINTER(vp))
+    sig('zz_attach_image', i32, vp, vp)
+    sig('zz_free_image', None, vp)
+    sig('zz_execute', i32, vp, i32, ctypes.POINTER(i32))
+    sig('zz_run', i32, vp, i32, ctypes.POINTER(Event))
+    sig('zz_set_async_syscalls', i32, vp, ctypes.c_uint32)
+    sig('zz_complete_syscall', i32, vp, u16)
+    sig('zz_dispatch_syscall', i32, vp)
+    sig('zz_reg_syscall_handler', i32, vp, vp)
+    sig('zz_read_mem', i32, vp, u16, vp, sz)
+    sig('zz_write_mem', i32, vp, u16, vp, sz)
+    sig('zz_set_heap', i32, vp, u16, sz)
+    sig('zz_malloc', u16, vp, sz)
+    sig('zz_free', i32, vp, u16)
+    sig('zz_set_tiering', i32, vp, ctypes.c_uint, ctypes.c_uint)
+    sig('zz_registers', ctypes.POINTER(u16), vp)
+    sig('zz_memory', ctypes.POINTER(ctypes.c_uint8), vp)
+    sig('zz_get_stats', i32, vp, vp)
+    sig('zz_flush_stats', None, vp)
+    sig('zz_get_global_stats', i32, vp)
+    sig('zz_format_stats', i32, vp, i32, ctypes.c_char_p, sz)
+
+    _lib = lib
+    return lib
+
+def _format_stats(lib, getter, fmt):
+    # ZZ_STATS is only passed back to zz_format_stats, an opaque buffer will do
+    stats = ctypes.create_string_buffer(4096)
+    if getter(stats) != ZZ_SUCCESS:
+        raise ZZError('statistics are not compiled in')
+    size = lib.zz_format_stats(stats, fmt, None, 0) + 1
+    text = ctypes.create_string_buffer(size)
+    lib.zz_format_stats(stats, fmt, text, size)
+    text = text.value.decode()
+    return json.loads(text) if fmt == STATS_JSON else text
+
+def global_stats(fmt=STATS_JSON, lib=None):
+    """
+    process-wide counters of every vm flushed so far, a dict or the
+    Prometheus text with fmt=STATS_PROMETHEUS
+    """
+    lib = lib or load_library()
+    return _format_stats(lib, lib.zz_get_global_stats, fmt)
+
+class RegisterView(object):
+    """
+    registers of a vm, indexed by number or Registers.XX, no copy is made
+    """
+    def __init__(self, array):
+        self.array = array
+
+    def __getitem__(self, reg):
+        return self.array[int(reg)]
+
+    def __setitem__(self, reg, value):
+        self.array[int(reg)] = value & 0xffff
+
+    def __len__(self):
+        return len(self.array)
+
+class VM(object):
+    """
+    a guest, created from an image in the raw format of Parser.build()
+
+    regs is a live view of the eight registers (index with Registers.RA,
+    ...), memory is a writable memoryview of guest memory or None when the
+    library is built with PAGED=1 or tiering is on, use read() and write()
+    then
+    """
+    def __init__(self, image=None, lib=None):
+        self.lib = lib or load_library()
+        self._vm = ctypes.c_void_p()
+        self._image = None
+        self._handler = None
+        if self.lib.zz_create(ctypes.byref(self._vm)) != ZZ_SUCCESS:
+            raise ZZError('can not create vm')
+
+        self.regs = RegisterView(ctypes.cast(self.lib.zz_registers(self._vm),
+                                             ctypes.POINTER(ctypes.c_uint16 * 8)).contents)
+        self._map_memory()
+
+        if image is not None:
+            self.load(image)
+
+    def load(self, image):
+        """
+        map a built image and jump to its entry point
+        """
+        if self._image is not None:
+            raise ZZError('an image is already loaded')
+        handle = ctypes.c_void_p()
+        if not self.lib.zz_load_image_raw(image, len(image), ctypes.byref(handle)):
+            raise ZZError('malformed image')
+        if not self.lib.zz_attach_image(handle, self._vm):
+            self.lib.zz_free_image(handle)
+            raise ZZError('can not map image')
+        # pages of the image are shared with the vm, keep it until close()
+        self._image = handle
+
+    def read(self, addr, size):
+        buf = ctypes.create_string_buffer(size)
+        if self.lib.zz_read_mem(self._vm, addr, buf, size) != ZZ_SUCCESS:
+            raise ZZError('can not read guest memory')
+        return buf.raw
+
+    def write(self, addr, data):
+        if self.lib.zz_write_mem(self._vm, addr, bytes(data), len(data)) != ZZ_SUCCESS:
+            raise ZZError('can not write guest memory')
+
+    def set_heap(self, base, size):
+        if self.lib.zz_set_heap(self._vm, base, size) != ZZ_SUCCESS:
+            raise ZZError('invalid heap region')
+
+    def malloc(self, size):
+        """
+        guest address of a heap block, for buffers handed to the guest
+        """
+        addr = self.lib.zz_malloc(self._vm, size)
+        if addr == 0:
+            raise ZZError('guest heap exhausted')
+        return addr
+
+    def free(self, addr):
+        if self.lib.zz_free(self._vm, addr) != ZZ_SUCCESS:
+            raise ZZError('not a heap block')
+
+    def _map_memory(self):
+        mem = self.lib.zz_memory(self._vm)
+        if mem:
+            array = ctypes.cast(mem, ctypes.POINTER(ctypes.c_uint8 * MEM_LIMIT)).contents
+            self.memory = memoryview(array).cast('B')
+        else:
+            self.memory = None
+
+    def set_tiering(self, block_threshold, loop_threshold):
+        """
+        entries before a block runs decoded, 0 and 0 turn tiering off.
+        memory is None while it is on, writes through it would go unseen
+        """
+        if self.lib.zz_set_tiering(self._vm, block_threshold, loop_threshold) != ZZ_SUCCESS:
+            raise ZZError('vm is running')
+        self._map_memory()
+
+    def set_syscall_handler(self, handler):
+        """
+        handler is a ctypes function pointer or an address of a native
+        ZZ_SYSCALL_HANDLER, or a Python callable handler(vm) returning the
+        value for RA
+        """
+        if callable(handler) and not isinstance(handler, ctypes._CFuncPtr):
+            func = handler
+            handler = SYSCALL_HANDLER(lambda ctx: func(self) & 0xffff)
+        # keep a reference, the library only stores the pointer
+        self._handler = handler
+        address = ctypes.cast(handler, ctypes.c_void_p) if not isinstance(handler, int) \
+            else ctypes.c_void_p(handler)
+        self.lib.zz_reg_syscall_handler(self._vm, address)
+
+    def set_async_syscalls(self, mask):
+        if self.lib.zz_set_async_syscalls(self._vm, mask) != ZZ_SUCCESS:
+            raise ZZError('vm is busy')
+
+    def run(self, count=-1):
+        """
+        execute until HLT, an error, a pending syscall or count instructions,
+        returns the stop reason and the pending syscall (or None)
+        """
+        event = Event()
+        if self.lib.zz_run(self._vm, count, ctypes.byref(event)) != ZZ_SUCCESS:
+            raise ZZError('execution failed, stop_reason = %d' % event.stop_reason)
+        if event.stop_reason == ZZ_SYSCALL_PENDING:
+            sc = event.syscall
+            return event.stop_reason, (sc.number, tuple(sc.args))
+        return event.stop_reason, None
+
+    def complete_syscall(self, result=None):
+        """
+        finish a pending syscall with result, or with the syscall handler
+        """
+        if result is None:
+            status = self.lib.zz_dispatch_syscall(self._vm)
+        else:
+            status = self.lib.zz_complete_syscall(self._vm, result & 0xffff)
+        if status != ZZ_SUCCESS:
+            raise ZZError('no pending syscall')
+
+    def stats(self, fmt=STATS_JSON):
+        """
+        counters since the last flush_stats(), a dict or Prometheus text
+        """
+        return _format_stats(self.lib, lambda buf: self.lib.zz_get_stats(self._vm, buf), fmt)
+
+    def flush_stats(self):
+        self.lib.zz_flush_stats(self._vm)
+
+    def _free_image(self):
+        if self._image is not None:
+            self.lib.zz_free_image(self._image)
+            self._image = None
+
+    def close(self):
+        if self._vm:
+            self.regs = self.memory = None
+            self.lib.zz_destroy(self._vm)
+            self._vm = ctypes.c_void_p()
+            self._free_image()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __del__(self):
+        try:
+            self.close()
+        except Exception:
+            pass
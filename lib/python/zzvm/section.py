@@ -2,31 +2,68 @@ import io
 
 from .instruction import Instruction
 
+class Align(object):
+    """
+    padding marker, its size depends on the position it is laid out at
+    """
+    def __init__(self, n):
+        self.n = n
+
+    def __repr__(self):
+        return 'Align(%r)' % self.n
+
+    def padding(self, pos):
+        return -pos % self.n
+
 class Section(object):
     def __init__(self, addr=0x4000):
         self.container = []
         self.labels = {}
+        self.label_index = {}
         self.addr = addr
         self.ptr = addr
         self.alignment = 1
 
     def label(self, name):
         self.labels[name] = self.ptr
+        self.label_index[name] = len(self.container)
 
     def pos(self):
         return self.ptr
 
     def align(self, n=16):
         self.alignment = n
-        pos = self.ptr
-        if pos % self.alignment > 0:
-            self.write(b'\0' * (self.alignment - pos % self.alignment))
+        if n > 1:
+            marker = Align(n)
+            self.ptr += marker.padding(self.ptr)
+            self.container.append(marker)
 
     def write(self, data):
+        self.ptr += self.sizeof(data, self.ptr)
+        self.container.append(data)
+        self.align(self.alignment)
+
+    def sizeof(self, data, pos):
         if type(data) is bytes:
-            self.ptr += len(data)
+            return len(data)
         elif type(data) is Instruction:
-            self.ptr += 4
+            return 4
+        elif type(data) is Align:
+            return data.padding(pos)
+        return 0
 
-        self.container.append(data)
-        self.align(self.alignment)
+    def relayout(self):
+        """
+        recompute label addresses after container has been changed
+        """
+        positions = []
+        ptr = self.addr
+        for data in self.container:
+            positions.append(ptr)
+            ptr += self.sizeof(data, ptr)
+        positions.append(ptr)
+
+        self.ptr = ptr
+        self.labels = {
+            name: positions[index] for name, index in self.label_index.items()
+        }
@@ -0,0 +1,357 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "zzvm.h"
+#include "zzimage.h"
+#include "fuzz.h"
+
+#ifdef ZZ_UNIX_ENV
+#include <dirent.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+
+// largest input the mutator produces
+#define ZZ_FUZZ_MAX_INPUT 4096
+// instructions per exec, longer runs count as hangs
+#define ZZ_FUZZ_BUDGET    100000
+// havoc operations stacked on one input
+#define ZZ_FUZZ_STACK     8
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} ZZ_FUZZ_INPUT;
+
+typedef struct {
+    ZZVM *vm;
+    ZZ_SNAPSHOT *snapshot;
+    uint8_t *trace;         // coverage of the current exec
+    uint8_t virgin[ZZ_COVERAGE_SIZE]; // hit count buckets seen so far
+    ZZ_FUZZ_INPUT *corpus;
+    size_t corpus_count;
+    size_t corpus_cap;
+    const char *dir;
+    uint64_t rng;
+    uint64_t execs;
+    size_t edges;
+    size_t crashes;
+    size_t hangs;
+    size_t next_id;         // keeps ids of earlier sessions in the same dir
+} ZZ_FUZZER;
+
+enum { ZZ_FUZZ_OK, ZZ_FUZZ_CRASH, ZZ_FUZZ_HANG };
+
+// AFL hit count buckets, one bit per class
+static uint8_t zz_bucket[256];
+
+static void _zz_init_buckets(void)
+{
+    for(int i = 1; i < 256; i++) {
+        zz_bucket[i] = i == 1 ? 1 : i == 2 ? 2 : i == 3 ? 4 : i < 8 ? 8 :
+                       i < 16 ? 16 : i < 32 ? 32 : i < 128 ? 64 : 128;
+    }
+}
+
+static uint64_t _zz_rand(ZZ_FUZZER *fuzzer)
+{
+    uint64_t x = fuzzer->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return fuzzer->rng = x;
+}
+
+#define ZZ_RAND_BELOW(F, N) (_zz_rand(F) % (N))
+
+// run one input from the snapshot
+static int _zz_fuzz_exec(ZZ_FUZZER *fuzzer, const uint8_t *input, size_t len)
+{
+    ZZVM *vm = fuzzer->vm;
+    ZZ_EVENT event;
+    size_t pos = 0;
+    int left = ZZ_FUZZ_BUDGET;
+
+    // trace is cleared by _zz_fuzz_new_bits after every exec
+    zz_restore(vm, fuzzer->snapshot);
+    fuzzer->execs++;
+
+    while(1) {
+        if(zz_run(vm, left, &event) != ZZ_SUCCESS) {
+            return ZZ_FUZZ_CRASH;
+        }
+        if(event.stop_reason == ZZ_HALT) {
+            return ZZ_FUZZ_OK;
+        }
+        if(event.stop_reason != ZZ_SYSCALL_PENDING || event.count_left == 0) {
+            return ZZ_FUZZ_HANG;
+        }
+        left = event.count_left;
+
+        // stdin comes from input, output is discarded
+        uint16_t result = 0;
+        if(event.syscall.number == ZZ_SYS_READ) {
+            result = pos < len ? input[pos++] : 0xffff;
+        } else if(event.syscall.number == ZZ_SYS_WRITEN) {
+            result = event.syscall.args[1];
+        }
+        zz_complete_syscall(vm, result);
+    }
+}
+
+// merge trace into virgin unless discard is set and clear it, returns the
+// number of new edges or buckets
+static int _zz_fuzz_new_bits(ZZ_FUZZER *fuzzer, int discard)
+{
+    uint64_t *words = (uint64_t *)fuzzer->trace;
+    int found = 0;
+
+    // few edges are hit per exec, skip empty cache lines quickly
+    for(size_t w = 0; w < ZZ_COVERAGE_SIZE / sizeof(uint64_t); w += 8) {
+        uint64_t *line = &words[w];
+        if((line[0] | line[1] | line[2] | line[3] | line[4] | line[5] | line[6] | line[7]) == 0) {
+            continue;
+        }
+        for(size_t i = w * 8; !discard && i < w * 8 + 64; i++) {
+            uint8_t bits = zz_bucket[fuzzer->trace[i]];
+            if(bits & ~fuzzer->virgin[i]) {
+                if(fuzzer->virgin[i] == 0) {
+                    fuzzer->edges++;
+                }
+                fuzzer->virgin[i] |= bits;
+                found++;
+            }
+        }
+        memset(line, 0, 64);
+    }
+    return found;
+}
+
+static void _zz_fuzz_save(ZZ_FUZZER *fuzzer, const char *prefix, size_t id,
+                          const uint8_t *data, size_t len)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s-%06zu", fuzzer->dir, prefix, id);
+
+    FILE *fp = fopen(path, "wb");
+    if(fp == NULL) {
+        perror(path);
+        return;
+    }
+    fwrite(data, 1, len, fp);
+    fclose(fp);
+}
+
+static int _zz_fuzz_add(ZZ_FUZZER *fuzzer, const uint8_t *data, size_t len)
+{
+    if(fuzzer->corpus_count == fuzzer->corpus_cap) {
+        size_t cap = fuzzer->corpus_cap ? fuzzer->corpus_cap * 2 : 64;
+        ZZ_FUZZ_INPUT *corpus = realloc(fuzzer->corpus, cap * sizeof(ZZ_FUZZ_INPUT));
+        if(corpus == NULL) {
+            return 0;
+        }
+        fuzzer->corpus = corpus;
+        fuzzer->corpus_cap = cap;
+    }
+
+    ZZ_FUZZ_INPUT *entry = &fuzzer->corpus[fuzzer->corpus_count];
+    entry->data = malloc(len + 1);
+    if(entry->data == NULL) {
+        return 0;
+    }
+    memcpy(entry->data, data, len);
+    entry->len = len;
+    fuzzer->corpus_count++;
+    return 1;
+}
+
+// run input and keep it when it finds new coverage
+static void _zz_fuzz_one(ZZ_FUZZER *fuzzer, const uint8_t *data, size_t len, int save)
+{
+    int result = _zz_fuzz_exec(fuzzer, data, len);
+
+    if(result == ZZ_FUZZ_HANG) {
+        fuzzer->hangs++;
+    }
+    if(!_zz_fuzz_new_bits(fuzzer, result == ZZ_FUZZ_HANG)) {
+        return;
+    }
+
+    if(result == ZZ_FUZZ_CRASH) {
+        _zz_fuzz_save(fuzzer, "crash", ++fuzzer->crashes, data, len);
+    } else if(_zz_fuzz_add(fuzzer, data, len) && save) {
+        _zz_fuzz_save(fuzzer, "id", ++fuzzer->next_id, data, len);
+    }
+}
+
+static size_t _zz_fuzz_mutate(ZZ_FUZZER *fuzzer, uint8_t *buf, size_t len)
+{
+    static const uint8_t interesting[] = { 0, 1, '\n', ' ', '0', 'A', 0x7f, 0x80, 0xff };
+    int stack = 1 + ZZ_RAND_BELOW(fuzzer, ZZ_FUZZ_STACK);
+
+    for(int n = 0; n < stack; n++) {
+        size_t at = len ? ZZ_RAND_BELOW(fuzzer, len) : 0;
+
+        switch(ZZ_RAND_BELOW(fuzzer, len ? 7 : 2)) {
+            case 0: // insert a random byte
+            case 1:
+                if(len < ZZ_FUZZ_MAX_INPUT) {
+                    memmove(buf + at + 1, buf + at, len - at);
+                    buf[at] = _zz_rand(fuzzer);
+                    len++;
+                }
+                break;
+            case 2:
+                buf[at] ^= 1 << ZZ_RAND_BELOW(fuzzer, 8);
+                break;
+            case 3:
+                buf[at] = interesting[ZZ_RAND_BELOW(fuzzer, sizeof(interesting))];
+                break;
+            case 4:
+                if(_zz_rand(fuzzer) & 1) {
+                    buf[at] += 1 + ZZ_RAND_BELOW(fuzzer, 16);
+                } else {
+                    buf[at] -= 1 + ZZ_RAND_BELOW(fuzzer, 16);
+                }
+                break;
+            case 5: // delete a byte
+                memmove(buf + at, buf + at + 1, len - at - 1);
+                len--;
+                break;
+            case 6: { // splice the tail of another input
+                ZZ_FUZZ_INPUT *other = &fuzzer->corpus[ZZ_RAND_BELOW(fuzzer, fuzzer->corpus_count)];
+                if(other->len) {
+                    size_t from = ZZ_RAND_BELOW(fuzzer, other->len);
+                    size_t count = other->len - from;
+                    if(at + count > ZZ_FUZZ_MAX_INPUT) {
+                        count = ZZ_FUZZ_MAX_INPUT - at;
+                    }
+                    memcpy(buf + at, other->data + from, count);
+                    len = at + count;
+                }
+                break;
+            }
+        }
+    }
+    return len;
+}
+
+static void _zz_fuzz_load_seeds(ZZ_FUZZER *fuzzer)
+{
+    DIR *dir = opendir(fuzzer->dir);
+    struct dirent *ent;
+    uint8_t *buf = malloc(ZZ_FUZZ_MAX_INPUT);
+
+    while(dir && buf && (ent = readdir(dir)) != NULL) {
+        char path[4096];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", fuzzer->dir, ent->d_name);
+        if(ent->d_name[0] == '.' || strncmp(ent->d_name, "crash-", 6) == 0 ||
+           stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        size_t id;
+        if(sscanf(ent->d_name, "id-%zu", &id) == 1 && id > fuzzer->next_id) {
+            fuzzer->next_id = id;
+        }
+
+        FILE *fp = fopen(path, "rb");
+        if(fp) {
+            size_t len = fread(buf, 1, ZZ_FUZZ_MAX_INPUT, fp);
+            fclose(fp);
+            _zz_fuzz_one(fuzzer, buf, len, 0);
+        }
+    }
+
+    if(dir) {
+        closedir(dir);
+    }
+    free(buf);
+}
+
+// the coverage map lives in AFL's shared memory when started by afl tools
+static uint8_t *_zz_fuzz_bitmap(void)
+{
+    const char *shm_id = getenv("__AFL_SHM_ID");
+    if(shm_id) {
+        void *bitmap = shmat(atoi(shm_id), NULL, 0);
+        if(bitmap != (void *)-1) {
+            memset(bitmap, 0, ZZ_COVERAGE_SIZE);
+            return bitmap;
+        }
+        perror("shmat");
+    }
+    return calloc(1, ZZ_COVERAGE_SIZE);
+}
+
+int zz_fuzz(const char *filename, const char *corpus_dir, uint64_t max_execs)
+{
+    ZZ_FUZZER *fuzzer = calloc(1, sizeof(ZZ_FUZZER));
+    ZZ_IMAGE *image;
+    uint8_t buf[ZZ_FUZZ_MAX_INPUT];
+
+    if(fuzzer == NULL || zz_create(&fuzzer->vm) != ZZ_SUCCESS) {
+        fprintf(stderr, "Can not create vm\n");
+        return 0;
+    }
+    if(!zz_load_image_to_vm(filename, fuzzer->vm, &image)) {
+        return 0;
+    }
+
+    fuzzer->trace = _zz_fuzz_bitmap();
+    fuzzer->dir = corpus_dir;
+    fuzzer->rng = time(NULL) * 0x9e3779b97f4a7c15ULL | 1;
+    _zz_init_buckets();
+    mkdir(corpus_dir, 0755);
+
+    // every exec starts from the state right after loading
+    zz_set_async_syscalls(fuzzer->vm, ZZ_SYS_MASK_IO);
+    zz_set_coverage(fuzzer->vm, fuzzer->trace);
+    if(fuzzer->trace == NULL || zz_snapshot(fuzzer->vm, &fuzzer->snapshot) != ZZ_SUCCESS) {
+        fprintf(stderr, "Can not snapshot vm\n");
+        return 0;
+    }
+
+    _zz_fuzz_load_seeds(fuzzer);
+    if(fuzzer->corpus_count == 0) {
+        _zz_fuzz_add(fuzzer, (const uint8_t *)"", 0);
+    }
+
+    time_t start = time(NULL), last = start;
+    while(max_execs == 0 || fuzzer->execs < max_execs) {
+        ZZ_FUZZ_INPUT *seed = &fuzzer->corpus[ZZ_RAND_BELOW(fuzzer, fuzzer->corpus_count)];
+        memcpy(buf, seed->data, seed->len);
+        size_t len = _zz_fuzz_mutate(fuzzer, buf, seed->len);
+        _zz_fuzz_one(fuzzer, buf, len, 1);
+
+        if((fuzzer->execs & 0x3fff) == 0 && time(NULL) != last) {
+            last = time(NULL);
+            fprintf(stderr, "execs %llu (%llu/s), corpus %zu, edges %zu, crashes %zu, hangs %zu\n",
+                    (unsigned long long)fuzzer->execs,
+                    (unsigned long long)(fuzzer->execs / (last - start)),
+                    fuzzer->corpus_count, fuzzer->edges, fuzzer->crashes, fuzzer->hangs);
+        }
+    }
+
+    fprintf(stderr, "done: execs %llu, corpus %zu, edges %zu, crashes %zu, hangs %zu\n",
+            (unsigned long long)fuzzer->execs, fuzzer->corpus_count,
+            fuzzer->edges, fuzzer->crashes, fuzzer->hangs);
+
+    zz_destroy(fuzzer->vm);
+    zz_free_snapshot(fuzzer->snapshot);
+    zz_free_image(image);
+    return 1;
+}
+
+#else
+
+int zz_fuzz(const char *filename, const char *corpus_dir, uint64_t max_execs)
+{
+    fprintf(stderr, "fuzz needs a UNIX environment\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef ZZFUZZ_H
+#define ZZFUZZ_H
+
+#include <stdint.h>
+
+// coverage guided fuzzing of the stdin of an image, inputs which reach new
+// edges are saved as id-NNNNNN into corpus_dir and inputs which make the vm
+// fail as crash-NNNNNN, existing files there are used as seeds.
+// max_execs 0 runs forever
+int zz_fuzz(const char *filename, const char *corpus_dir, uint64_t max_execs);
+
+#endif
@@ -4,267 +4,146 @@
 #include <string.h>
 
 #include "zzvm.h"
+#include "zzimage.h"
+#include "serve.h"
+#include "fuzz.h"
+#include "zzperf.h"
 
-#define ZZ_IMAGE_MAGIC   0x7a5a /* 'Zz' */
-#define ZZ_IMAGE_VERSION 0x0
-
-typedef struct __attribute__((__packed__)) {
-    ZZ_ADDRESS section_addr;
-    ZZ_ADDRESS section_size;
-} ZZ_SECTION_HEADER;
-
-typedef struct __attribute__((__packed__)) {
-    uint16_t          magic;
-    uint16_t          file_ver;
-    ZZ_ADDRESS        entry;
-    uint16_t          section_count;
-    ZZ_SECTION_HEADER sections[0];
-} ZZ_IMAGE_HEADER;
-
-// decode a byte of Zz-encoded data (encoded) to buffer (out)
-int zz_decode_byte(const char *encoded, uint8_t *out)
-{
-    uint8_t value = 0;
-
-    for(int i = 0; i < 8; i++)
-    {
-        value <<= 1;
-        if(encoded[i] == 'Z') {
-            value |= 1;
-        } else if(encoded[i] != 'z') {
-            return 0;
-        }
-    }
-
-    *out = value;
-    return 1;
-}
-
-// decode Zz-encoded data from source (src) to buffer (dst)
-int zz_decode_data(void *dst, const void *src, size_t unpacked_size)
-{
-    uint8_t *dst8 = (uint8_t *)dst;
-    uint64_t i, val, packed_size;
-
-    for(i = 0; i < unpacked_size; i++) {
-        if(!zz_decode_byte(src + i * 8, &dst8[i])) {
-            return 0;
-        }
-    }
-
-    return 1;
-}
-
-// read and decode header data from file (fp) to buffer (header)
-int zz_read_image_header(FILE *fp, ZZ_IMAGE_HEADER *header)
-{
-    char buffer[sizeof(*header) * 8];
-
-    if(fread(buffer, sizeof(buffer), 1, fp) != 1) {
-        fprintf(stderr, "Unable to read file\n");
-        return 0;
-    }
-
-    if(!zz_decode_data(header, buffer, sizeof(*header))) {
-        fprintf(stderr, "Malformed file\n");
-        return 0;
-    }
-
-    return 1;
-}
-
-// verify header data (header), checking magic number and file version
-int zz_verify_image_header(ZZ_IMAGE_HEADER *header)
+// dump vm context and print
+void dump_vm_context(ZZVM *vm)
 {
-    if(header->magic != ZZ_IMAGE_MAGIC) {
-        fprintf(stderr, "Invalid file magic (%.4x)\n", header->magic);
-        return 0;
-    }
-
-    if(header->file_ver != ZZ_IMAGE_VERSION) {
-        fprintf(stderr, "Mismatch file version\n");
-        return 0;
-    }
-
-    return 1;
+    char buffer[1024];
+    zz_dump_context(&vm->ctx, buffer, sizeof(buffer));
+    puts(buffer);
 }
 
-// read and decode header->sections
-int zz_read_image_header_section(FILE *fp, ZZ_SECTION_HEADER *section)
+// load zz-image into vm and run, stats is a ZZ_STATS_* format or -1,
+// xmem_path a file mapped as extended memory in a ZZ_XMEM_* mode or NULL,
+// tier the block and loop thresholds of zz_set_tiering or NULL to interpret
+// only
+int run_file(const char *filename, int trace, int stats, const char *xmem_path,
+             int xmem_mode, const unsigned *tier)
 {
-    char buffer[sizeof(*section) * 8];
-
-    if(fread(buffer, sizeof(buffer), 1, fp) != 1) {
-        fprintf(stderr, "Can not read file section\n");
-        return 0;
-    }
-
-    if(!zz_decode_data(section, buffer, sizeof(*section))) {
-        fprintf(stderr, "Malformed file\n");
+    ZZVM *vm;
+    ZZ_IMAGE *image;
+    ZZ_XMEM *xmem = NULL;
+    if(zz_create(&vm) != ZZ_SUCCESS) {
+        fprintf(stderr, "Can not create vm\n");
         return 0;
     }
 
-    return 1;
-}
-
-// read and decode ZZ_IMAGE_HEADER
-int zz_load_image_header(FILE *fp, ZZ_IMAGE_HEADER **out_header)
-{
-    ZZ_IMAGE_HEADER *header = (ZZ_IMAGE_HEADER *)malloc(sizeof(ZZ_IMAGE_HEADER));
-
-    if(!zz_read_image_header(fp, header)) {
-        return 0;
-    }
-    if(!zz_verify_image_header(header)) {
+    if(!zz_load_image_to_vm(filename, vm, &image)) {
+        zz_destroy(vm);
         return 0;
     }
 
-    header = (ZZ_IMAGE_HEADER *)realloc(header, sizeof(ZZ_IMAGE_HEADER) +
-            sizeof(ZZ_SECTION_HEADER) * header->section_count);
-
-    for(int i = 0; i < header->section_count; i++) {
-        if(!zz_read_image_header_section(fp, &header->sections[i])) {
+    if(xmem_path) {
+        if(zz_xmem_open(xmem_path, xmem_mode, &xmem) != ZZ_SUCCESS) {
+            fprintf(stderr, "Can not map %s\n", xmem_path);
+            zz_destroy(vm);
+            zz_free_image(image);
             return 0;
         }
+        zz_set_xmem(vm, xmem);
     }
 
-    *out_header = header;
-    return 1;
-}
-
-// read, decode image and put things into an existed vm
-int zz_load_image_to_vm(const char *filename, ZZVM *vm, ZZ_IMAGE_HEADER **out_header)
-{
-    FILE *fp;
-    ZZ_IMAGE_HEADER *header = NULL;
-
-    if(strcmp(filename, "-") == 0 || filename == NULL) {
-        fp = stdin;
-    } else {
-        fp = fopen(filename, "rb");
-    }
-
-    if(!fp) {
-        fprintf(stderr, "Unable to open file\n");
-        return 0;
+    if(tier) {
+        zz_set_tiering(vm, tier[0], tier[1]);
     }
 
-    if(!zz_load_image_header(fp, &header)) {
-        return 0;
-    }
+    // synchronous, a trace must not lose or reorder lines when the async
+    // ring is full
+    zz_set_log(vm, stderr, ZZ_MSGL_MSG, 0);
 
-    vm->ctx.regs.IP = header->entry;
-
-    size_t buffer_size = 8192;
-    char *buffer = malloc(buffer_size);
-
-    for(int i = 0; i < header->section_count; i++) {
-        ZZ_SECTION_HEADER *section_header = &header->sections[i];
-
-        size_t size_bound = (size_t)section_header->section_addr +
-                            (size_t)section_header->section_size;
-        size_t encoded_size = section_header->section_size * 8;
-
-        if(size_bound >= sizeof(vm->ctx.memory)) {
-            fprintf(stderr, "Section#%d out of scope\n", i);
-            goto fail;
-        }
-
-        if(buffer_size < encoded_size) {
-            buffer_size = encoded_size;
-            buffer = realloc(buffer, buffer_size);
+    int stop_reason = ZZ_SUCCESS;
+    while(1) {
+        if(trace) {
+            char buffer[64];
+            ZZ_INSTRUCTION *ins = zz_fetch(&vm->ctx);
+            zz_disasm(vm->ctx.regs.IP, ins, buffer, sizeof(buffer) - 1);
+            zz_msg_f(vm, "[TRACE] %.4x: %s\n", vm->ctx.regs.IP, buffer);
+            dump_vm_context(vm);
         }
 
-        if(fread(buffer, encoded_size, 1, fp) != 1) {
-            fprintf(stderr, "Can not read section #%d\n", i);
-            goto fail;
+        if(stop_reason == ZZ_HALT) {
+            break;
         }
 
-        if(!zz_decode_data(&vm->ctx.memory[section_header->section_addr], buffer, section_header->section_size)) {
-            fprintf(stderr, "Malformed file\n");
-            goto fail;
+        if(zz_execute(vm, trace ? 1 : -1, &stop_reason) != ZZ_SUCCESS) {
+            zz_error_f(vm, "Failed to execute, stop_reason = %d\n", stop_reason);
+            break;
         }
     }
 
-    if(fp != stdin) fclose(fp);
-    if(out_header) {
-        *out_header = header;
-    } else {
-        free(header);
+    if(stats >= 0) {
+        ZZ_STATS counters;
+        char buffer[4096];
+        if(zz_get_stats(vm, &counters) == ZZ_SUCCESS) {
+            zz_format_stats(&counters, stats, buffer, sizeof(buffer));
+            fputs(buffer, stderr);
+        } else {
+            fprintf(stderr, "Statistics are not compiled in\n");
+        }
     }
-    free(buffer);
 
+    zz_destroy(vm);
+    zz_xmem_free(xmem);
+    zz_free_image(image);
+    zz_log_stop();
     return 1;
-
-fail:
-    if(fp && fp != stdin) fclose(fp);
-    if(header) free(header);
-    if(buffer) free(buffer);
-    return 0;
 }
 
-// dump vm context and print
-void dump_vm_context(ZZVM *vm)
-{
-    char buffer[1024];
-    zz_dump_context(&vm->ctx, buffer, sizeof(buffer));
-    puts(buffer);
-}
-
-// load zz-image into vm and run
-int run_file(const char *filename, int trace)
+// run zz-image under host counters, report to stderr
+int stat_file(const char *filename, int blocks)
 {
     ZZVM *vm;
+    ZZ_IMAGE *image;
+    ZZ_PERF perf;
     if(zz_create(&vm) != ZZ_SUCCESS) {
         fprintf(stderr, "Can not create vm\n");
         return 0;
     }
+    zz_set_log(vm, stderr, ZZ_MSGL_MSG, 0);
 
-    if(!zz_load_image_to_vm(filename, vm, NULL)) {
+    if(!zz_load_image_to_vm(filename, vm, &image)) {
+        zz_destroy(vm);
         return 0;
     }
 
-    zz_msg_pipe = stderr;
+    if(zz_perf_open(&perf, vm, blocks) != ZZ_SUCCESS) {
+        fprintf(stderr, "No performance counter is available\n");
+    }
 
     int stop_reason = ZZ_SUCCESS;
-    while(1) {
-        if(trace) {
-            char buffer[64];
-            ZZ_INSTRUCTION *ins = zz_fetch(&vm->ctx);
-            zz_disasm(vm->ctx.regs.IP, ins, buffer, sizeof(buffer) - 1);
-            fprintf(zz_msg_pipe, "[TRACE] %.4x: %s\n", vm->ctx.regs.IP, buffer);
-            dump_vm_context(vm);
-        }
-
-        if(stop_reason == ZZ_HALT) {
-            break;
-        }
-
-        if(zz_execute(vm, 1, &stop_reason) != ZZ_SUCCESS) {
-            fprintf(zz_msg_pipe, "Failed to execute, stop_reason = %d\n", stop_reason);
-            break;
-        }
+    zz_perf_start(&perf);
+    int result = zz_execute(vm, -1, &stop_reason);
+    zz_perf_stop(&perf);
+    if(result != ZZ_SUCCESS) {
+        zz_error_f(vm, "Failed to execute, stop_reason = %d\n", stop_reason);
     }
 
+    ZZ_STATS counters;
+    int has_stats = zz_get_stats(vm, &counters) == ZZ_SUCCESS;
+    zz_perf_report(stderr, &perf, has_stats ? &counters : NULL, image);
+
+    zz_perf_close(&perf);
     zz_destroy(vm);
-    return 1;
+    zz_free_image(image);
+    zz_log_stop();
+    return result == ZZ_SUCCESS;
 }
 
 // disassemble zz-image file
 int disassemble_file(const char *filename)
 {
-    ZZVM *vm;
-    if(zz_create(&vm) != ZZ_SUCCESS) {
-        fprintf(stderr, "Can not create vm\n");
-        return 0;
-    }
+    ZZ_IMAGE *image;
 
-    ZZ_IMAGE_HEADER *header;
-
-    if(!zz_load_image_to_vm(filename, vm, &header)) {
+    if(!zz_load_image(filename, &image)) {
         return 0;
     }
 
+    ZZ_IMAGE_HEADER *header = image->header;
+
     for(int i = 0; i < header->section_count; i++) {
         ZZ_SECTION_HEADER *section = &header->sections[i];
         ZZ_ADDRESS addr = section->section_addr;
@@ -279,7 +158,7 @@ int disassemble_file(const char *filename)
         char buffer[128];
 
         while(addr < addr_end) {
-            ZZ_INSTRUCTION* ins = (ZZ_INSTRUCTION *)&vm->ctx.memory[addr];
+            ZZ_INSTRUCTION* ins = (ZZ_INSTRUCTION *)&image->memory[addr];
             if(zz_disasm(addr, ins, buffer, sizeof(buffer)) != ZZ_SUCCESS) {
                 fprintf(stderr, "Can not disassemble at address %.4x\n", addr);
                 break;
@@ -293,18 +172,39 @@ int disassemble_file(const char *filename)
         while(addr < addr_end) {
             if((addr & 0xf) == 0)
                 printf("%.4x: ", addr);
-            printf("%.2x%c", vm->ctx.memory[addr], (addr & 0xf) == 0xf ? '\n' : ' ');
+            printf("%.2x%c", image->memory[addr], (addr & 0xf) == 0xf ? '\n' : ' ');
             addr++;
         }
 
         putchar('\n');
     }
 
-    free(header);
-    zz_destroy(vm);
+    zz_free_image(image);
     return 1;
 }
 
+// parse block[,loop] or off of --tier=, loop defaults to block
+int parse_tier(const char *arg, unsigned tier[2])
+{
+    char *end;
+
+    if(strcmp(arg, "off") == 0) {
+        tier[0] = tier[1] = 0;
+        return 1;
+    }
+    if(*arg < '0' || *arg > '9') {
+        return 0;
+    }
+    tier[0] = tier[1] = strtoul(arg, &end, 10);
+    if(*end == ',') {
+        if(end[1] < '0' || end[1] > '9') {
+            return 0;
+        }
+        tier[1] = strtoul(end + 1, &end, 10);
+    }
+    return *end == '\0';
+}
+
 void usage(const char *prog)
 {
     printf("zzvm\n\n"
@@ -318,13 +218,25 @@ void usage(const char *prog)
            "\n"
            "Usage: %s <command> zz-image\n\n"
            "  available command:\n"
-           "    run\n"
-           "      run until HLT instruction\n"
+           "    run [--stats[=prometheus]] [--xmem=file|--xmem-rw=file] [--tier=block[,loop]|off]\n"
+           "      run until HLT instruction, dump execution counters to stderr\n"
+           "      as JSON or Prometheus text, map file as extended memory,\n"
+           "      copy on write or written back with --xmem-rw,\n"
+           "      promote blocks after this many entries or turn tiering off\n"
+           "    stat [--blocks]\n"
+           "      run under host performance counters, report them per guest\n"
+           "      instruction and optionally the hottest guest blocks\n"
            "    trace\n"
            "      run one step and dump context until HLT instruction\n"
            "    disasm\n"
            "      disassemble a zz file\n"
-           , prog);
+           "\n"
+           "Usage: %s serve socket-path [workers]\n\n"
+           "  run uploaded images on a pool of workers vms, see docs/embedding.md\n"
+           "\n"
+           "Usage: %s fuzz zz-image corpus-dir [execs]\n\n"
+           "  feed mutated stdin to the image, keep inputs with new coverage\n"
+           , prog, prog, prog);
 }
 
 int main(int argc, const char * const argv[])
@@ -332,10 +244,47 @@ int main(int argc, const char * const argv[])
     if(argc < 3) {
         usage(argv[0]);
     } else if(argc >= 3) {
-        if(strcmp(argv[1], "trace") == 0) {
-            run_file(argv[2], 1);
+        if(strcmp(argv[1], "serve") == 0) {
+            int workers = argc > 3 ? atoi(argv[3]) : 4;
+            return zz_serve(argv[2], workers > 0 ? workers : 1) ? 0 : 1;
+        } else if(strcmp(argv[1], "fuzz") == 0 && argc >= 4) {
+            uint64_t execs = argc > 4 ? strtoull(argv[4], NULL, 0) : 0;
+            return zz_fuzz(argv[2], argv[3], execs) ? 0 : 1;
+        } else if(strcmp(argv[1], "stat") == 0) {
+            int blocks = strcmp(argv[2], "--blocks") == 0;
+            if(blocks && argc < 4) {
+                usage(argv[0]);
+                return 1;
+            }
+            return stat_file(argv[blocks ? 3 : 2], blocks) ? 0 : 1;
+        } else if(strcmp(argv[1], "trace") == 0) {
+            run_file(argv[2], 1, -1, NULL, 0, NULL);
         } else if(strcmp(argv[1], "run") == 0) {
-            run_file(argv[2], 0);
+            int stats = -1, i;
+            const char *xmem_path = NULL;
+            int xmem_mode = ZZ_XMEM_PRIVATE;
+            unsigned tier[2] = { ZZ_TIER_BLOCK_THRESHOLD, ZZ_TIER_LOOP_THRESHOLD };
+            for(i = 2; i < argc - 1; i++) {
+                if(strcmp(argv[i], "--stats") == 0) {
+                    stats = ZZ_STATS_JSON;
+                } else if(strcmp(argv[i], "--stats=prometheus") == 0) {
+                    stats = ZZ_STATS_PROMETHEUS;
+                } else if(strncmp(argv[i], "--xmem=", 7) == 0) {
+                    xmem_path = argv[i] + 7;
+                    xmem_mode = ZZ_XMEM_PRIVATE;
+                } else if(strncmp(argv[i], "--xmem-rw=", 10) == 0) {
+                    xmem_path = argv[i] + 10;
+                    xmem_mode = ZZ_XMEM_SHARED;
+                } else if(strncmp(argv[i], "--tier=", 7) == 0) {
+                    if(!parse_tier(argv[i] + 7, tier)) {
+                        usage(argv[0]);
+                        return 1;
+                    }
+                } else {
+                    break;
+                }
+            }
+            run_file(argv[i], 0, stats, xmem_path, xmem_mode, tier);
         } else if(strcmp(argv[1], "disasm") == 0) {
             disassemble_file(argv[2]);
         } else {
@@ -0,0 +1,478 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zzvm.h"
+#include "zzimage.h"
+#include "serve.h"
+
+#ifdef ZZ_UNIX_ENV
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// size limits of request payloads
+#define ZZ_SERVE_MAX_IMAGE (ZZ_MEM_LIMIT * 2)
+#define ZZ_SERVE_MAX_INPUT (16 << 20)
+// cached images, least recently used are evicted
+#define ZZ_SERVE_CACHE     256
+// guest output is sent in chunks of at most this size
+#define ZZ_SERVE_CHUNK     4096
+#define ZZ_MIN(A, B) ((A) < (B) ? (A) : (B))
+
+// digest and instruction limit in front of the stdin of a run request
+#define ZZ_SERVE_RUN_HEADER (ZZ_DIGEST_SIZE + 8)
+
+// instructions between budget checks and output flushes
+#define ZZ_SERVE_SLICE     (1 << 20)
+
+typedef struct {
+    uint8_t digest[ZZ_DIGEST_SIZE];  // SHA-256 of the raw image, its key
+    size_t size;                     // length of the raw image
+    ZZ_IMAGE *image;
+    int refs;           // running jobs, evicted only when zero
+    uint64_t last_used;
+} ZZ_CACHED_IMAGE;
+
+static ZZ_CACHED_IMAGE zz_cache[ZZ_SERVE_CACHE];
+static uint64_t zz_cache_clock = 0;
+static pthread_mutex_t zz_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// entry keyed by digest, the cache lock must be held
+static ZZ_CACHED_IMAGE *_zz_cache_find(const uint8_t *digest)
+{
+    for(int i = 0; i < ZZ_SERVE_CACHE; i++) {
+        if(zz_cache[i].image && memcmp(zz_cache[i].digest, digest, ZZ_DIGEST_SIZE) == 0) {
+            return &zz_cache[i];
+        }
+    }
+    return NULL;
+}
+
+// find an image and take a reference, NULL when it is not cached
+static ZZ_CACHED_IMAGE *_zz_cache_get(const uint8_t *digest)
+{
+    pthread_mutex_lock(&zz_cache_lock);
+    ZZ_CACHED_IMAGE *found = _zz_cache_find(digest);
+    if(found) {
+        found->refs++;
+        found->last_used = ++zz_cache_clock;
+    }
+    pthread_mutex_unlock(&zz_cache_lock);
+    return found;
+}
+
+static void _zz_cache_put(ZZ_CACHED_IMAGE *entry)
+{
+    pthread_mutex_lock(&zz_cache_lock);
+    entry->refs--;
+    pthread_mutex_unlock(&zz_cache_lock);
+}
+
+// decode and cache an uploaded image, an entry of the same digest is only
+// reused when its length matches as well
+static int _zz_cache_add(const uint8_t *data, size_t len, uint8_t *out_digest)
+{
+    ZZ_CACHED_IMAGE *entry;
+    ZZ_IMAGE *image;
+
+    zz_sha256(data, len, out_digest);
+    pthread_mutex_lock(&zz_cache_lock);
+    // the entry may be evicted once the lock is dropped
+    int cached = (entry = _zz_cache_find(out_digest)) != NULL;
+    int matches = cached && entry->size == len;
+    pthread_mutex_unlock(&zz_cache_lock);
+    if(cached) {
+        return matches;
+    }
+
+    if(!zz_load_image_raw(data, len, &image)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&zz_cache_lock);
+    if((entry = _zz_cache_find(out_digest)) != NULL) {
+        // uploaded by another connection meanwhile
+        zz_free_image(image);
+        pthread_mutex_unlock(&zz_cache_lock);
+        return entry->size == len;
+    }
+    ZZ_CACHED_IMAGE *victim = NULL;
+    for(int i = 0; i < ZZ_SERVE_CACHE; i++) {
+        ZZ_CACHED_IMAGE *e = &zz_cache[i];
+        if(e->refs == 0 && (victim == NULL || e->image == NULL ||
+                            (victim->image && e->last_used < victim->last_used))) {
+            victim = e;
+        }
+    }
+    if(victim == NULL) {
+        // every slot is running a job
+        zz_free_image(image);
+        pthread_mutex_unlock(&zz_cache_lock);
+        return 0;
+    }
+    zz_free_image(victim->image);
+    memcpy(victim->digest, out_digest, ZZ_DIGEST_SIZE);
+    victim->size = len;
+    victim->image = image;
+    victim->refs = 0;
+    victim->last_used = ++zz_cache_clock;
+    pthread_mutex_unlock(&zz_cache_lock);
+    return 1;
+}
+
+static int _zz_read_full(int fd, void *buffer, size_t len)
+{
+    uint8_t *p = buffer;
+    while(len > 0) {
+        ssize_t n = read(fd, p, len);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int _zz_write_full(int fd, const void *buffer, size_t len)
+{
+    const uint8_t *p = buffer;
+    while(len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+#define ZZ_FRAME_HEADER 5
+
+static void _zz_frame_header(uint8_t *header, uint8_t type, uint32_t len)
+{
+    header[0] = type;
+    header[1] = len;
+    header[2] = len >> 8;
+    header[3] = len >> 16;
+    header[4] = len >> 24;
+}
+
+// header and payload go out in one send unless the payload is large
+static int _zz_send_frame(int fd, uint8_t type, const void *payload, uint32_t len)
+{
+    uint8_t frame[ZZ_FRAME_HEADER + ZZ_SERVE_CHUNK];
+
+    _zz_frame_header(frame, type, len);
+    if(len > ZZ_SERVE_CHUNK) {
+        return _zz_write_full(fd, frame, ZZ_FRAME_HEADER) && _zz_write_full(fd, payload, len);
+    }
+    memcpy(frame + ZZ_FRAME_HEADER, payload, len);
+    return _zz_write_full(fd, frame, ZZ_FRAME_HEADER + len);
+}
+
+static int _zz_send_error(int fd, const char *msg)
+{
+    return _zz_send_frame(fd, ZZ_FRAME_ERROR, msg, strlen(msg));
+}
+
+// guest output buffered per job behind room for the frame header, sent as a
+// ZZ_FRAME_OUTPUT when the chunk is full, every ZZ_SERVE_SLICE instructions
+// and at the end of the job
+typedef struct {
+    int fd;
+    size_t used;
+    uint8_t frame[ZZ_FRAME_HEADER + ZZ_SERVE_CHUNK];
+} ZZ_OUTPUT;
+
+static int _zz_output_flush(ZZ_OUTPUT *out)
+{
+    int ok = 1;
+    if(out->used) {
+        _zz_frame_header(out->frame, ZZ_FRAME_OUTPUT, out->used);
+        ok = _zz_write_full(out->fd, out->frame, ZZ_FRAME_HEADER + out->used);
+    }
+    out->used = 0;
+    return ok;
+}
+
+static int _zz_output_byte(ZZ_OUTPUT *out, uint8_t c)
+{
+    out->frame[ZZ_FRAME_HEADER + out->used++] = c;
+    return out->used < ZZ_SERVE_CHUNK || _zz_output_flush(out);
+}
+
+// complete an I/O syscall of the job, returns 0 when the client is gone
+static int _zz_job_syscall(ZZVM *vm, ZZ_SYSCALL *sc, ZZ_OUTPUT *out,
+                           const uint8_t *input, size_t input_len, size_t *input_pos)
+{
+    uint16_t result = 0;
+
+    switch(sc->number) {
+        case ZZ_SYS_READ:
+            result = *input_pos < input_len ? input[(*input_pos)++] : 0xffff;
+            break;
+        case ZZ_SYS_WRITE:
+            if(!_zz_output_byte(out, sc->args[0])) {
+                return 0;
+            }
+            break;
+        case ZZ_SYS_WRITEN: {
+            ZZ_ADDRESS addr = sc->args[0];
+            for(uint16_t i = 0; i < sc->args[1]; i++) {
+                if(!_zz_output_byte(out, zz_mem_read8(&vm->ctx, addr + i))) {
+                    return 0;
+                }
+            }
+            result = sc->args[1];
+            break;
+        }
+    }
+    zz_complete_syscall(vm, result);
+    return 1;
+}
+
+// run request: digest (32), instruction limit (8, 0 = none), stdin
+static int _zz_serve_run(int fd, ZZVM *vm, const uint8_t *payload, size_t len)
+{
+    uint64_t limit, executed = 0;
+    ZZ_OUTPUT out = { fd, 0, { 0 } };
+    ZZ_EVENT event = { ZZ_SUCCESS };
+    int status = ZZ_SUCCESS;
+
+    if(len < ZZ_SERVE_RUN_HEADER) {
+        return _zz_send_error(fd, "malformed run request");
+    }
+    memcpy(&limit, payload + ZZ_DIGEST_SIZE, 8);
+
+    ZZ_CACHED_IMAGE *entry = _zz_cache_get(payload);
+    if(entry == NULL) {
+        return _zz_send_error(fd, "unknown image");
+    }
+
+    if(zz_reset(vm) != ZZ_SUCCESS || !zz_attach_image(entry->image, vm)) {
+        _zz_cache_put(entry);
+        return _zz_send_error(fd, "can not prepare vm");
+    }
+
+    size_t input_pos = 0;
+    uint64_t unflushed = 0;     // instructions since output was last sent
+    while(1) {
+        int count = ZZ_SERVE_SLICE;
+        if(limit) {
+            if(executed >= limit) {
+                event.stop_reason = ZZ_SUCCESS;
+                break;
+            }
+            if(limit - executed < ZZ_SERVE_SLICE) {
+                count = limit - executed;
+            }
+        }
+
+        status = zz_run(vm, count, &event);
+        if(status != ZZ_SUCCESS || event.stop_reason == ZZ_HALT) {
+            break;
+        }
+        if(event.stop_reason == ZZ_SYSCALL_PENDING) {
+            count -= event.count_left;
+            if(!_zz_job_syscall(vm, &event.syscall, &out, payload + ZZ_SERVE_RUN_HEADER,
+                                len - ZZ_SERVE_RUN_HEADER, &input_pos)) {
+                _zz_cache_put(entry);
+                return 0;
+            }
+        }
+        executed += count;
+
+        // long jobs stream their output a slice at a time
+        if((unflushed += count) >= ZZ_SERVE_SLICE) {
+            unflushed = 0;
+            if(!_zz_output_flush(&out)) {
+                _zz_cache_put(entry);
+                return 0;
+            }
+        }
+    }
+    _zz_cache_put(entry);
+    zz_flush_stats(vm);
+
+    // result: status, stop_reason, registers
+    uint8_t result[8 + sizeof(vm->ctx.registers)];
+    int32_t values[2] = { status, event.stop_reason };
+    memcpy(result, values, 8);
+    memcpy(result + 8, vm->ctx.registers, sizeof(vm->ctx.registers));
+    return _zz_output_flush(&out) && _zz_send_frame(fd, ZZ_FRAME_RESULT, result, sizeof(result));
+}
+
+// process-wide counters of every finished job as Prometheus text
+static int _zz_serve_stats(int fd)
+{
+    ZZ_STATS stats;
+    char buffer[4096];
+
+    if(zz_get_global_stats(&stats) != ZZ_SUCCESS) {
+        return _zz_send_error(fd, "statistics are not compiled in");
+    }
+    int len = zz_format_stats(&stats, ZZ_STATS_PROMETHEUS, buffer, sizeof(buffer));
+    return _zz_send_frame(fd, ZZ_FRAME_STATS, buffer, ZZ_MIN(len, (int)sizeof(buffer) - 1));
+}
+
+// free vms of the pool, a job takes one for its run and gives it back
+static ZZVM **zz_pool;
+static int zz_pool_idle = 0;
+static pthread_mutex_t zz_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zz_pool_ready = PTHREAD_COND_INITIALIZER;
+
+static ZZVM *_zz_pool_take(void)
+{
+    pthread_mutex_lock(&zz_pool_lock);
+    while(zz_pool_idle == 0) {
+        pthread_cond_wait(&zz_pool_ready, &zz_pool_lock);
+    }
+    ZZVM *vm = zz_pool[--zz_pool_idle];
+    pthread_mutex_unlock(&zz_pool_lock);
+    return vm;
+}
+
+static void _zz_pool_give(ZZVM *vm)
+{
+    pthread_mutex_lock(&zz_pool_lock);
+    zz_pool[zz_pool_idle++] = vm;
+    pthread_cond_signal(&zz_pool_ready);
+    pthread_mutex_unlock(&zz_pool_lock);
+}
+
+// every connection has a thread reading its frames, only run requests hold
+// a vm, so idle clients never keep one from other connections
+static void *_zz_serve_connection(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    uint8_t *payload = NULL;
+    uint8_t header[5];
+
+    while(_zz_read_full(fd, header, sizeof(header))) {
+        uint32_t len = header[1] | header[2] << 8 | header[3] << 16 | (uint32_t)header[4] << 24;
+        size_t max = header[0] == ZZ_FRAME_IMAGE ? ZZ_SERVE_MAX_IMAGE :
+                                                   ZZ_SERVE_MAX_INPUT + ZZ_SERVE_RUN_HEADER;
+        if(len > max) {
+            _zz_send_error(fd, "request too large");
+            break;
+        }
+
+        free(payload);
+        payload = malloc(len + 1);
+        if(payload == NULL || !_zz_read_full(fd, payload, len)) {
+            break;
+        }
+
+        int ok;
+        uint8_t digest[ZZ_DIGEST_SIZE];
+        ZZVM *vm;
+        switch(header[0]) {
+            case ZZ_FRAME_IMAGE:
+                if(_zz_cache_add(payload, len, digest)) {
+                    ok = _zz_send_frame(fd, ZZ_FRAME_HASH, digest, sizeof(digest));
+                } else {
+                    ok = _zz_send_error(fd, "can not load image");
+                }
+                break;
+            case ZZ_FRAME_RUN:
+                vm = _zz_pool_take();
+                ok = _zz_serve_run(fd, vm, payload, len);
+                _zz_pool_give(vm);
+                break;
+            case ZZ_FRAME_STATS:
+                ok = _zz_serve_stats(fd);
+                break;
+            default:
+                ok = _zz_send_error(fd, "unknown request");
+                break;
+        }
+        if(!ok) {
+            break;
+        }
+    }
+
+    free(payload);
+    close(fd);
+    return NULL;
+}
+
+int zz_serve(const char *path, int workers)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    pthread_attr_t attr;
+    int listen_fd;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return 0;
+    }
+    strcpy(addr.sun_path, path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if(listen_fd < 0 ||
+       bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       listen(listen_fd, 128) != 0) {
+        perror("Can not listen");
+        return 0;
+    }
+
+    zz_pool = calloc(workers, sizeof(ZZVM *));
+    if(zz_pool == NULL) {
+        fprintf(stderr, "Can not allocate vm pool\n");
+        return 0;
+    }
+
+    for(int i = 0; i < workers; i++) {
+        ZZVM *vm;
+        if(zz_create(&vm) != ZZ_SUCCESS) {
+            fprintf(stderr, "Can not create vm\n");
+            return 0;
+        }
+        zz_set_log(vm, stderr, ZZ_MSGL_WARN, 1);
+        zz_set_async_syscalls(vm, ZZ_SYS_MASK_IO);
+        _zz_pool_give(vm);
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    fprintf(stderr, "serving on %s with %d vms\n", path, workers);
+    while(1) {
+        pthread_t thread;
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Can not accept");
+            break;
+        }
+        if(pthread_create(&thread, &attr, _zz_serve_connection, (void *)(intptr_t)fd) != 0) {
+            fprintf(stderr, "Can not start connection thread\n");
+            close(fd);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+#else
+
+int zz_serve(const char *path, int workers)
+{
+    fprintf(stderr, "serve needs a UNIX environment\n");
+    return 0;
+}
+
+#endif
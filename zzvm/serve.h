@@ -0,0 +1,17 @@
+#ifndef ZZSERVE_H
+#define ZZSERVE_H
+
+// frames of the serve protocol: type (1), payload length (4, LE), payload
+#define ZZ_FRAME_IMAGE  'I' // raw image from Parser.build(), replied with HASH
+#define ZZ_FRAME_RUN    'R' // image digest (32), instruction limit (8, 0 = none), stdin
+#define ZZ_FRAME_STATS  'S' // empty request, replied with Prometheus text of all jobs
+#define ZZ_FRAME_HASH   'H' // SHA-256 of an uploaded image (32), its cache key
+#define ZZ_FRAME_OUTPUT 'O' // a chunk of guest stdout
+#define ZZ_FRAME_RESULT 'X' // status (4), stop_reason (4), registers (16)
+#define ZZ_FRAME_ERROR  'E' // error message, the connection stays usable
+
+// listen on unix socket path, serve every connection on a thread of its own
+// and run up to workers jobs at once on a pool of vms, returns only on failure
+int zz_serve(const char *path, int workers);
+
+#endif
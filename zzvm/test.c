@@ -33,7 +33,18 @@ int main()
         MAKE_INS( ZZOP_SHRI, ZZ_R2, ZZ_R1, 8|1    ), // 4054: SHR   R2, R1, 0x0009
         MAKE_INS( ZZOP_MOVI, ZZ_R3, 0,     4      ), // 4058: MOV   R3, 0x0004
         MAKE_INS( ZZOP_SHRR, ZZ_RA, ZZ_RA, 3      ), // 405c: SHR   RA, RA, R3
-        MAKE_INS( ZZOP_HLT,  0,     0,     0      ), // 4060: HLT
+        MAKE_INS( ZZOP_MOVI, ZZ_R1, 0,     3      ), // 4060: MOV   R1, 0x0003
+        MAKE_INS( ZZOP_MOVI, ZZ_R2, 0,     0      ), // 4064: MOV   R2, 0x0000
+        MAKE_INS( ZZOP_ADDI, ZZ_R2, ZZ_R2, 2      ), // 4068: ADD   R2, 0x0002
+        MAKE_INS( ZZOP_STR,  ZZ_R1, ZZ_R4, ZZ_R2  ), // 406c: ST    R1, R4, R2
+        MAKE_INS( ZZOP_LOOP, ZZ_R1, 0,     -12    ), // 4070: LOOP  R1, 0x4068
+        MAKE_INS( ZZOP_LDR,  ZZ_R3, ZZ_R4, ZZ_R2  ), // 4074: LD    R3, R4, R2
+        MAKE_INS( ZZOP_JEC,  ZZ_R3, 0,     0x101  ), // 4078: JEC   R3, 0x0001, 0x4080
+        MAKE_INS( ZZOP_NOP,  0,     0,     0      ), // 407c: NOP
+        MAKE_INS( ZZOP_MOVI, ZZ_R5, 0,     0xffff ), // 4080: MOV   R5, 0xffff
+        MAKE_INS( ZZOP_JSGI, ZZ_R3, ZZ_R5, 4      ), // 4084: JSG   R3, R5, 0x408c
+        MAKE_INS( ZZOP_NOP,  0,     0,     0      ), // 4088: NOP
+        MAKE_INS( ZZOP_HLT,  0,     0,     0      ), // 408c: HLT
     };
 
     for(i = 0; i < sizeof(ins) / sizeof(ins[0]); i++) {
@@ -59,4 +70,19 @@ int main()
 
     zz_execute(vm, -1, &reason);
     zz_dump_context(&vm->ctx, buffer, sizeof(buffer)); printf("%s", buffer);
+
+    // only the address zz_malloc returned frees a block, and only once
+    ZZ_ADDRESS block = zz_malloc(vm, 32);
+    if(block == 0 ||
+       zz_free(vm, block + ZZ_HEAP_ALIGN) != ZZ_FAILED ||
+       zz_free(vm, block + 2 * ZZ_HEAP_ALIGN) != ZZ_FAILED ||
+       zz_free(vm, block) != ZZ_SUCCESS ||
+       zz_free(vm, block) != ZZ_FAILED) {
+        printf("Heap accepted a bad free\n");
+        return 1;
+    }
+    printf("heap: ok\n");
+
+    zz_destroy(vm);
+    return 0;
 }
@@ -10,6 +10,9 @@
  *
  *     - I means I-type instruction
  *     - R means R-type instruction
+ *     - C means C-type instruction, I-type with the immediate split into a
+ *       signed 8-bit constant (high byte) and a signed 8-bit jump offset
+ *       counted in instructions (low byte)
  *
  * `C` means how many registers are used in this instruciton
  */
@@ -46,4 +49,11 @@ enum ZZOP {
     ZZOP_PUSI   = 0x1c, // I 0
     ZZOP_SYS    = 0x1d, // R 0
     ZZOP_RAND   = 0x1e, // R 0
+    ZZOP_JEC    = 0x1f, // C 1
+    ZZOP_JNC    = 0x20, // C 1
+    ZZOP_JGC    = 0x21, // C 1
+    ZZOP_JSGI   = 0x22, // I 2
+    ZZOP_LOOP   = 0x23, // I 1
+    ZZOP_LDR    = 0x24, // R 3
+    ZZOP_STR    = 0x25, // R 3
 };
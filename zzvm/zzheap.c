@@ -0,0 +1,308 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zzvm.h"
+
+// the heap is cut into granules of ZZ_HEAP_ALIGN bytes, blocks are runs of
+// granules and every bookkeeping entry is indexed by granule
+#define ZZ_HEAP_NONE 0xffff
+// size classes by the highest set bit of the granule count
+#define ZZ_HEAP_CLASSES 14
+
+#define ZZ_HEAP_HEAD 1  // first granule of a block
+#define ZZ_HEAP_USED 2  // with ZZ_HEAP_HEAD, block is allocated
+
+typedef struct {
+    uint16_t size;  // granules of the block, valid at its head
+    uint16_t head;  // valid at the last granule of a block
+    uint16_t next;  // free list links, valid at free heads
+    uint16_t prev;
+    uint8_t flags;
+} ZZ_HEAP_GRANULE;
+
+struct ZZ_HEAP {
+    ZZ_ADDRESS base;
+    uint32_t count;
+    uint32_t classes;   // bit per size class with a non-empty free list
+    uint16_t lists[ZZ_HEAP_CLASSES];
+    ZZ_HEAP_GRANULE g[];
+};
+
+#define ZZ_HEAP_BYTES(COUNT) (sizeof(ZZ_HEAP) + (COUNT) * sizeof(ZZ_HEAP_GRANULE))
+
+static int _zz_heap_class(uint32_t size)
+{
+    int c = 0;
+    while(size >>= 1) {
+        c++;
+    }
+    return c;
+}
+
+static void _zz_heap_unlink(ZZ_HEAP *heap, uint16_t start)
+{
+    ZZ_HEAP_GRANULE *g = heap->g;
+    int c = _zz_heap_class(g[start].size);
+
+    if(g[start].prev != ZZ_HEAP_NONE) {
+        g[g[start].prev].next = g[start].next;
+    } else if((heap->lists[c] = g[start].next) == ZZ_HEAP_NONE) {
+        heap->classes &= ~(1u << c);
+    }
+    if(g[start].next != ZZ_HEAP_NONE) {
+        g[g[start].next].prev = g[start].prev;
+    }
+}
+
+static void _zz_heap_mark(ZZ_HEAP *heap, uint16_t start, uint16_t size, uint8_t flags)
+{
+    heap->g[start].size = size;
+    heap->g[start].flags = flags;
+    heap->g[start + size - 1].head = start;
+}
+
+// add a free block, its neighbours must be allocated already
+static void _zz_heap_push(ZZ_HEAP *heap, uint16_t start, uint16_t size)
+{
+    ZZ_HEAP_GRANULE *g = heap->g;
+    int c = _zz_heap_class(size);
+
+    _zz_heap_mark(heap, start, size, ZZ_HEAP_HEAD);
+    g[start].prev = ZZ_HEAP_NONE;
+    g[start].next = heap->lists[c];
+    if(heap->lists[c] != ZZ_HEAP_NONE) {
+        g[heap->lists[c]].prev = start;
+    }
+    heap->lists[c] = start;
+    heap->classes |= 1u << c;
+}
+
+static int _zz_heap_free(ZZ_HEAP *heap, uint16_t start)
+{
+    return start < heap->count && !(heap->g[start].flags & ZZ_HEAP_USED);
+}
+
+// free an allocated block and merge it with free neighbours
+static void _zz_heap_release(ZZ_HEAP *heap, uint16_t start)
+{
+    ZZ_HEAP_GRANULE *g = heap->g;
+    uint16_t size = g[start].size;
+    uint16_t next = start + size;
+
+    if(_zz_heap_free(heap, next)) {
+        _zz_heap_unlink(heap, next);
+        size += g[next].size;
+        g[next].flags = 0;
+    }
+    if(start > 0 && _zz_heap_free(heap, g[start - 1].head)) {
+        uint16_t prev = g[start - 1].head;
+        _zz_heap_unlink(heap, prev);
+        g[start].flags = 0;
+        size += g[prev].size;
+        start = prev;
+    }
+    _zz_heap_push(heap, start, size);
+}
+
+// segregated fit: first fit inside the class of size, otherwise any block
+// of a larger class, which is large enough by construction
+static uint16_t _zz_heap_alloc(ZZ_HEAP *heap, uint16_t size)
+{
+    ZZ_HEAP_GRANULE *g = heap->g;
+    int c = _zz_heap_class(size);
+    uint16_t start;
+
+    for(start = heap->lists[c]; start != ZZ_HEAP_NONE; start = g[start].next) {
+        if(g[start].size >= size) {
+            break;
+        }
+    }
+    if(start == ZZ_HEAP_NONE) {
+        uint32_t larger = heap->classes & ~((2u << c) - 1);
+        if(larger == 0) {
+            return ZZ_HEAP_NONE;
+        }
+        for(c++; !(larger & (1u << c)); c++);
+        start = heap->lists[c];
+    }
+
+    uint16_t left = g[start].size - size;
+    _zz_heap_unlink(heap, start);
+    _zz_heap_mark(heap, start, size, ZZ_HEAP_HEAD | ZZ_HEAP_USED);
+    if(left) {
+        _zz_heap_push(heap, start + size, left);
+    }
+    return start;
+}
+
+static ZZ_HEAP *_zz_heap_create(ZZ_ADDRESS base, size_t size)
+{
+    uint32_t count = size / ZZ_HEAP_ALIGN;
+    // cleared flags, only heads of blocks may look allocated to _zz_heap_find
+    ZZ_HEAP *heap = calloc(1, ZZ_HEAP_BYTES(count));
+    if(heap == NULL) {
+        return NULL;
+    }
+
+    heap->base = base;
+    heap->count = count;
+    heap->classes = 0;
+    for(int i = 0; i < ZZ_HEAP_CLASSES; i++) {
+        heap->lists[i] = ZZ_HEAP_NONE;
+    }
+    if(count) {
+        _zz_heap_push(heap, 0, count);
+    }
+    return heap;
+}
+
+static ZZ_HEAP *_zz_heap_get(ZZVM *vm)
+{
+    if(vm->heap == NULL) {
+        vm->heap = _zz_heap_create(ZZ_HEAP_BASE, ZZ_HEAP_SIZE);
+    }
+    return vm->heap;
+}
+
+// granule of an allocated block at addr, ZZ_HEAP_NONE for anything else
+static uint16_t _zz_heap_find(ZZVM *vm, ZZ_HEAP *heap, ZZ_ADDRESS addr)
+{
+    uint16_t offset = addr - heap->base;
+    uint16_t start = offset / ZZ_HEAP_ALIGN;
+
+    if(addr < heap->base || offset % ZZ_HEAP_ALIGN || start >= heap->count ||
+       heap->g[start].flags != (ZZ_HEAP_HEAD | ZZ_HEAP_USED)) {
+        zz_warn_f(vm, "[WARN] %.4x is not an allocated heap block\n", addr);
+        return ZZ_HEAP_NONE;
+    }
+    return start;
+}
+
+int zz_set_heap(ZZVM *vm, ZZ_ADDRESS base, size_t size)
+{
+    if(vm->state != ZZ_ST_SLEEP && vm->state != ZZ_ST_WAIT) {
+        return ZZ_FAILED;
+    }
+    if(base == 0 || base % ZZ_HEAP_ALIGN || size % ZZ_HEAP_ALIGN || base + size > ZZ_MEM_LIMIT) {
+        return ZZ_FAILED;
+    }
+
+    ZZ_HEAP *heap = _zz_heap_create(base, size);
+    if(heap == NULL) {
+        return ZZ_FAILED;
+    }
+    zz_free_heap(vm->heap);
+    vm->heap = heap;
+    return ZZ_SUCCESS;
+}
+
+ZZ_ADDRESS zz_malloc(ZZVM *vm, size_t size)
+{
+    ZZ_HEAP *heap = _zz_heap_get(vm);
+    if(heap == NULL || size == 0 || size > heap->count * ZZ_HEAP_ALIGN) {
+        return 0;
+    }
+
+    uint16_t start = _zz_heap_alloc(heap, (size + ZZ_HEAP_ALIGN - 1) / ZZ_HEAP_ALIGN);
+    return start == ZZ_HEAP_NONE ? 0 : heap->base + start * ZZ_HEAP_ALIGN;
+}
+
+int zz_free(ZZVM *vm, ZZ_ADDRESS addr)
+{
+    ZZ_HEAP *heap = _zz_heap_get(vm);
+    if(addr == 0) {
+        return ZZ_SUCCESS;
+    }
+    if(heap == NULL) {
+        return ZZ_FAILED;
+    }
+
+    uint16_t start = _zz_heap_find(vm, heap, addr);
+    if(start == ZZ_HEAP_NONE) {
+        return ZZ_FAILED;
+    }
+    _zz_heap_release(heap, start);
+    return ZZ_SUCCESS;
+}
+
+ZZ_ADDRESS zz_realloc(ZZVM *vm, ZZ_ADDRESS addr, size_t size)
+{
+    ZZ_HEAP *heap = _zz_heap_get(vm);
+    if(addr == 0) {
+        return zz_malloc(vm, size);
+    }
+    if(size == 0) {
+        zz_free(vm, addr);
+        return 0;
+    }
+    if(heap == NULL || size > heap->count * ZZ_HEAP_ALIGN) {
+        return 0;
+    }
+
+    ZZ_HEAP_GRANULE *g = heap->g;
+    uint16_t start = _zz_heap_find(vm, heap, addr);
+    if(start == ZZ_HEAP_NONE) {
+        return 0;
+    }
+
+    uint16_t want = (size + ZZ_HEAP_ALIGN - 1) / ZZ_HEAP_ALIGN;
+    uint16_t have = g[start].size;
+    uint16_t next = start + have;
+
+    // shrink in place, the tail becomes a block of its own and is freed
+    if(want < have) {
+        _zz_heap_mark(heap, start, want, ZZ_HEAP_HEAD | ZZ_HEAP_USED);
+        _zz_heap_mark(heap, start + want, have - want, ZZ_HEAP_HEAD | ZZ_HEAP_USED);
+        _zz_heap_release(heap, start + want);
+        return addr;
+    } else if(want == have) {
+        return addr;
+    }
+
+    // grow into a free successor
+    if(_zz_heap_free(heap, next) && have + g[next].size >= want) {
+        uint16_t total = have + g[next].size;
+        _zz_heap_unlink(heap, next);
+        g[next].flags = 0;
+        _zz_heap_mark(heap, start, want, ZZ_HEAP_HEAD | ZZ_HEAP_USED);
+        if(total > want) {
+            _zz_heap_push(heap, start + want, total - want);
+        }
+        return addr;
+    }
+
+    uint16_t moved = _zz_heap_alloc(heap, want);
+    if(moved == ZZ_HEAP_NONE) {
+        return 0;
+    }
+    ZZ_ADDRESS dst = heap->base + moved * ZZ_HEAP_ALIGN;
+    zz_mem_copy(&vm->ctx, dst, addr, have * ZZ_HEAP_ALIGN);
+    _zz_heap_release(heap, start);
+    return dst;
+}
+
+int zz_copy_heap(ZZ_HEAP **dst, const ZZ_HEAP *src)
+{
+    if(src == NULL) {
+        zz_free_heap(*dst);
+        *dst = NULL;
+        return ZZ_SUCCESS;
+    }
+
+    if(*dst == NULL || (*dst)->count != src->count) {
+        ZZ_HEAP *heap = malloc(ZZ_HEAP_BYTES(src->count));
+        if(heap == NULL) {
+            return ZZ_FAILED;
+        }
+        zz_free_heap(*dst);
+        *dst = heap;
+    }
+    memcpy(*dst, src, ZZ_HEAP_BYTES(src->count));
+    return ZZ_SUCCESS;
+}
+
+void zz_free_heap(ZZ_HEAP *heap)
+{
+    free(heap);
+}
@@ -0,0 +1,538 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zzvm.h"
+#include "zzimage.h"
+
+#ifdef ZZ_UNIX_ENV
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// decode a byte of Zz-encoded data (encoded) to buffer (out)
+int zz_decode_byte(const char *encoded, uint8_t *out)
+{
+    uint8_t value = 0;
+
+    for(int i = 0; i < 8; i++)
+    {
+        value <<= 1;
+        if(encoded[i] == 'Z') {
+            value |= 1;
+        } else if(encoded[i] != 'z') {
+            return 0;
+        }
+    }
+
+    *out = value;
+    return 1;
+}
+
+// decode Zz-encoded data from source (src) to buffer (dst)
+int zz_decode_data(void *dst, const void *src, size_t unpacked_size)
+{
+    uint8_t *dst8 = (uint8_t *)dst;
+    const char *src8 = (const char *)src;
+
+    for(size_t i = 0; i < unpacked_size; i++) {
+        if(!zz_decode_byte(src8 + i * 8, &dst8[i])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// verify header data (header), checking magic number and file version
+static int zz_verify_image_header(ZZ_IMAGE_HEADER *header)
+{
+    if(header->magic != ZZ_IMAGE_MAGIC) {
+        fprintf(stderr, "Invalid file magic (%.4x)\n", header->magic);
+        return 0;
+    }
+
+    if(header->file_ver != ZZ_IMAGE_VERSION) {
+        fprintf(stderr, "Mismatch file version\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+void zz_free_image(ZZ_IMAGE *image)
+{
+    if(image == NULL) {
+        return;
+    }
+#ifdef ZZ_UNIX_ENV
+    if(image->mapping) {
+        munmap(image->mapping, image->mapping_size);
+        free(image);
+        return;
+    }
+#endif
+    free(image->header);
+    free(image->memory);
+    free(image);
+}
+
+static void _zz_mark_leader(ZZ_IMAGE *image, uint32_t addr)
+{
+    if(addr < ZZ_MEM_LIMIT && (addr & (sizeof(ZZ_INSTRUCTION) - 1)) == 0) {
+        image->leaders[addr >> 5] |= 1 << ((addr >> 2) & 7);
+    }
+}
+
+// recover basic block boundaries from the branches in every present page,
+// data decoded as code only adds a few spurious leaders
+static void _zz_find_leaders(ZZ_IMAGE *image)
+{
+    memset(image->leaders, 0, sizeof(image->leaders));
+    _zz_mark_leader(image, image->header->entry);
+
+    for(uint32_t addr = 0; addr < ZZ_MEM_LIMIT; addr += sizeof(ZZ_INSTRUCTION)) {
+        if(!image->present[addr >> ZZ_PAGE_SHIFT]) {
+            continue;
+        }
+
+        ZZ_INSTRUCTION *ins = (ZZ_INSTRUCTION *)&image->memory[addr];
+        uint32_t next = addr + sizeof(ZZ_INSTRUCTION);
+        switch(ins->op) {
+            case ZZOP_JEI:
+            case ZZOP_JNI:
+            case ZZOP_JGI:
+            case ZZOP_JZI:
+            case ZZOP_JSGI:
+            case ZZOP_LOOP:
+            case ZZOP_CALL:
+                _zz_mark_leader(image, (ZZ_ADDRESS)(next + ins->imm));
+                _zz_mark_leader(image, next);
+                break;
+            case ZZOP_JEC:
+            case ZZOP_JNC:
+            case ZZOP_JGC:
+                _zz_mark_leader(image, (ZZ_ADDRESS)(next + ZZ_C_OFFSET(ins->imm)));
+                _zz_mark_leader(image, next);
+                break;
+            case ZZOP_RET:
+            case ZZOP_HLT:
+                _zz_mark_leader(image, next);
+                break;
+        }
+    }
+}
+
+int zz_load_image_raw(const void *data, size_t size, ZZ_IMAGE **out_image)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    ZZ_IMAGE_HEADER header;
+    ZZ_IMAGE *image = NULL;
+
+    if(size < sizeof(header)) {
+        fprintf(stderr, "Unable to read file\n");
+        return 0;
+    }
+    memcpy(&header, p, sizeof(header));
+    if(!zz_verify_image_header(&header)) {
+        return 0;
+    }
+
+    size_t headers_size = sizeof(ZZ_IMAGE_HEADER) +
+                          sizeof(ZZ_SECTION_HEADER) * header.section_count;
+    if(size < headers_size) {
+        fprintf(stderr, "Can not read file section\n");
+        return 0;
+    }
+
+    image = (ZZ_IMAGE *)calloc(1, sizeof(ZZ_IMAGE));
+    if(image == NULL ||
+       (image->memory = calloc(1, ZZ_MEM_LIMIT)) == NULL ||
+       (image->header = malloc(headers_size)) == NULL) {
+        fprintf(stderr, "Can not allocate image\n");
+        goto fail;
+    }
+    memcpy(image->header, p, headers_size);
+
+    size_t offset = headers_size;
+    for(int i = 0; i < header.section_count; i++) {
+        ZZ_SECTION_HEADER *section_header = &image->header->sections[i];
+
+        size_t size_bound = (size_t)section_header->section_addr +
+                            (size_t)section_header->section_size;
+
+        if(size_bound >= ZZ_MEM_LIMIT) {
+            fprintf(stderr, "Section#%d out of scope\n", i);
+            goto fail;
+        }
+
+        if(size - offset < section_header->section_size) {
+            fprintf(stderr, "Can not read section #%d\n", i);
+            goto fail;
+        }
+
+        memcpy(&image->memory[section_header->section_addr], p + offset,
+               section_header->section_size);
+        offset += section_header->section_size;
+
+        if(section_header->section_size > 0) {
+            size_t first = section_header->section_addr >> ZZ_PAGE_SHIFT;
+            size_t last = (size_bound - 1) >> ZZ_PAGE_SHIFT;
+            memset(&image->present[first], 1, last - first + 1);
+        }
+    }
+
+    _zz_find_leaders(image);
+    *out_image = image;
+    return 1;
+
+fail:
+    zz_free_image(image);
+    return 0;
+}
+
+// hash a word at a time, checksums cache entries
+static uint64_t _zz_hash(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t hash = 0xcbf29ce484222325ULL ^ len;
+
+    for(; len >= sizeof(uint64_t); p += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    for(; len > 0; p++, len--) {
+        hash = (hash ^ *p) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static const uint32_t ZZ_SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ZZ_ROTR(X, N) (((X) >> (N)) | ((X) << (32 - (N))))
+
+static void _zz_sha256_block(uint32_t *state, const uint8_t *block)
+{
+    uint32_t w[64], s[8];
+
+    for(int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | block[i * 4 + 1] << 16 |
+               block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for(int i = 16; i < 64; i++) {
+        uint32_t s0 = ZZ_ROTR(w[i - 15], 7) ^ ZZ_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ZZ_ROTR(w[i - 2], 17) ^ ZZ_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(s, state, sizeof(s));
+    for(int i = 0; i < 64; i++) {
+        uint32_t t1 = s[7] + (ZZ_ROTR(s[4], 6) ^ ZZ_ROTR(s[4], 11) ^ ZZ_ROTR(s[4], 25)) +
+                      ((s[4] & s[5]) ^ (~s[4] & s[6])) + ZZ_SHA256_K[i] + w[i];
+        uint32_t t2 = (ZZ_ROTR(s[0], 2) ^ ZZ_ROTR(s[0], 13) ^ ZZ_ROTR(s[0], 22)) +
+                      ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(&s[1], &s[0], 7 * sizeof(uint32_t));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+    for(int i = 0; i < 8; i++) {
+        state[i] += s[i];
+    }
+}
+
+void zz_sha256(const void *data, size_t len, uint8_t *digest)
+{
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    const uint8_t *p = (const uint8_t *)data;
+    uint8_t tail[128] = { 0 };
+    size_t rest = len % 64;
+    uint64_t bits = (uint64_t)len * 8;
+
+    for(size_t i = 0; i + 64 <= len; i += 64) {
+        _zz_sha256_block(state, p + i);
+    }
+
+    // padding: 0x80, zeros, then the length in bits, in one or two blocks
+    size_t tail_size = rest < 56 ? 64 : 128;
+    memcpy(tail, p + len - rest, rest);
+    tail[rest] = 0x80;
+    for(int i = 0; i < 8; i++) {
+        tail[tail_size - 1 - i] = bits >> (i * 8);
+    }
+    for(size_t i = 0; i < tail_size; i += 64) {
+        _zz_sha256_block(state, tail + i);
+    }
+
+    for(int i = 0; i < 8; i++) {
+        digest[i * 4] = state[i] >> 24;
+        digest[i * 4 + 1] = state[i] >> 16;
+        digest[i * 4 + 2] = state[i] >> 8;
+        digest[i * 4 + 3] = state[i];
+    }
+}
+
+#ifdef ZZ_UNIX_ENV
+// the cache depends on the page layout as well
+#define ZZ_CACHE_TAG ((ZZ_CACHE_VERSION << 8) | ZZ_PAGE_SHIFT)
+#define ZZ_CACHE_ALIGN 4096
+
+// entries are named by the first 64 bits of the digest
+static int _zz_cache_path(const uint8_t *digest, char *path, size_t size)
+{
+    const char *dir = getenv("ZZ_IMAGE_CACHE_DIR");
+    const char *home = getenv("HOME");
+    unsigned long long name = 0;
+    int n;
+
+    for(int i = 0; i < 8; i++) {
+        name = name << 8 | digest[i];
+    }
+    if(dir && dir[0] == '\0') {
+        return 0;
+    } else if(dir) {
+        n = snprintf(path, size, "%s/%.16llx.zzc", dir, name);
+    } else if(home) {
+        n = snprintf(path, size, "%s/.cache/zzvm/images/%.16llx.zzc", home, name);
+    } else {
+        return 0;
+    }
+    return n > 0 && (size_t)n < size;
+}
+
+// map a cached image, NULL when it is missing or does not validate
+static ZZ_IMAGE *_zz_cache_load(const char *path, size_t source_size, const uint8_t *digest)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ZZ_CACHE_HEADER) + ZZ_MEM_LIMIT) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        return NULL;
+    }
+
+    ZZ_CACHE_HEADER *cache = (ZZ_CACHE_HEADER *)map;
+    ZZ_IMAGE_HEADER *header = (ZZ_IMAGE_HEADER *)(map + sizeof(ZZ_CACHE_HEADER));
+    size_t meta = sizeof(ZZ_CACHE_HEADER) + cache->headers_size;
+
+    if(cache->magic != ZZ_CACHE_MAGIC || cache->version != ZZ_CACHE_TAG ||
+       cache->source_size != source_size ||
+       memcmp(cache->digest, digest, ZZ_DIGEST_SIZE) != 0 ||
+       cache->memory_offset % ZZ_CACHE_ALIGN ||
+       (size_t)cache->memory_offset + ZZ_MEM_LIMIT != size ||
+       meta + ZZ_PAGE_COUNT + ZZ_LEADERS_SIZE > cache->memory_offset ||
+       cache->headers_size < sizeof(ZZ_IMAGE_HEADER) ||
+       cache->headers_size != sizeof(ZZ_IMAGE_HEADER) +
+                              sizeof(ZZ_SECTION_HEADER) * header->section_count ||
+       cache->checksum != _zz_hash(map + sizeof(ZZ_CACHE_HEADER),
+                                   size - sizeof(ZZ_CACHE_HEADER))) {
+        munmap(map, size);
+        return NULL;
+    }
+
+    ZZ_IMAGE *image = calloc(1, sizeof(ZZ_IMAGE));
+    if(image == NULL) {
+        munmap(map, size);
+        return NULL;
+    }
+    image->header = header;
+    image->memory = map + cache->memory_offset;
+    memcpy(image->present, map + meta, ZZ_PAGE_COUNT);
+    memcpy(image->leaders, map + meta + ZZ_PAGE_COUNT, ZZ_LEADERS_SIZE);
+    image->mapping = map;
+    image->mapping_size = size;
+    return image;
+}
+
+// create parent directories of path
+static void _zz_make_dirs(const char *path)
+{
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for(char *p = dir + 1; *p; p++) {
+        if(*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+}
+
+// write image next to path and rename it, concurrent loaders never see a
+// partial file
+static void _zz_cache_store(const char *path, size_t source_size, const uint8_t *digest,
+                            ZZ_IMAGE *image)
+{
+    size_t headers_size = sizeof(ZZ_IMAGE_HEADER) +
+                          sizeof(ZZ_SECTION_HEADER) * image->header->section_count;
+    size_t meta = sizeof(ZZ_CACHE_HEADER) + headers_size;
+    size_t memory_offset = (meta + ZZ_PAGE_COUNT + ZZ_LEADERS_SIZE + ZZ_CACHE_ALIGN - 1) &
+                           ~(size_t)(ZZ_CACHE_ALIGN - 1);
+    size_t size = memory_offset + ZZ_MEM_LIMIT;
+    uint8_t *data = calloc(1, size);
+    char tmp[4096];
+    FILE *fp;
+
+    // a name too long for the temporary file is not cached
+    int n = snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if(data == NULL || n < 0 || (size_t)n >= sizeof(tmp)) {
+        free(data);
+        return;
+    }
+
+    ZZ_CACHE_HEADER *cache = (ZZ_CACHE_HEADER *)data;
+    cache->magic = ZZ_CACHE_MAGIC;
+    cache->version = ZZ_CACHE_TAG;
+    cache->source_size = source_size;
+    memcpy(cache->digest, digest, ZZ_DIGEST_SIZE);
+    cache->headers_size = headers_size;
+    cache->memory_offset = memory_offset;
+    memcpy(data + sizeof(ZZ_CACHE_HEADER), image->header, headers_size);
+    memcpy(data + meta, image->present, ZZ_PAGE_COUNT);
+    memcpy(data + meta + ZZ_PAGE_COUNT, image->leaders, ZZ_LEADERS_SIZE);
+    memcpy(data + memory_offset, image->memory, ZZ_MEM_LIMIT);
+    cache->checksum = _zz_hash(data + sizeof(ZZ_CACHE_HEADER), size - sizeof(ZZ_CACHE_HEADER));
+
+    _zz_make_dirs(path);
+    if((fp = fopen(tmp, "wb")) != NULL) {
+        int ok = fwrite(data, 1, size, fp) == size;
+        if(fclose(fp) == 0 && ok && rename(tmp, path) == 0) {
+            tmp[0] = '\0';
+        }
+        if(tmp[0]) {
+            unlink(tmp);
+        }
+    }
+    free(data);
+}
+#endif
+
+int zz_load_image(const char *filename, ZZ_IMAGE **out_image)
+{
+    FILE *fp;
+    char *encoded = NULL;
+    uint8_t *raw = NULL;
+    size_t size = 0, capacity = 8192, n;
+    int status = 0;
+
+    if(filename == NULL || strcmp(filename, "-") == 0) {
+        fp = stdin;
+    } else {
+        fp = fopen(filename, "rb");
+    }
+
+    if(!fp) {
+        fprintf(stderr, "Unable to open file\n");
+        return 0;
+    }
+
+    encoded = malloc(capacity);
+    while(encoded && (n = fread(encoded + size, 1, capacity - size, fp)) > 0) {
+        size += n;
+        if(size == capacity) {
+            capacity *= 2;
+            char *grown = realloc(encoded, capacity);
+            if(grown == NULL) {
+                free(encoded);
+                encoded = NULL;
+                break;
+            }
+            encoded = grown;
+        }
+    }
+
+#ifdef ZZ_UNIX_ENV
+    char path[4096];
+    uint8_t digest[ZZ_DIGEST_SIZE];
+    int cached = 0;
+    if(encoded) {
+        zz_sha256(encoded, size, digest);
+        cached = _zz_cache_path(digest, path, sizeof(path));
+    }
+    if(cached && (*out_image = _zz_cache_load(path, size, digest)) != NULL) {
+        status = 1;
+        goto done;
+    }
+#endif
+
+    if(encoded == NULL || (raw = malloc(size / 8 + 1)) == NULL) {
+        fprintf(stderr, "Can not allocate image\n");
+        goto done;
+    }
+
+    if(!zz_decode_data(raw, encoded, size / 8)) {
+        fprintf(stderr, "Malformed file\n");
+        goto done;
+    }
+
+    status = zz_load_image_raw(raw, size / 8, out_image);
+#ifdef ZZ_UNIX_ENV
+    if(status && cached) {
+        _zz_cache_store(path, size, digest, *out_image);
+    }
+#endif
+
+done:
+    if(fp != stdin) fclose(fp);
+    free(encoded);
+    free(raw);
+    return status;
+}
+
+int zz_attach_image(ZZ_IMAGE *image, ZZVM *vm)
+{
+    for(int i = 0; i < ZZ_PAGE_COUNT; i++) {
+        if(!image->present[i]) {
+            continue;
+        }
+        ZZ_ADDRESS addr = i << ZZ_PAGE_SHIFT;
+        if(zz_map_shared(vm, addr, image->memory + addr, ZZ_PAGE_SIZE) != ZZ_SUCCESS) {
+            fprintf(stderr, "Can not map image page 0x%.4x\n", addr);
+            return 0;
+        }
+    }
+
+    vm->ctx.regs.IP = image->header->entry;
+    return 1;
+}
+
+int zz_load_image_to_vm(const char *filename, ZZVM *vm, ZZ_IMAGE **out_image)
+{
+    ZZ_IMAGE *image;
+
+    if(!zz_load_image(filename, &image)) {
+        return 0;
+    }
+
+    if(!zz_attach_image(image, vm)) {
+        zz_free_image(image);
+        return 0;
+    }
+
+    *out_image = image;
+    return 1;
+}
@@ -0,0 +1,79 @@
+#ifndef ZZIMAGE_H
+#define ZZIMAGE_H
+
+#include "zzvm.h"
+
+#define ZZ_IMAGE_MAGIC   0x7a5a /* 'Zz' */
+#define ZZ_IMAGE_VERSION 0x0
+
+typedef struct __attribute__((__packed__)) {
+    ZZ_ADDRESS section_addr;
+    ZZ_ADDRESS section_size;
+} ZZ_SECTION_HEADER;
+
+typedef struct __attribute__((__packed__)) {
+    uint16_t          magic;
+    uint16_t          file_ver;
+    ZZ_ADDRESS        entry;
+    uint16_t          section_count;
+    ZZ_SECTION_HEADER sections[0];
+} ZZ_IMAGE_HEADER;
+
+#define ZZ_LEADERS_SIZE (ZZ_MEM_LIMIT / sizeof(ZZ_INSTRUCTION) / 8)
+
+// a decoded image, its pages are shared by every vm it is attached to
+typedef struct {
+    ZZ_IMAGE_HEADER *header;
+    uint8_t *memory;
+    uint8_t present[ZZ_PAGE_COUNT];
+    // a bit per instruction slot which starts a basic block: the entry,
+    // jump and call targets and the instructions after jumps
+    uint8_t leaders[ZZ_LEADERS_SIZE];
+    // cache file holding header and memory, NULL when they are malloc'd
+    void *mapping;
+    size_t mapping_size;
+} ZZ_IMAGE;
+
+#define ZZ_IMAGE_LEADER(IMAGE, ADDR) \
+    ((IMAGE)->leaders[(ADDR) >> 5] & (1 << (((ADDR) >> 2) & 7)))
+
+// decoded images are cached in $ZZ_IMAGE_CACHE_DIR or
+// ~/.cache/zzvm/images, named by the SHA-256 of the encoded file and
+// checked against its length and full digest on load. An empty
+// ZZ_IMAGE_CACHE_DIR disables the cache.
+#define ZZ_CACHE_MAGIC   0x48435a5a /* 'ZZCH' */
+#define ZZ_CACHE_VERSION 2          // bump when decoding or the layout changes
+#define ZZ_DIGEST_SIZE   32
+
+typedef struct __attribute__((__packed__)) {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_size;   // length of the encoded image file
+    uint8_t  digest[ZZ_DIGEST_SIZE]; // its SHA-256
+    uint64_t checksum;      // hash of everything after this header
+    uint32_t headers_size;  // image and section headers, then present and leaders
+    uint32_t memory_offset; // page aligned so memory can be mapped directly
+} ZZ_CACHE_HEADER;
+
+// Zz encoding, every byte is stored as 8 characters of 'Z' (1) and 'z' (0)
+int zz_decode_byte(const char *encoded, uint8_t *out);
+int zz_decode_data(void *dst, const void *src, size_t unpacked_size);
+
+// SHA-256 of data into ZZ_DIGEST_SIZE bytes, names cached images
+void zz_sha256(const void *data, size_t len, uint8_t *digest);
+
+// load a Zz-encoded image file, filename NULL or "-" reads stdin
+int zz_load_image(const char *filename, ZZ_IMAGE **out_image);
+// load a decoded image: header, section headers, then section bodies
+// this is what Parser.build() returns before encoding
+int zz_load_image_raw(const void *data, size_t size, ZZ_IMAGE **out_image);
+// release an image, vms attached to it must be destroyed first
+void zz_free_image(ZZ_IMAGE *image);
+
+// map pages of a decoded image into vm and set its entry point
+int zz_attach_image(ZZ_IMAGE *image, ZZVM *vm);
+// read, decode image and put things into an existed vm, the image must be
+// kept until vm is destroyed
+int zz_load_image_to_vm(const char *filename, ZZVM *vm, ZZ_IMAGE **out_image);
+
+#endif
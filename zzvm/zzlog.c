@@ -0,0 +1,408 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zzvm.h"
+
+#ifdef ZZ_UNIX_ENV
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// events per thread, must be power of 2
+#define ZZ_LOG_SLOTS 1024
+#define ZZ_LOG_ARGS  8
+#define ZZ_LOG_TEXT  96
+
+// captured argument, strings are copied into ZZ_LOG_EVENT.text
+typedef union {
+    long long i;
+    unsigned long long u;
+    double d;
+    void *p;
+    size_t s;
+} ZZ_LOG_ARG;
+
+typedef struct {
+    FILE *pipe;
+    const char *fmt;    // NULL when text holds the formatted message
+    int argc;
+    ZZ_LOG_ARG args[ZZ_LOG_ARGS];
+    char text[ZZ_LOG_TEXT];
+} ZZ_LOG_EVENT;
+
+// single producer (the owning thread), single consumer (the drain thread)
+typedef struct ZZ_LOG_RING {
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    struct ZZ_LOG_RING *next;
+    ZZ_LOG_EVENT events[ZZ_LOG_SLOTS];
+} ZZ_LOG_RING;
+
+static ZZ_LOG_RING *_Atomic zz_log_rings = NULL;
+static _Thread_local ZZ_LOG_RING *zz_thread_ring = NULL;
+static _Atomic size_t zz_log_drops = 0;
+static _Atomic int zz_log_running = 0;
+static pthread_mutex_t zz_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t zz_log_thread;
+
+// conversion classes of a format specification
+#define ZZ_SPEC_INT    1
+#define ZZ_SPEC_UINT   2
+#define ZZ_SPEC_DOUBLE 3
+#define ZZ_SPEC_STRING 4
+#define ZZ_SPEC_CHAR   5
+#define ZZ_SPEC_PTR    6
+
+// length modifiers
+#define ZZ_LEN_NONE 0
+#define ZZ_LEN_HH   1
+#define ZZ_LEN_H    2
+#define ZZ_LEN_L    3
+#define ZZ_LEN_LL   4
+#define ZZ_LEN_Z    5
+#define ZZ_LEN_J    6
+#define ZZ_LEN_T    7
+
+// parse one specification starting at '%', copies it to spec with the
+// length modifier replaced by what ZZ_LOG_ARG stores
+// returns pointer after the specification, NULL if unsupported
+static const char *_zz_log_spec(const char *p, char *spec, size_t limit, int *type, int *length)
+{
+    size_t n = 0;
+    spec[n++] = *p++;
+
+    while(*p && strchr("-+ #0123456789.", *p) && n < limit - 4) {
+        spec[n++] = *p++;
+    }
+
+    *length = ZZ_LEN_NONE;
+    if(p[0] == 'h' && p[1] == 'h') { *length = ZZ_LEN_HH; p += 2; }
+    else if(p[0] == 'l' && p[1] == 'l') { *length = ZZ_LEN_LL; p += 2; }
+    else if(*p == 'h') { *length = ZZ_LEN_H; p++; }
+    else if(*p == 'l') { *length = ZZ_LEN_L; p++; }
+    else if(*p == 'z') { *length = ZZ_LEN_Z; p++; }
+    else if(*p == 'j') { *length = ZZ_LEN_J; p++; }
+    else if(*p == 't') { *length = ZZ_LEN_T; p++; }
+
+    switch(*p) {
+        case 'd': case 'i':
+            *type = ZZ_SPEC_INT;
+            break;
+        case 'u': case 'x': case 'X': case 'o':
+            *type = ZZ_SPEC_UINT;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            if(*length != ZZ_LEN_NONE && *length != ZZ_LEN_L) {
+                return NULL;
+            }
+            *type = ZZ_SPEC_DOUBLE;
+            break;
+        case 's':
+            *type = ZZ_SPEC_STRING;
+            break;
+        case 'c':
+            *type = ZZ_SPEC_CHAR;
+            break;
+        case 'p':
+            *type = ZZ_SPEC_PTR;
+            break;
+        default:
+            // '*', '%n', wide strings and the rest are formatted eagerly
+            return NULL;
+    }
+
+    if(*type == ZZ_SPEC_INT || *type == ZZ_SPEC_UINT) {
+        spec[n++] = 'l';
+        spec[n++] = 'l';
+    }
+    spec[n++] = *p++;
+    spec[n] = '\0';
+    return p;
+}
+
+// read the arguments of fmt into event, returns 0 if the format can not be
+// captured
+static int _zz_log_capture(ZZ_LOG_EVENT *event, const char *fmt, va_list args)
+{
+    char spec[32];
+    size_t text_used = 0;
+    int type, length;
+
+    event->argc = 0;
+    for(const char *p = fmt; *p; ) {
+        if(*p != '%') {
+            p++;
+            continue;
+        }
+        if(p[1] == '%') {
+            p += 2;
+            continue;
+        }
+
+        p = _zz_log_spec(p, spec, sizeof(spec), &type, &length);
+        if(p == NULL || event->argc >= ZZ_LOG_ARGS) {
+            return 0;
+        }
+
+        ZZ_LOG_ARG *arg = &event->args[event->argc++];
+        switch(type) {
+            case ZZ_SPEC_INT:
+                switch(length) {
+                    case ZZ_LEN_HH: arg->i = (signed char)va_arg(args, int); break;
+                    case ZZ_LEN_H:  arg->i = (short)va_arg(args, int); break;
+                    case ZZ_LEN_L:  arg->i = va_arg(args, long); break;
+                    case ZZ_LEN_LL: arg->i = va_arg(args, long long); break;
+                    case ZZ_LEN_Z:  arg->i = va_arg(args, ssize_t); break;
+                    case ZZ_LEN_J:  arg->i = va_arg(args, intmax_t); break;
+                    case ZZ_LEN_T:  arg->i = va_arg(args, ptrdiff_t); break;
+                    default:        arg->i = va_arg(args, int); break;
+                }
+                break;
+            case ZZ_SPEC_UINT:
+                switch(length) {
+                    case ZZ_LEN_HH: arg->u = (unsigned char)va_arg(args, unsigned int); break;
+                    case ZZ_LEN_H:  arg->u = (unsigned short)va_arg(args, unsigned int); break;
+                    case ZZ_LEN_L:  arg->u = va_arg(args, unsigned long); break;
+                    case ZZ_LEN_LL: arg->u = va_arg(args, unsigned long long); break;
+                    case ZZ_LEN_Z:  arg->u = va_arg(args, size_t); break;
+                    case ZZ_LEN_J:  arg->u = va_arg(args, uintmax_t); break;
+                    case ZZ_LEN_T:  arg->u = va_arg(args, ptrdiff_t); break;
+                    default:        arg->u = va_arg(args, unsigned int); break;
+                }
+                break;
+            case ZZ_SPEC_DOUBLE:
+                arg->d = va_arg(args, double);
+                break;
+            case ZZ_SPEC_CHAR:
+                arg->i = va_arg(args, int);
+                break;
+            case ZZ_SPEC_PTR:
+                arg->p = va_arg(args, void *);
+                break;
+            case ZZ_SPEC_STRING: {
+                const char *str = va_arg(args, const char *);
+                size_t len = strlen(str ? str : "(null)");
+                if(text_used + len + 1 > ZZ_LOG_TEXT) {
+                    return 0;
+                }
+                memcpy(event->text + text_used, str ? str : "(null)", len + 1);
+                arg->s = text_used;
+                text_used += len + 1;
+                break;
+            }
+        }
+    }
+
+    event->fmt = fmt;
+    return 1;
+}
+
+// format event, runs on the drain thread
+static void _zz_log_format(ZZ_LOG_EVENT *event)
+{
+    FILE *fp = event->pipe;
+    char spec[32];
+    int type, length, argi = 0;
+
+    if(event->fmt == NULL) {
+        fputs(event->text, fp);
+        return;
+    }
+
+    const char *p = event->fmt;
+    while(*p) {
+        const char *next = strchr(p, '%');
+        if(next == NULL) {
+            fputs(p, fp);
+            break;
+        }
+        fwrite(p, 1, next - p, fp);
+        if(next[1] == '%') {
+            fputc('%', fp);
+            p = next + 2;
+            continue;
+        }
+
+        p = _zz_log_spec(next, spec, sizeof(spec), &type, &length);
+        ZZ_LOG_ARG *arg = &event->args[argi++];
+        switch(type) {
+            case ZZ_SPEC_INT:    fprintf(fp, spec, arg->i); break;
+            case ZZ_SPEC_UINT:   fprintf(fp, spec, arg->u); break;
+            case ZZ_SPEC_DOUBLE: fprintf(fp, spec, arg->d); break;
+            case ZZ_SPEC_CHAR:   fprintf(fp, spec, (int)arg->i); break;
+            case ZZ_SPEC_PTR:    fprintf(fp, spec, arg->p); break;
+            case ZZ_SPEC_STRING: fprintf(fp, spec, event->text + arg->s); break;
+        }
+    }
+}
+
+// format everything queued, returns how many events were handled
+static size_t _zz_log_drain(void)
+{
+    size_t count = 0;
+    for(ZZ_LOG_RING *ring = atomic_load(&zz_log_rings); ring; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        FILE *last = NULL;
+
+        for(; tail != head; tail++, count++) {
+            ZZ_LOG_EVENT *event = &ring->events[tail & (ZZ_LOG_SLOTS - 1)];
+            _zz_log_format(event);
+            if(last && last != event->pipe) {
+                fflush(last);
+            }
+            last = event->pipe;
+        }
+        if(last) {
+            fflush(last);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    return count;
+}
+
+static void *_zz_log_thread(void *unused)
+{
+    struct timespec idle = { 0, 1000000 };
+
+    while(atomic_load(&zz_log_running)) {
+        if(_zz_log_drain() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    _zz_log_drain();
+    return NULL;
+}
+
+static ZZ_LOG_RING *_zz_log_thread_ring(void)
+{
+    if(zz_thread_ring) {
+        return zz_thread_ring;
+    }
+
+    ZZ_LOG_RING *ring = calloc(1, sizeof(ZZ_LOG_RING));
+    if(ring == NULL) {
+        return NULL;
+    }
+
+    // rings are never freed, a thread may exit with messages still queued
+    ring->next = atomic_load(&zz_log_rings);
+    while(!atomic_compare_exchange_weak(&zz_log_rings, &ring->next, ring));
+    zz_thread_ring = ring;
+    return ring;
+}
+
+int zz_log_start(void)
+{
+    int status = ZZ_SUCCESS;
+
+    pthread_mutex_lock(&zz_log_lock);
+    if(!atomic_load(&zz_log_running)) {
+        atomic_store(&zz_log_running, 1);
+        if(pthread_create(&zz_log_thread, NULL, _zz_log_thread, NULL) != 0) {
+            atomic_store(&zz_log_running, 0);
+            status = ZZ_FAILED;
+        }
+    }
+    pthread_mutex_unlock(&zz_log_lock);
+    return status;
+}
+
+void zz_log_post(FILE *pipe, const char *msg, va_list args)
+{
+    ZZ_LOG_RING *ring;
+
+    if(!atomic_load_explicit(&zz_log_running, memory_order_relaxed) ||
+       (ring = _zz_log_thread_ring()) == NULL) {
+        vfprintf(pipe, msg, args);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if(head - tail >= ZZ_LOG_SLOTS) {
+        atomic_fetch_add_explicit(&zz_log_drops, 1, memory_order_relaxed);
+        return;
+    }
+
+    ZZ_LOG_EVENT *event = &ring->events[head & (ZZ_LOG_SLOTS - 1)];
+    event->pipe = pipe;
+
+    va_list copy;
+    va_copy(copy, args);
+    int captured = _zz_log_capture(event, msg, copy);
+    va_end(copy);
+    if(!captured) {
+        vsnprintf(event->text, sizeof(event->text), msg, args);
+        event->fmt = NULL;
+    }
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// wait until every message queued so far is written
+void zz_log_flush(void)
+{
+    struct timespec idle = { 0, 100000 };
+
+    if(!atomic_load(&zz_log_running)) {
+        return;
+    }
+
+    for(ZZ_LOG_RING *ring = atomic_load(&zz_log_rings); ring; ring = ring->next) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while((ssize_t)(head - atomic_load_explicit(&ring->tail, memory_order_acquire)) > 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+}
+
+void zz_log_stop(void)
+{
+    pthread_mutex_lock(&zz_log_lock);
+    if(atomic_load(&zz_log_running)) {
+        atomic_store(&zz_log_running, 0);
+        pthread_join(zz_log_thread, NULL);
+        if(atomic_load(&zz_log_drops)) {
+            fprintf(stderr, "[WARN] log ring full, %zu messages dropped\n",
+                    atomic_load(&zz_log_drops));
+        }
+    }
+    pthread_mutex_unlock(&zz_log_lock);
+}
+
+size_t zz_log_dropped(void)
+{
+    return atomic_load(&zz_log_drops);
+}
+
+#else
+
+// no threads, zz_set_log falls back to synchronous output
+
+int zz_log_start(void)
+{
+    return ZZ_FAILED;
+}
+
+void zz_log_post(FILE *pipe, const char *msg, va_list args)
+{
+    vfprintf(pipe, msg, args);
+}
+
+void zz_log_flush(void)
+{
+}
+
+void zz_log_stop(void)
+{
+}
+
+size_t zz_log_dropped(void)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,301 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zzperf.h"
+
+#define ZZ_SLOTS (ZZ_MEM_LIMIT / sizeof(ZZ_INSTRUCTION))
+
+static const char * const ZZ_PERF_NAME[ZZ_PERF_COUNT] = {
+    "cycles", "instructions", "branch-misses", "cache-misses", "task-clock",
+};
+
+const char *zz_perf_name(int counter)
+{
+    return counter >= 0 && counter < ZZ_PERF_COUNT ? ZZ_PERF_NAME[counter] : "?";
+}
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef F_SETSIG
+#define F_SETSIG 10
+#endif
+#ifndef F_SETOWN_EX
+#define F_SETOWN_EX 15
+#define F_OWNER_TID 0
+struct f_owner_ex { int type; int pid; };
+#endif
+
+static const struct { uint32_t type; uint64_t config; } ZZ_PERF_EVENT[ZZ_PERF_COUNT] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+
+// the sampling ZZ_PERF, read by the signal handler
+static ZZ_PERF *volatile zz_perf_sampler = NULL;
+
+static int _zz_perf_event_open(uint32_t type, uint64_t config, uint64_t period)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    if(period) {
+        attr.sample_period = period;
+        attr.wakeup_events = 1;
+    }
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// an overflow of the sampling counter, IP is as fresh as the interpreter
+// last stored it
+static void _zz_perf_signal(int sig, siginfo_t *info, void *context)
+{
+    ZZ_PERF *perf = zz_perf_sampler;
+
+    if(perf == NULL || info->si_fd != perf->sample_fd) {
+        return;
+    }
+    if(perf->vm->state == ZZ_ST_EXEC) {
+        perf->samples[perf->vm->ctx.regs.IP / sizeof(ZZ_INSTRUCTION)]++;
+        perf->sample_count++;
+    }
+    ioctl(perf->sample_fd, PERF_EVENT_IOC_REFRESH, 1);
+}
+
+static int _zz_perf_open_sampler(ZZ_PERF *perf)
+{
+    struct sigaction action;
+    struct f_owner_ex owner = { F_OWNER_TID, syscall(SYS_gettid) };
+
+    if(zz_perf_sampler != NULL ||
+       (perf->samples = calloc(ZZ_SLOTS, sizeof(uint32_t))) == NULL) {
+        return 0;
+    }
+
+    if(perf->fds[ZZ_PERF_CYCLES] >= 0) {
+        perf->sample_fd = _zz_perf_event_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+                                              ZZ_PERF_SAMPLE_CYCLES);
+    } else {
+        perf->sample_fd = _zz_perf_event_open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK,
+                                              ZZ_PERF_SAMPLE_NS);
+    }
+    if(perf->sample_fd < 0) {
+        return 0;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = _zz_perf_signal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigaction(SIGPROF, &action, NULL);
+
+    fcntl(perf->sample_fd, F_SETFL, O_ASYNC | O_NONBLOCK);
+    fcntl(perf->sample_fd, F_SETSIG, SIGPROF);
+    fcntl(perf->sample_fd, F_SETOWN_EX, &owner);
+    zz_perf_sampler = perf;
+    return 1;
+}
+
+int zz_perf_open(ZZ_PERF *perf, ZZVM *vm, int sample)
+{
+    int opened = 0;
+
+    memset(perf, 0, sizeof(ZZ_PERF));
+    perf->vm = vm;
+    perf->sample_fd = -1;
+    for(int i = 0; i < ZZ_PERF_COUNT; i++) {
+        perf->fds[i] = _zz_perf_event_open(ZZ_PERF_EVENT[i].type, ZZ_PERF_EVENT[i].config, 0);
+        if(perf->fds[i] < 0) {
+            perf->errors[i] = errno;
+        } else {
+            opened++;
+        }
+    }
+
+    if(sample && !_zz_perf_open_sampler(perf)) {
+        zz_warn(vm, "[WARN] guest IP sampling is not available\n");
+    }
+    return opened ? ZZ_SUCCESS : ZZ_FAILED;
+}
+
+void zz_perf_start(ZZ_PERF *perf)
+{
+    for(int i = 0; i < ZZ_PERF_COUNT; i++) {
+        if(perf->fds[i] >= 0) {
+            ioctl(perf->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    if(perf->sample_fd >= 0) {
+        ioctl(perf->sample_fd, PERF_EVENT_IOC_REFRESH, 1);
+    }
+}
+
+void zz_perf_stop(ZZ_PERF *perf)
+{
+    if(perf->sample_fd >= 0) {
+        ioctl(perf->sample_fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for(int i = 0; i < ZZ_PERF_COUNT; i++) {
+        uint64_t value[3]; // value, time enabled, time running
+        if(perf->fds[i] < 0) {
+            continue;
+        }
+        ioctl(perf->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if(read(perf->fds[i], value, sizeof(value)) != sizeof(value) || value[2] == 0) {
+            continue;
+        }
+        // scale up when the kernel multiplexed the counter
+        if(value[2] < value[1]) {
+            value[0] = (uint64_t)((double)value[0] * value[1] / value[2]);
+        }
+        perf->values[i] += value[0];
+    }
+}
+
+void zz_perf_close(ZZ_PERF *perf)
+{
+    for(int i = 0; i < ZZ_PERF_COUNT; i++) {
+        if(perf->fds[i] >= 0) {
+            close(perf->fds[i]);
+            perf->fds[i] = -1;
+        }
+    }
+    if(perf->sample_fd >= 0) {
+        zz_perf_sampler = NULL;
+        close(perf->sample_fd);
+        perf->sample_fd = -1;
+    }
+    free(perf->samples);
+    perf->samples = NULL;
+}
+
+#else
+
+int zz_perf_open(ZZ_PERF *perf, ZZVM *vm, int sample)
+{
+    memset(perf, 0, sizeof(ZZ_PERF));
+    perf->vm = vm;
+    perf->sample_fd = -1;
+    for(int i = 0; i < ZZ_PERF_COUNT; i++) {
+        perf->fds[i] = -1;
+    }
+    return ZZ_FAILED;
+}
+
+void zz_perf_start(ZZ_PERF *perf)
+{
+}
+
+void zz_perf_stop(ZZ_PERF *perf)
+{
+}
+
+void zz_perf_close(ZZ_PERF *perf)
+{
+}
+
+#endif
+
+// the block of slot, the nearest leader at or before it
+static size_t _zz_block_of(const ZZ_IMAGE *image, size_t slot)
+{
+    while(slot > 0 && !ZZ_IMAGE_LEADER(image, slot * sizeof(ZZ_INSTRUCTION))) {
+        slot--;
+    }
+    return slot;
+}
+
+static void _zz_report_blocks(FILE *out, const ZZ_PERF *perf, const ZZ_IMAGE *image)
+{
+    uint64_t *blocks = calloc(ZZ_SLOTS, sizeof(uint64_t));
+    if(blocks == NULL) {
+        return;
+    }
+
+    for(size_t slot = 0; slot < ZZ_SLOTS; slot++) {
+        if(perf->samples[slot]) {
+            blocks[image ? _zz_block_of(image, slot) : slot] += perf->samples[slot];
+        }
+    }
+
+    fprintf(out, "\nhot guest %s, %llu samples\n", image ? "blocks" : "instructions",
+            (unsigned long long)perf->sample_count);
+    for(int rank = 0; rank < 10; rank++) {
+        size_t best = 0;
+        for(size_t slot = 1; slot < ZZ_SLOTS; slot++) {
+            if(blocks[slot] > blocks[best]) {
+                best = slot;
+            }
+        }
+        if(blocks[best] == 0) {
+            break;
+        }
+        fprintf(out, "  0x%.4zx  %6.2f%%  %llu\n", best * sizeof(ZZ_INSTRUCTION),
+                100.0 * blocks[best] / perf->sample_count, (unsigned long long)blocks[best]);
+        blocks[best] = 0;
+    }
+    free(blocks);
+}
+
+void zz_perf_report(FILE *out, const ZZ_PERF *perf, const ZZ_STATS *stats,
+                    const ZZ_IMAGE *image)
+{
+    uint64_t guest = stats ? stats->instructions : 0;
+
+    fprintf(out, "engine: interpreter, %s memory\n",
+#ifdef ZZ_PAGED_MEMORY
+            "paged"
+#else
+            "flat"
+#endif
+            );
+    if(guest) {
+        fprintf(out, "%-16s %16llu\n", "guest insns", (unsigned long long)guest);
+        fprintf(out, "%-16s %16llu  %8.2f%% of guest insns, %llu promoted, %llu demoted\n",
+                "decoded insns", (unsigned long long)stats->decoded,
+                100.0 * stats->decoded / guest, (unsigned long long)stats->promotions,
+                (unsigned long long)stats->demotions);
+    } else {
+        fprintf(out, "guest instruction count needs a build without NOSTATS\n");
+    }
+
+    for(int i = 0; i < ZZ_PERF_COUNT; i++) {
+        if(perf->fds[i] < 0) {
+            fprintf(out, "%-16s %16s  (%s)\n", ZZ_PERF_NAME[i], "not supported",
+                    strerror(perf->errors[i]));
+            continue;
+        }
+
+        fprintf(out, "%-16s %16llu", ZZ_PERF_NAME[i], (unsigned long long)perf->values[i]);
+        if(guest && i == ZZ_PERF_TASK_CLOCK) {
+            fprintf(out, "  %8.2f ns per guest insn", (double)perf->values[i] / guest);
+        } else if(guest && (i == ZZ_PERF_CYCLES || i == ZZ_PERF_INSTRUCTIONS)) {
+            fprintf(out, "  %8.2f per guest insn", (double)perf->values[i] / guest);
+        } else if(guest) {
+            fprintf(out, "  %8.2f per 1000 guest insns", 1000.0 * perf->values[i] / guest);
+        }
+        fputc('\n', out);
+    }
+
+    if(perf->samples && perf->sample_count) {
+        _zz_report_blocks(out, perf, image);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef ZZPERF_H
+#define ZZPERF_H
+
+#include <stdio.h>
+#include "zzvm.h"
+#include "zzimage.h"
+
+// host counters around execution, Linux perf_event_open
+//
+// counters measure user space of the calling thread. Any of them may be
+// missing (no PMU in a guest vm, perf_event_paranoid, seccomp), those keep
+// fd -1 and are reported as unsupported.
+enum {
+    ZZ_PERF_CYCLES,
+    ZZ_PERF_INSTRUCTIONS,
+    ZZ_PERF_BRANCH_MISSES,
+    ZZ_PERF_CACHE_MISSES,
+    ZZ_PERF_TASK_CLOCK,     // nanoseconds, software counter
+    ZZ_PERF_COUNT
+};
+
+// host cycles between hotspot samples, or nanoseconds of cpu time when the
+// cycle counter is unavailable
+#define ZZ_PERF_SAMPLE_CYCLES 200000
+#define ZZ_PERF_SAMPLE_NS     100000
+
+typedef struct {
+    int fds[ZZ_PERF_COUNT];
+    uint64_t values[ZZ_PERF_COUNT];  // summed over start/stop pairs
+    int errors[ZZ_PERF_COUNT];       // errno of perf_event_open
+    // guest IP samples per instruction slot, NULL unless sampling
+    int sample_fd;
+    uint32_t *samples;
+    uint64_t sample_count;
+    ZZVM *vm;
+} ZZ_PERF;
+
+// open counters, sample the guest IP of vm as well when sample is set.
+// Only one ZZ_PERF per process can sample. ZZ_FAILED when no counter at
+// all can be opened
+int zz_perf_open(ZZ_PERF *perf, ZZVM *vm, int sample);
+void zz_perf_start(ZZ_PERF *perf);
+void zz_perf_stop(ZZ_PERF *perf);
+void zz_perf_close(ZZ_PERF *perf);
+const char *zz_perf_name(int counter);
+
+// per guest instruction ratios from stats, and the hottest guest blocks by
+// the leaders of image when samples were taken
+void zz_perf_report(FILE *out, const ZZ_PERF *perf, const ZZ_STATS *stats,
+                    const ZZ_IMAGE *image);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "zzvm.h"
+
+#ifdef ZZ_STATS_ENABLED
+// totals of flushed vms, updated with relaxed atomics since any thread may
+// flush its vm at any time
+static uint64_t zz_global_ops[256];
+static uint64_t zz_global_taken;
+static uint64_t zz_global_jumps;
+// promoted, demoted and decoded counts
+static uint64_t zz_global_tier[3];
+
+static void _zz_summarize(const uint64_t *ops, uint64_t taken, uint64_t jumps,
+                          const uint64_t *tier, ZZ_STATS *stats)
+{
+    memset(stats, 0, sizeof(ZZ_STATS));
+    for(int i = 0; i < ZZ_OP_COUNT; i++) {
+        stats->ops[i] = ops[i];
+        stats->instructions += ops[i];
+    }
+
+    stats->syscalls = ops[ZZOP_SYS];
+    stats->calls = ops[ZZOP_CALL];
+    stats->branches = ops[ZZOP_JEI] + ops[ZZOP_JNI] + ops[ZZOP_JGI] +
+                      ops[ZZOP_JZI] + ops[ZZOP_JSGI] + ops[ZZOP_JEC] +
+                      ops[ZZOP_JNC] + ops[ZZOP_JGC] + ops[ZZOP_LOOP] + jumps;
+    stats->branches_taken = taken + jumps;
+    stats->mem_reads = ops[ZZOP_LD] + ops[ZZOP_LDR] + ops[ZZOP_POP] + ops[ZZOP_RET];
+    stats->mem_writes = ops[ZZOP_ST] + ops[ZZOP_STR] + ops[ZZOP_PUSH] +
+                        ops[ZZOP_PUSI] + ops[ZZOP_CALL];
+    stats->promotions = tier[0];
+    stats->demotions = tier[1];
+    stats->decoded = tier[2];
+}
+#endif
+
+int zz_get_stats(ZZVM *vm, ZZ_STATS *stats)
+{
+#ifdef ZZ_STATS_ENABLED
+    const uint64_t tier[] = { vm->promoted_count, vm->demoted_count, vm->decoded_count };
+    _zz_summarize(vm->op_count, vm->taken_count, vm->jump_count, tier, stats);
+    return ZZ_SUCCESS;
+#else
+    memset(stats, 0, sizeof(ZZ_STATS));
+    return ZZ_FAILED;
+#endif
+}
+
+void zz_flush_stats(ZZVM *vm)
+{
+#ifdef ZZ_STATS_ENABLED
+    for(int i = 0; i < 256; i++) {
+        if(vm->op_count[i]) {
+            __atomic_fetch_add(&zz_global_ops[i], vm->op_count[i], __ATOMIC_RELAXED);
+            vm->op_count[i] = 0;
+        }
+    }
+    __atomic_fetch_add(&zz_global_taken, vm->taken_count, __ATOMIC_RELAXED);
+    vm->taken_count = 0;
+    __atomic_fetch_add(&zz_global_jumps, vm->jump_count, __ATOMIC_RELAXED);
+    vm->jump_count = 0;
+    __atomic_fetch_add(&zz_global_tier[0], vm->promoted_count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&zz_global_tier[1], vm->demoted_count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&zz_global_tier[2], vm->decoded_count, __ATOMIC_RELAXED);
+    vm->promoted_count = vm->demoted_count = vm->decoded_count = 0;
+#endif
+}
+
+int zz_get_global_stats(ZZ_STATS *stats)
+{
+#ifdef ZZ_STATS_ENABLED
+    uint64_t ops[ZZ_OP_COUNT], tier[3];
+    for(int i = 0; i < ZZ_OP_COUNT; i++) {
+        ops[i] = __atomic_load_n(&zz_global_ops[i], __ATOMIC_RELAXED);
+    }
+    for(int i = 0; i < 3; i++) {
+        tier[i] = __atomic_load_n(&zz_global_tier[i], __ATOMIC_RELAXED);
+    }
+    _zz_summarize(ops, __atomic_load_n(&zz_global_taken, __ATOMIC_RELAXED),
+                  __atomic_load_n(&zz_global_jumps, __ATOMIC_RELAXED), tier, stats);
+    return ZZ_SUCCESS;
+#else
+    memset(stats, 0, sizeof(ZZ_STATS));
+    return ZZ_FAILED;
+#endif
+}
+
+#define ZZ_MIN(A, B) ((A) < (B) ? (A) : (B))
+
+// snprintf into the rest of buffer, keeps counting once it is full
+#define ZZ_APPEND(FMT, args...) \
+    used += snprintf(buffer + ZZ_MIN(used, size), size - ZZ_MIN(used, size), FMT, args)
+
+// opcodes sharing a mnemonic (ADD R/I, LD/LDR, ...) are reported together
+static uint64_t _zz_mnemonic_count(const ZZ_STATS *stats, int op)
+{
+    uint64_t count = 0;
+    for(int i = 0; i < ZZ_OP_COUNT; i++) {
+        if(i < op && strcmp(ZZ_OP_NAME[i], ZZ_OP_NAME[op]) == 0) {
+            return 0; // reported by the first opcode of this mnemonic
+        }
+        if(strcmp(ZZ_OP_NAME[i], ZZ_OP_NAME[op]) == 0) {
+            count += stats->ops[i];
+        }
+    }
+    return count;
+}
+
+int zz_format_stats(const ZZ_STATS *stats, int format, char *buffer, size_t size)
+{
+    static const char *names[] = {
+        "instructions", "syscalls", "calls", "branches", "branches_taken",
+        "mem_reads", "mem_writes", "tier_promotions", "tier_demotions",
+        "decoded_instructions",
+    };
+    const uint64_t values[] = {
+        stats->instructions, stats->syscalls, stats->calls, stats->branches,
+        stats->branches_taken, stats->mem_reads, stats->mem_writes,
+        stats->promotions, stats->demotions, stats->decoded,
+    };
+    size_t used = 0;
+    int first = 1;
+
+    if(size > 0) {
+        buffer[0] = '\0';
+    }
+
+    if(format == ZZ_STATS_JSON) {
+        ZZ_APPEND("%s", "{");
+        for(size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+            ZZ_APPEND("\"%s\": %llu, ", names[i], (unsigned long long)values[i]);
+        }
+        ZZ_APPEND("%s", "\"ops\": {");
+        for(int op = 0; op < ZZ_OP_COUNT; op++) {
+            uint64_t count = _zz_mnemonic_count(stats, op);
+            if(count) {
+                ZZ_APPEND("%s\"%s\": %llu", first ? "" : ", ", ZZ_OP_NAME[op],
+                          (unsigned long long)count);
+                first = 0;
+            }
+        }
+        ZZ_APPEND("%s", "}}\n");
+    } else {
+        for(size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+            ZZ_APPEND("# TYPE zzvm_%s_total counter\nzzvm_%s_total %llu\n",
+                      names[i], names[i], (unsigned long long)values[i]);
+        }
+        ZZ_APPEND("%s", "# TYPE zzvm_ops_total counter\n");
+        for(int op = 0; op < ZZ_OP_COUNT; op++) {
+            uint64_t count = _zz_mnemonic_count(stats, op);
+            if(count) {
+                ZZ_APPEND("zzvm_ops_total{op=\"%s\"} %llu\n", ZZ_OP_NAME[op],
+                          (unsigned long long)count);
+            }
+        }
+    }
+
+    return used;
+}
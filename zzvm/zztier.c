@@ -0,0 +1,189 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zzvm.h"
+
+#ifdef ZZ_STATS_ENABLED
+#define ZZ_COUNT_PROMOTED() vm->promoted_count++
+#define ZZ_COUNT_DEMOTED()  vm->demoted_count++
+#else
+#define ZZ_COUNT_PROMOTED()
+#define ZZ_COUNT_DEMOTED()
+#endif
+
+int zz_set_tiering(ZZVM *vm, unsigned block_threshold, unsigned loop_threshold)
+{
+    if(vm->state != ZZ_ST_SLEEP && vm->state != ZZ_ST_WAIT) {
+        return ZZ_FAILED;
+    }
+
+    vm->tier_threshold[0] = block_threshold < 0xffff ? block_threshold : 0xffff;
+    vm->tier_threshold[1] = loop_threshold < 0xffff ? loop_threshold : 0xffff;
+    if(block_threshold == 0 && loop_threshold == 0) {
+        zz_tier_free(vm);
+    }
+    return ZZ_SUCCESS;
+}
+
+int zz_tier_create(ZZVM *vm)
+{
+    if(vm->tier == NULL && (vm->tier = malloc(sizeof(ZZ_TIER))) == NULL) {
+        return ZZ_FAILED;
+    }
+    zz_tier_reset(vm);
+    return ZZ_SUCCESS;
+}
+
+void zz_tier_reset(ZZVM *vm)
+{
+    ZZ_TIER *tier = vm->tier;
+
+    if(tier == NULL) {
+        return;
+    }
+    memset(tier->hot, 0, sizeof(tier->hot));
+    memset(tier->index, 0, sizeof(tier->index));
+    memset(tier->code_pages, 0, sizeof(tier->code_pages));
+    tier->block_count = 0;
+    tier->code_used = 0;
+}
+
+void zz_tier_free(ZZVM *vm)
+{
+    free(vm->tier);
+    vm->tier = NULL;
+}
+
+// drop every block but keep the counters, when the code space is full
+static void _zz_tier_flush(ZZVM *vm)
+{
+    ZZ_TIER *tier = vm->tier;
+
+    for(int i = 0; i < tier->block_count; i++) {
+        if(tier->blocks[i].length) {
+            tier->index[tier->blocks[i].addr / sizeof(ZZ_INSTRUCTION)] = 0;
+            ZZ_COUNT_DEMOTED();
+        }
+    }
+    memset(tier->code_pages, 0, sizeof(tier->code_pages));
+    tier->block_count = 0;
+    tier->code_used = 0;
+}
+
+// demote every block with an instruction on page, it has to warm up again
+static void _zz_tier_demote_page(ZZVM *vm, int page)
+{
+    ZZ_TIER *tier = vm->tier;
+    int start = page << ZZ_PAGE_SHIFT, end = start + ZZ_PAGE_SIZE;
+
+    for(int i = 0; i < tier->block_count; i++) {
+        ZZ_BLOCK *block = &tier->blocks[i];
+        int last = block->addr + block->length * sizeof(ZZ_INSTRUCTION);
+        if(block->length == 0 || block->addr >= end || last <= start) {
+            continue;
+        }
+        tier->index[block->addr / sizeof(ZZ_INSTRUCTION)] = 0;
+        tier->hot[block->addr / sizeof(ZZ_INSTRUCTION)] = 0;
+        block->length = 0;
+        ZZ_COUNT_DEMOTED();
+    }
+    tier->code_pages[page] = 0;
+}
+
+void zz_tier_invalidate(ZZVM *vm, ZZ_ADDRESS addr, size_t len)
+{
+    ZZ_TIER *tier = vm->tier;
+
+    if(tier == NULL || len == 0) {
+        return;
+    }
+    if(len > ZZ_MEM_LIMIT) {
+        len = ZZ_MEM_LIMIT;
+    }
+
+    // pages of [addr, addr + len), which may wrap around
+    int first = addr >> ZZ_PAGE_SHIFT;
+    int count = (((addr & ZZ_PAGE_MASK) + len - 1) >> ZZ_PAGE_SHIFT) + 1;
+    for(int i = 0; i < count && i < ZZ_PAGE_COUNT; i++) {
+        int page = (first + i) % ZZ_PAGE_COUNT;
+        if(tier->code_pages[page]) {
+            _zz_tier_demote_page(vm, page);
+        }
+    }
+}
+
+// instructions which may leave the straight line end a block, so a block
+// runs from its first instruction to the last unless something stops the vm
+static int _zz_tier_ends_block(const ZZ_DECODED *ins)
+{
+    switch(ins->op) {
+        case ZZOP_JEI: case ZZOP_JNI: case ZZOP_JGI: case ZZOP_JZI:
+        case ZZOP_JSGI: case ZZOP_JEC: case ZZOP_JNC: case ZZOP_JGC:
+        case ZZOP_LOOP: case ZZOP_CALL: case ZZOP_RET: case ZZOP_SYS:
+        case ZZOP_HLT:
+            return 1;
+    }
+    // anything writing IP is a jump, JMP is ADDI IP, IP, offset
+    return ins->op >= ZZ_OP_COUNT || ins->r1 == ZZ_IP;
+}
+
+int zz_tier_promote(ZZVM *vm, ZZ_ADDRESS ip)
+{
+    ZZ_TIER *tier = vm->tier;
+    ZZVM_CTX *ctx = &vm->ctx;
+    int slot = ip / sizeof(ZZ_INSTRUCTION);
+
+    if(tier->block_count == ZZ_TIER_MAX_BLOCKS ||
+       tier->code_used + ZZ_TIER_MAX_LENGTH > ZZ_TIER_CODE_SIZE) {
+        _zz_tier_flush(vm);
+    }
+
+    ZZ_DECODED *code = &tier->code[tier->code_used];
+    int length = 0;
+    for(int addr = ip; length < ZZ_TIER_MAX_LENGTH; addr += sizeof(ZZ_INSTRUCTION)) {
+        // the interpreter reports IP out of bound and invalid registers
+        if(addr > ZZ_MEM_LIMIT - sizeof(ZZ_INSTRUCTION)) {
+            break;
+        }
+#ifdef ZZ_PAGED_MEMORY
+        // host buffers change behind our back
+        if(ctx->borrowed[addr >> ZZ_PAGE_SHIFT] ||
+           ctx->borrowed[(addr + sizeof(ZZ_INSTRUCTION) - 1) >> ZZ_PAGE_SHIFT]) {
+            break;
+        }
+#endif
+        uint8_t reg = zz_mem_read8(ctx, addr + 1);
+        if(reg & 0x88) {
+            break;
+        }
+
+        ZZ_DECODED *ins = &code[length++];
+        ins->op = zz_mem_read8(ctx, addr);
+        ins->r1 = reg >> 4;
+        ins->r2 = reg & 0xf;
+        ins->imm = zz_mem_read16(ctx, addr + 2);
+        ins->r3 = ins->imm & 7;
+        if(_zz_tier_ends_block(ins)) {
+            break;
+        }
+    }
+
+    if(length == 0) {
+        tier->hot[slot] = 0;
+        return 0;
+    }
+
+    ZZ_BLOCK *block = &tier->blocks[tier->block_count++];
+    block->addr = ip;
+    block->length = length;
+    block->code = tier->code_used;
+    tier->code_used += length;
+
+    int last = ip + length * sizeof(ZZ_INSTRUCTION) - 1;
+    for(int page = ip >> ZZ_PAGE_SHIFT; page <= last >> ZZ_PAGE_SHIFT; page++) {
+        tier->code_pages[page] = 1;
+    }
+    ZZ_COUNT_PROMOTED();
+    return tier->index[slot] = tier->block_count;
+}
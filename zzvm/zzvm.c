@@ -5,8 +5,10 @@
 #include <time.h>
 #include "zzvm.h"
 
-FILE *zz_msg_pipe = NULL;
-int zz_msg_level = ZZ_MSGL_MSG;
+#ifdef ZZ_PAGED_MEMORY
+// backs every page which has never been written, must stay zero
+static uint8_t zz_zero_page[ZZ_PAGE_SIZE];
+#endif
 
 const char * const ZZ_REGISTER_NAME[] = {
     "RA", "R1", "R2", "R3", "R4", "R5", "SP", "IP"
@@ -44,46 +46,123 @@ const char * const ZZ_OP_NAME[] = {
     /* 0x1c */ "PUSH",
     /* 0x1d */ "SYS",
     /* 0x1e */ "RAND",
-    /* 0x1f */ "XXX",
+    /* 0x1f */ "JEC",
+    /* 0x20 */ "JNC",
+    /* 0x21 */ "JGC",
+    /* 0x22 */ "JSG",
+    /* 0x23 */ "LOOP",
+    /* 0x24 */ "LD",
+    /* 0x25 */ "ST",
+    /* 0x26 */ "XXX",
 };
 
-void zz_output_message(int level, char *msg, ...)
+void zz_set_log(ZZVM *vm, FILE *pipe, int level, int async)
 {
-    if(level < zz_msg_level) {
-        return;
+    if(async && zz_log_start() != ZZ_SUCCESS) {
+        async = 0;
     }
-    if(zz_msg_pipe == NULL) {
+    vm->log.pipe = pipe;
+    vm->log.level = level;
+    vm->log.async = async;
+}
+
+void zz_output_message(ZZVM *vm, int level, const char *msg, ...)
+{
+    ZZ_LOG *log = &vm->log;
+    if(level < log->level || log->pipe == NULL) {
         return;
     }
 
     va_list args;
     va_start(args, msg);
-    vfprintf(zz_msg_pipe, msg, args);
+    if(log->async) {
+        zz_log_post(log->pipe, msg, args);
+    } else {
+        vfprintf(log->pipe, msg, args);
+    }
     va_end(args);
 }
 
+// write guest memory to fd, returns bytes written or -1
+static ssize_t _zz_write_guest(ZZVM_CTX *ctx, int fd, ZZ_ADDRESS addr, size_t len)
+{
+    size_t done = 0;
+
+    while(done < len) {
+        uint8_t *ptr;
+        size_t n = zz_mem_span(ctx, addr + done, len - done, 0, &ptr);
+        ssize_t r = write(fd, ptr, n);
+        if(r <= 0) {
+            return done ? done : -1;
+        }
+        done += r;
+    }
+    return done;
+}
+
 uint16_t _zz_default_syscall_handler(ZZVM_CTX *ctx)
 {
     char c;
+    ZZ_REGISTERS *regs = &ctx->regs;
 
-    switch (ctx->regs.RA) {
-        case 0: // read
+    switch (regs->RA) {
+        case ZZ_SYS_READ:
             if(read(0, &c, 1) == 1) {
                 return c;
             } else {
                 return 0xffff;
             }
-        case 1: // write
-            c = ctx->regs.R1;
+        case ZZ_SYS_WRITE:
+            c = regs->R1;
             if(write(1, &c, 1) == 1) {
                 return 0;
             } else {
                 return 0xffff;
             }
+        case ZZ_SYS_WRITEN:
+            return _zz_write_guest(ctx, 1, regs->R1, regs->R2);
+        case ZZ_SYS_MEMCPY:
+            return zz_mem_copy(ctx, regs->R1, regs->R2, regs->R3) == ZZ_SUCCESS ? 0 : 0xffff;
+        case ZZ_SYS_MEMSET:
+            return zz_mem_fill(ctx, regs->R1, regs->R2, regs->R3) == ZZ_SUCCESS ? 0 : 0xffff;
+        case ZZ_SYS_MEMCMP:
+            return zz_mem_compare(ctx, regs->R1, regs->R2, regs->R3);
+        case ZZ_SYS_STRLEN:
+            return zz_mem_strlen(ctx, regs->R1);
+        case ZZ_SYS_XOR:
+            return zz_mem_xor(ctx, regs->R1, regs->R2, regs->R3) == ZZ_SUCCESS ? 0 : 0xffff;
+        case ZZ_SYS_MALLOC:
+            return zz_malloc(ZZ_CTX_VM(ctx), regs->R1);
+        case ZZ_SYS_FREE:
+            return zz_free(ZZ_CTX_VM(ctx), regs->R1) == ZZ_SUCCESS ? 0 : 0xffff;
+        case ZZ_SYS_REALLOC:
+            return zz_realloc(ZZ_CTX_VM(ctx), regs->R1, regs->R2);
+        case ZZ_SYS_XMAP:
+            return zz_xmem_map(ZZ_CTX_VM(ctx), regs->R1, regs->R2 | (uint32_t)regs->R3 << 16) == ZZ_SUCCESS ? 0 : 0xffff;
+        case ZZ_SYS_XUNMAP:
+            return zz_xmem_unmap(ZZ_CTX_VM(ctx), regs->R1) == ZZ_SUCCESS ? 0 : 0xffff;
+        case ZZ_SYS_XSEEK:
+            return zz_xmem_seek(ZZ_CTX_VM(ctx), regs->R1 | (uint64_t)regs->R2 << 16 | (uint64_t)regs->R3 << 32) == ZZ_SUCCESS ? 0 : 0xffff;
+        case ZZ_SYS_XREAD:
+            return zz_xmem_copy(ZZ_CTX_VM(ctx), regs->R1, regs->R2, 0);
+        case ZZ_SYS_XWRITE:
+            return zz_xmem_copy(ZZ_CTX_VM(ctx), regs->R1, regs->R2, 1);
     }
     return 0;
 }
 
+#ifdef ZZ_PAGED_MEMORY
+// drop the private page at index, host buffers are not ours to free
+static void _zz_release_page(ZZVM_CTX *ctx, int index)
+{
+    if(!ctx->borrowed[index]) {
+        free(ctx->wpages[index]);
+    }
+    ctx->wpages[index] = NULL;
+    ctx->borrowed[index] = 0;
+}
+#endif
+
 int zz_create(ZZVM **p_vm)
 {
     *p_vm = NULL;
@@ -94,6 +173,11 @@ int zz_create(ZZVM **p_vm)
     }
 
     memset(&vm->ctx, 0, sizeof(ZZVM_CTX));
+#ifdef ZZ_PAGED_MEMORY
+    for(int i = 0; i < ZZ_PAGE_COUNT; i++) {
+        vm->ctx.pages[i] = zz_zero_page;
+    }
+#endif
     vm->ctx.random_seed = time(NULL) ^ (uint64_t)&vm ^ (uint64_t)p_vm ^ (uint64_t)vm ^ random();
 #ifdef ZZ_UNIX_ENV
     uint64_t seed;
@@ -106,6 +190,25 @@ int zz_create(ZZVM **p_vm)
     }
 #endif
     zz_reg_syscall_handler(vm, _zz_default_syscall_handler);
+    vm->async_syscalls = 0;
+    vm->userdata = NULL;
+    vm->coverage = NULL;
+    vm->coverage_prev = 0;
+    vm->heap = NULL;
+    vm->xmem = NULL;
+    vm->xmem_offset = 0;
+    vm->tier_threshold[0] = 0;
+    vm->tier_threshold[1] = 0;
+    vm->tier = NULL;
+#ifdef ZZ_STATS_ENABLED
+    memset(vm->op_count, 0, sizeof(vm->op_count));
+    vm->taken_count = 0;
+    vm->jump_count = 0;
+    vm->promoted_count = 0;
+    vm->demoted_count = 0;
+    vm->decoded_count = 0;
+#endif
+    zz_set_log(vm, NULL, ZZ_MSGL_MSG, 0);
     vm->ctx.regs.SP = 0xFFF0;
     vm->state = ZZ_ST_SLEEP;
     *p_vm = vm;
@@ -114,40 +217,513 @@ int zz_create(ZZVM **p_vm)
 
 int zz_destroy(ZZVM *vm)
 {
-    if(vm->state == ZZ_ST_SLEEP) {
+    if(vm->state == ZZ_ST_SLEEP || vm->state == ZZ_ST_WAIT) {
+        zz_flush_stats(vm);
         vm->state = ZZ_ST_FREED;
+#ifdef ZZ_PAGED_MEMORY
+        for(int i = 0; i < ZZ_PAGE_COUNT; i++) {
+            _zz_release_page(&vm->ctx, i);
+        }
+#endif
+        zz_free_heap(vm->heap);
+        zz_tier_free(vm);
         free(vm);
         return ZZ_SUCCESS;
     } else if(vm->state == ZZ_ST_FREED) {
-        zz_fatal("[FATAL] double free detected\n");
+        zz_fatal(vm, "[FATAL] double free detected\n");
         return ZZ_FAILED;
     } else {
         return ZZ_FAILED;
     }
 }
 
-int zz_write_mem(ZZVM *vm, ZZ_ADDRESS addr, void *data, size_t len)
+int zz_reset(ZZVM *vm)
+{
+    if(vm->state != ZZ_ST_SLEEP && vm->state != ZZ_ST_WAIT) {
+        return ZZ_FAILED;
+    }
+
+    zz_flush_stats(vm);
+#ifdef ZZ_PAGED_MEMORY
+    for(int i = 0; i < ZZ_PAGE_COUNT; i++) {
+        _zz_release_page(&vm->ctx, i);
+        vm->ctx.pages[i] = zz_zero_page;
+    }
+#else
+    memset(vm->ctx.memory, 0, ZZ_MEM_LIMIT);
+#endif
+    zz_free_heap(vm->heap);
+    vm->heap = NULL;
+    vm->xmem_offset = 0;
+    zz_tier_reset(vm);
+    memset(vm->ctx.registers, 0, sizeof(vm->ctx.registers));
+    memset(&vm->pending, 0, sizeof(vm->pending));
+    vm->ctx.regs.SP = 0xFFF0;
+    vm->state = ZZ_ST_SLEEP;
+    return ZZ_SUCCESS;
+}
+
+int zz_snapshot(ZZVM *vm, ZZ_SNAPSHOT **out_snapshot)
 {
+    *out_snapshot = NULL;
     if(vm->state != ZZ_ST_SLEEP) {
         return ZZ_FAILED;
     }
-    if(addr + len >= ZZ_MEM_LIMIT) {
+
+    ZZ_SNAPSHOT *snapshot = malloc(sizeof(ZZ_SNAPSHOT));
+    if(snapshot == NULL) {
+        return ZZ_FAILED;
+    }
+    snapshot->heap = NULL;
+    if(zz_copy_heap(&snapshot->heap, vm->heap) != ZZ_SUCCESS) {
+        free(snapshot);
+        return ZZ_FAILED;
+    }
+
+    memcpy(snapshot->registers, vm->ctx.registers, sizeof(snapshot->registers));
+    snapshot->random_seed = vm->ctx.random_seed;
+    snapshot->xmem_offset = vm->xmem_offset;
+#ifdef ZZ_PAGED_MEMORY
+    // the next write to any page faults again, so wpages is exactly the
+    // set of pages a restore has to drop
+    for(int i = 0; i < ZZ_PAGE_COUNT; i++) {
+        snapshot->pages[i] = vm->ctx.pages[i];
+        snapshot->owned[i] = vm->ctx.wpages[i];
+        if(vm->ctx.borrowed[i]) {
+            // host buffers keep changing, save their content instead
+            if((snapshot->owned[i] = malloc(ZZ_PAGE_SIZE)) == NULL) {
+                while(i-- > 0) {
+                    if(vm->ctx.borrowed[i]) {
+                        free(snapshot->owned[i]);
+                    } else {
+                        vm->ctx.wpages[i] = snapshot->owned[i];
+                    }
+                }
+                zz_free_heap(snapshot->heap);
+                free(snapshot);
+                return ZZ_FAILED;
+            }
+            memcpy(snapshot->owned[i], vm->ctx.wpages[i], ZZ_PAGE_SIZE);
+            snapshot->pages[i] = snapshot->owned[i];
+        } else {
+            vm->ctx.wpages[i] = NULL;
+        }
+    }
+#else
+    memcpy(snapshot->memory, vm->ctx.memory, ZZ_MEM_LIMIT);
+#endif
+
+    *out_snapshot = snapshot;
+    return ZZ_SUCCESS;
+}
+
+int zz_restore(ZZVM *vm, const ZZ_SNAPSHOT *snapshot)
+{
+    if(vm->state != ZZ_ST_SLEEP && vm->state != ZZ_ST_WAIT) {
+        return ZZ_FAILED;
+    }
+    if(zz_copy_heap(&vm->heap, snapshot->heap) != ZZ_SUCCESS) {
+        return ZZ_FAILED;
+    }
+
+    // decoded blocks outlive a restore unless their code changes
+    for(int i = 0; vm->tier && i < ZZ_PAGE_COUNT; i++) {
+#ifdef ZZ_PAGED_MEMORY
+        const uint8_t *now = vm->ctx.pages[i], *then = snapshot->pages[i];
+#else
+        const uint8_t *now = vm->ctx.memory + (i << ZZ_PAGE_SHIFT);
+        const uint8_t *then = snapshot->memory + (i << ZZ_PAGE_SHIFT);
+#endif
+        if(vm->tier->code_pages[i] && now != then && memcmp(now, then, ZZ_PAGE_SIZE)) {
+            zz_tier_invalidate(vm, i << ZZ_PAGE_SHIFT, ZZ_PAGE_SIZE);
+        }
+    }
+
+#ifdef ZZ_PAGED_MEMORY
+    for(int i = 0; i < ZZ_PAGE_COUNT; i++) {
+        if(vm->ctx.wpages[i]) {
+            _zz_release_page(&vm->ctx, i);
+        }
+        vm->ctx.pages[i] = snapshot->pages[i];
+    }
+#else
+    memcpy(vm->ctx.memory, snapshot->memory, ZZ_MEM_LIMIT);
+#endif
+    memcpy(vm->ctx.registers, snapshot->registers, sizeof(vm->ctx.registers));
+    vm->ctx.random_seed = snapshot->random_seed;
+    vm->xmem_offset = snapshot->xmem_offset;
+    memset(&vm->pending, 0, sizeof(vm->pending));
+    vm->coverage_prev = 0;
+    vm->state = ZZ_ST_SLEEP;
+    return ZZ_SUCCESS;
+}
+
+void zz_free_snapshot(ZZ_SNAPSHOT *snapshot)
+{
+#ifdef ZZ_PAGED_MEMORY
+    for(int i = 0; i < ZZ_PAGE_COUNT; i++) {
+        free(snapshot->owned[i]);
+    }
+#endif
+    zz_free_heap(snapshot->heap);
+    free(snapshot);
+}
+
+int zz_set_coverage(ZZVM *vm, uint8_t *bitmap)
+{
+    if(vm->state != ZZ_ST_SLEEP && vm->state != ZZ_ST_WAIT) {
+        return ZZ_FAILED;
+    }
+    vm->coverage = bitmap;
+    vm->coverage_prev = 0;
+    return ZZ_SUCCESS;
+}
+
+uint8_t *zz_page_fault(ZZVM_CTX *ctx, ZZ_ADDRESS addr)
+{
+#ifdef ZZ_PAGED_MEMORY
+    int index = addr >> ZZ_PAGE_SHIFT;
+    uint8_t *page;
+
+    if(ctx->wpages[index]) {
+        return ctx->wpages[index];
+    }
+
+    // copy-on-write, the old page is either the zero page or a shared one
+    if(ctx->pages[index] == zz_zero_page) {
+        page = calloc(1, ZZ_PAGE_SIZE);
+    } else if((page = malloc(ZZ_PAGE_SIZE)) != NULL) {
+        memcpy(page, ctx->pages[index], ZZ_PAGE_SIZE);
+    }
+
+    if(page == NULL) {
+        return NULL;
+    }
+    ctx->pages[index] = ctx->wpages[index] = page;
+    return page;
+#else
+    return ctx->memory;
+#endif
+}
+
+// find the contiguous host memory backing guest memory at addr, returns the
+// usable length (at most len), or 0 if a private page can not be allocated.
+// Writable spans demote decoded code they cover
+size_t zz_mem_span(ZZVM_CTX *ctx, ZZ_ADDRESS addr, size_t len, int writable, uint8_t **out)
+{
+#ifdef ZZ_PAGED_MEMORY
+    size_t left = ZZ_PAGE_SIZE - (addr & ZZ_PAGE_MASK);
+    uint8_t *page = ctx->pages[addr >> ZZ_PAGE_SHIFT];
+
+    if(writable && (page = zz_page_fault(ctx, addr)) == NULL) {
+        return 0;
+    }
+    *out = page + (addr & ZZ_PAGE_MASK);
+#else
+    size_t left = ZZ_MEM_LIMIT - addr;
+
+    *out = ctx->memory + addr;
+#endif
+    if(len > left) {
+        len = left;
+    }
+    if(writable) {
+        zz_tier_invalidate(ZZ_CTX_VM(ctx), addr, len);
+    }
+    return len;
+}
+
+// largest run of guest memory which is contiguous on the host
+#ifdef ZZ_PAGED_MEMORY
+#define ZZ_SPAN_MASK ZZ_PAGE_MASK
+#else
+#define ZZ_SPAN_MASK (ZZ_MEM_LIMIT - 1)
+#endif
+
+#define ZZ_MIN(A, B) ((A) < (B) ? (A) : (B))
+
+int zz_mem_copy(ZZVM_CTX *ctx, ZZ_ADDRESS dst, ZZ_ADDRESS src, size_t len)
+{
+    uint8_t *pd, *ps;
+    size_t n;
+
+    if(len > ZZ_MEM_LIMIT) {
         return ZZ_OUT_BOUND;
     }
-    memcpy(vm->ctx.memory + addr, data, len);
+
+    if((ZZ_ADDRESS)(dst - src) >= len || dst == src) {
+        // dst does not overlap the tail of src, copy forward
+        while(len > 0) {
+            n = zz_mem_span(ctx, dst, len, 1, &pd);
+            if(n == 0) {
+                return ZZ_NO_MEMORY;
+            }
+            n = zz_mem_span(ctx, src, n, 0, &ps);
+            memmove(pd, ps, n);
+            dst += n;
+            src += n;
+            len -= n;
+        }
+    } else {
+        // copy backward, chunks end at the host contiguous boundary
+        while(len > 0) {
+            ZZ_ADDRESS dst_last = dst + len - 1, src_last = src + len - 1;
+            n = ZZ_MIN(len, ZZ_MIN((dst_last & ZZ_SPAN_MASK) + 1u, (src_last & ZZ_SPAN_MASK) + 1u));
+            if(zz_mem_span(ctx, dst_last - n + 1, n, 1, &pd) != n) {
+                return ZZ_NO_MEMORY;
+            }
+            zz_mem_span(ctx, src_last - n + 1, n, 0, &ps);
+            memmove(pd, ps, n);
+            len -= n;
+        }
+    }
     return ZZ_SUCCESS;
 }
 
+int zz_mem_fill(ZZVM_CTX *ctx, ZZ_ADDRESS dst, uint8_t value, size_t len)
+{
+    if(len > ZZ_MEM_LIMIT) {
+        return ZZ_OUT_BOUND;
+    }
+
+    while(len > 0) {
+        uint8_t *ptr;
+        size_t n = zz_mem_span(ctx, dst, len, 1, &ptr);
+        if(n == 0) {
+            return ZZ_NO_MEMORY;
+        }
+        memset(ptr, value, n);
+        dst += n;
+        len -= n;
+    }
+    return ZZ_SUCCESS;
+}
+
+int zz_mem_compare(ZZVM_CTX *ctx, ZZ_ADDRESS a, ZZ_ADDRESS b, size_t len)
+{
+    if(len > ZZ_MEM_LIMIT) {
+        len = ZZ_MEM_LIMIT;
+    }
+
+    while(len > 0) {
+        uint8_t *pa, *pb;
+        size_t n = zz_mem_span(ctx, a, len, 0, &pa);
+        n = zz_mem_span(ctx, b, n, 0, &pb);
+        int r = memcmp(pa, pb, n);
+        if(r) {
+            return r < 0 ? -1 : 1;
+        }
+        a += n;
+        b += n;
+        len -= n;
+    }
+    return 0;
+}
+
+size_t zz_mem_strlen(ZZVM_CTX *ctx, ZZ_ADDRESS addr)
+{
+    size_t len = 0;
+
+    while(len < ZZ_MEM_LIMIT) {
+        uint8_t *ptr, *end;
+        size_t n = zz_mem_span(ctx, addr + len, ZZ_MEM_LIMIT - len, 0, &ptr);
+        if((end = memchr(ptr, 0, n)) != NULL) {
+            return len + (end - ptr);
+        }
+        len += n;
+    }
+    return ZZ_MEM_LIMIT - 1;
+}
+
+int zz_mem_xor(ZZVM_CTX *ctx, ZZ_ADDRESS dst, ZZ_ADDRESS key, size_t len)
+{
+    if(len > ZZ_MEM_LIMIT) {
+        return ZZ_OUT_BOUND;
+    }
+
+    while(len > 0) {
+        uint8_t *pd, *pk;
+        size_t n = zz_mem_span(ctx, dst, len, 1, &pd);
+        if(n == 0) {
+            return ZZ_NO_MEMORY;
+        }
+        n = zz_mem_span(ctx, key, n, 0, &pk);
+        for(size_t i = 0; i < n; i++) {
+            pd[i] ^= pk[i];
+        }
+        dst += n;
+        key += n;
+        len -= n;
+    }
+    return ZZ_SUCCESS;
+}
+
+// copy between host and guest, the guest range wraps around at ZZ_MEM_LIMIT
+static int _zz_copy_mem(ZZVM *vm, ZZ_ADDRESS addr, uint8_t *host, size_t len, int write)
+{
+    while(len > 0) {
+        uint8_t *ptr;
+        size_t n = zz_mem_span(&vm->ctx, addr, len, write, &ptr);
+        if(n == 0) {
+            return ZZ_NO_MEMORY;
+        }
+        if(write) {
+            memcpy(ptr, host, n);
+        } else {
+            memcpy(host, ptr, n);
+        }
+        host += n;
+        addr += n;
+        len -= n;
+    }
+    return ZZ_SUCCESS;
+}
+
+int zz_write_mem(ZZVM *vm, ZZ_ADDRESS addr, void *data, size_t len)
+{
+    // syscall handlers access memory while the vm executes
+    if(vm->state == ZZ_ST_FREED) {
+        return ZZ_FAILED;
+    }
+    if(addr + len > ZZ_MEM_LIMIT) {
+        return ZZ_OUT_BOUND;
+    }
+    return _zz_copy_mem(vm, addr, data, len, 1);
+}
+
 int zz_read_mem(ZZVM *vm, ZZ_ADDRESS addr, void *buffer, size_t len)
+{
+    // syscall handlers access memory while the vm executes
+    if(vm->state == ZZ_ST_FREED) {
+        return ZZ_FAILED;
+    }
+    if(addr + len > ZZ_MEM_LIMIT) {
+        return ZZ_OUT_BOUND;
+    }
+    return _zz_copy_mem(vm, addr, buffer, len, 0);
+}
+
+static int _zz_copy_vector(ZZVM *vm, const ZZ_IOVEC *iov, int count, int write)
+{
+    if(vm->state == ZZ_ST_FREED) {
+        return ZZ_FAILED;
+    }
+    for(int i = 0; i < count; i++) {
+        if(iov[i].len > ZZ_MEM_LIMIT) {
+            return ZZ_OUT_BOUND;
+        }
+    }
+    for(int i = 0; i < count; i++) {
+        int r = _zz_copy_mem(vm, iov[i].addr, iov[i].base, iov[i].len, write);
+        if(r != ZZ_SUCCESS) {
+            return r;
+        }
+    }
+    return ZZ_SUCCESS;
+}
+
+int zz_readv(ZZVM *vm, const ZZ_IOVEC *iov, int count)
+{
+    return _zz_copy_vector(vm, iov, count, 0);
+}
+
+int zz_writev(ZZVM *vm, const ZZ_IOVEC *iov, int count)
+{
+    return _zz_copy_vector(vm, iov, count, 1);
+}
+
+int zz_get_view(ZZVM *vm, ZZ_ADDRESS addr, size_t len, int writable, ZZ_SPAN *spans, int *count)
+{
+    int used = 0;
+
+    if(vm->state == ZZ_ST_FREED) {
+        return ZZ_FAILED;
+    }
+    if(len > ZZ_MEM_LIMIT) {
+        return ZZ_OUT_BOUND;
+    }
+    while(len > 0) {
+        if(used == *count) {
+            return ZZ_OUT_BOUND;
+        }
+        size_t n = zz_mem_span(&vm->ctx, addr, len, writable, &spans[used].ptr);
+        if(n == 0) {
+            return ZZ_NO_MEMORY;
+        }
+        spans[used++].len = n;
+        addr += n;
+        len -= n;
+    }
+    *count = used;
+    return ZZ_SUCCESS;
+}
+
+int zz_map_shared(ZZVM *vm, ZZ_ADDRESS addr, const void *data, size_t len)
 {
     if(vm->state != ZZ_ST_SLEEP) {
         return ZZ_FAILED;
     }
-    if(addr + len >= ZZ_MEM_LIMIT) {
+    if(addr + len > ZZ_MEM_LIMIT) {
         return ZZ_OUT_BOUND;
     }
-    memcpy(buffer, vm->ctx.memory + addr, len);
+#ifdef ZZ_PAGED_MEMORY
+    return zz_map_pages(&vm->ctx, addr, (uint8_t *)data, len, 0);
+#else
+    memcpy(vm->ctx.memory + addr, data, len);
     return ZZ_SUCCESS;
+#endif
+}
+
+int zz_map_host(ZZVM *vm, ZZ_ADDRESS addr, void *buffer, size_t len)
+{
+    if(vm->state != ZZ_ST_SLEEP && vm->state != ZZ_ST_WAIT) {
+        return ZZ_FAILED;
+    }
+    if(addr + len > ZZ_MEM_LIMIT) {
+        return ZZ_OUT_BOUND;
+    }
+    return zz_map_pages(&vm->ctx, addr, buffer, len, 1);
+}
+
+int zz_map_pages(ZZVM_CTX *ctx, ZZ_ADDRESS addr, uint8_t *buffer, size_t len, int writable)
+{
+#ifdef ZZ_PAGED_MEMORY
+    if((addr & ZZ_PAGE_MASK) || (len & ZZ_PAGE_MASK) || addr + len > ZZ_MEM_LIMIT) {
+        return ZZ_FAILED;
+    }
+    zz_tier_invalidate(ZZ_CTX_VM(ctx), addr, len);
+    for(size_t off = 0; off < len; off += ZZ_PAGE_SIZE) {
+        int index = (addr + off) >> ZZ_PAGE_SHIFT;
+        _zz_release_page(ctx, index);
+        if(buffer == NULL) {
+            ctx->pages[index] = zz_zero_page;
+        } else if(writable) {
+            ctx->pages[index] = ctx->wpages[index] = buffer + off;
+            ctx->borrowed[index] = 1;
+        } else {
+            ctx->pages[index] = buffer + off;
+        }
+    }
+    return ZZ_SUCCESS;
+#else
+    // flat memory can not alias host buffers
+    return ZZ_FAILED;
+#endif
+}
+
+size_t zz_mem_usage(ZZVM *vm)
+{
+#ifdef ZZ_PAGED_MEMORY
+    size_t usage = 0;
+    for(int i = 0; i < ZZ_PAGE_COUNT; i++) {
+        if(vm->ctx.wpages[i] && !vm->ctx.borrowed[i]) {
+            usage += ZZ_PAGE_SIZE;
+        }
+    }
+    return usage;
+#else
+    return ZZ_MEM_LIMIT;
+#endif
 }
 
 int zz_put_code(ZZVM *vm, ZZ_ADDRESS addr, ZZ_INSTRUCTION *ins, size_t count)
@@ -192,21 +768,33 @@ int zz_dump_context(ZZVM_CTX *ctx, char *buffer, size_t buffer_size)
         }
         ZZ_ADDRESS addr = ctx->regs.SP + i * sizeof(ctx->regs.RA);
         r += snprintf(buffer + r, buffer_size - r, "0x%.4x: 0x%.4x\n", addr,
-                *(uint16_t*)&ctx->memory[addr]);
+                zz_mem_read16(ctx, addr));
     }
     return r;
 }
 
-#define ZZ_MEM(CTX, TYPE, ADDR) ((TYPE*)&((CTX)->memory[(ZZ_ADDRESS)(ADDR)]))
-
 ZZ_INSTRUCTION * zz_fetch(ZZVM_CTX *ctx)
 {
+#ifdef ZZ_PAGED_MEMORY
+    ZZ_ADDRESS ip = ctx->regs.IP;
+
+    if((ip & ZZ_PAGE_MASK) <= ZZ_PAGE_SIZE - sizeof(ZZ_INSTRUCTION)) {
+        return (ZZ_INSTRUCTION*)&ctx->pages[ip >> ZZ_PAGE_SHIFT][ip & ZZ_PAGE_MASK];
+    }
+
+    uint8_t *buffer = (uint8_t*)&ctx->fetch_buffer;
+    for(int i = 0; i < sizeof(ZZ_INSTRUCTION); i++) {
+        buffer[i] = zz_mem_read8(ctx, ip + i);
+    }
+    return &ctx->fetch_buffer;
+#else
     return (ZZ_INSTRUCTION*)&ctx->memory[ctx->regs.IP];
+#endif
 }
 
 uint16_t zz_pop(ZZVM_CTX *ctx)
 {
-    uint16_t data = *ZZ_MEM(ctx, uint16_t, ctx->regs.SP);
+    uint16_t data = zz_mem_read16(ctx, ctx->regs.SP);
     ctx->regs.SP += 4;
     return data;
 }
@@ -214,6 +802,53 @@ uint16_t zz_pop(ZZVM_CTX *ctx)
 #define ZZ_DO_SHIFT(V, O) (O >= 0) ? (V >> O) : (V << -O)
 #define ZZ_SHIFT(VALUE, OFFSET) ZZ_DO_SHIFT((VALUE), ((int16_t)(OFFSET)))
 
+// per vm counters, see zz_get_stats
+#ifdef ZZ_STATS_ENABLED
+#define ZZ_COUNT_OP(OP)    vm->op_count[OP]++
+#define ZZ_COUNT_TAKEN()   vm->taken_count++
+#define ZZ_COUNT_JUMP()    vm->jump_count++
+#define ZZ_COUNT_DECODED() vm->decoded_count++
+#else
+#define ZZ_COUNT_OP(OP)
+#define ZZ_COUNT_TAKEN()
+#define ZZ_COUNT_JUMP()
+#define ZZ_COUNT_DECODED()
+#endif
+
+// a taken jump enters its target, through a backward branch when OFFSET
+// does not move past the jump
+#define ZZ_TAKEN(OFFSET) \
+    ZZ_COUNT_TAKEN(); \
+    if((int16_t)(OFFSET) < 0) { \
+        entered = ZZ_TIER_LOOP; \
+    }
+
+// AFL style edge coverage, hooked on every jump, call and return, which
+// all enter a block
+#define ZZ_COVER(DEST) \
+    if(vm->coverage) { \
+        uint16_t cur = ((DEST) >> 2) * 40503u; \
+        vm->coverage[cur ^ vm->coverage_prev]++; \
+        vm->coverage_prev = cur >> 1; \
+    } \
+    if(!entered) { \
+        entered = ZZ_TIER_BLOCK; \
+    }
+
+// stores may allocate a private page, bail out of zz_execute if that fails.
+// A store into decoded code drops the rest of the running block
+#define ZZ_STORE16(ADDR, VALUE) { \
+    ZZ_ADDRESS dest = (ADDR); \
+    if(zz_mem_write16(ctx, dest, (VALUE)) != ZZ_SUCCESS) { \
+        goto no_memory; \
+    } \
+    if(vm->tier && zz_tier_written(vm->tier, dest)) { \
+        zz_tier_invalidate(vm, dest, sizeof(uint16_t)); \
+        left = 0; \
+        entered = ZZ_TIER_RESUME; \
+    } \
+}
+
 int zz_execute(ZZVM *vm, int count, int *stop_reason)
 {
     if(vm->state != ZZ_ST_SLEEP) {
@@ -226,6 +861,16 @@ int zz_execute(ZZVM *vm, int count, int *stop_reason)
     ZZ_REGISTERS *regs = &ctx->regs;
     uint16_t *rega = ctx->registers;
 
+    // rest of the decoded block being run, and how the current address was
+    // reached when it may start a block
+    const ZZ_DECODED *next = NULL;
+    int left = 0;
+    int entered = ZZ_TIER_RESUME;
+
+    if(vm->tier == NULL && (vm->tier_threshold[0] || vm->tier_threshold[1])) {
+        zz_tier_create(vm);
+    }
+
     while(1) {
         if(count > 0) {
             count--;
@@ -233,26 +878,65 @@ int zz_execute(ZZVM *vm, int count, int *stop_reason)
             break;
         }
 
-        if(regs->IP > (ZZ_MEM_LIMIT - sizeof(ZZ_INSTRUCTION))) {
-            zz_error("[ERROR] IP out of bound\n");
-            *stop_reason = ZZ_OUT_BOUND;
-            vm->state = ZZ_ST_SLEEP;
-            return ZZ_FAILED;
+        if(entered) {
+            const ZZ_BLOCK *block = zz_tier_enter(vm, regs->IP, entered);
+            if(block) {
+                next = &vm->tier->code[block->code];
+                left = block->length;
+            }
+            entered = 0;
         }
 
-        ZZ_INSTRUCTION *ins = zz_fetch(ctx);
+        ZZ_DECODED decoded;
+        const ZZ_DECODED *ins;
+
+        if(left > 0) {
+            // decoded code was checked when the block was promoted
+            ins = next++;
+            if(--left == 0) {
+                entered = ZZ_TIER_BLOCK;
+            }
+            ZZ_COUNT_DECODED();
+        } else {
+            if(regs->IP > (ZZ_MEM_LIMIT - sizeof(ZZ_INSTRUCTION))) {
+                zz_error(vm, "[ERROR] IP out of bound\n");
+                *stop_reason = ZZ_OUT_BOUND;
+                vm->state = ZZ_ST_SLEEP;
+                return ZZ_FAILED;
+            }
+
+            ZZ_INSTRUCTION *raw = zz_fetch(ctx);
 
-        uint8_t r1 = ins->reg >> 4;
-        uint8_t r2 = ins->reg & 0xf;
-        uint8_t r3 = ins->imm & 7;
+            decoded.op = raw->op;
+            decoded.r1 = raw->reg >> 4;
+            decoded.r2 = raw->reg & 0xf;
+            decoded.r3 = raw->imm & 7;
+            decoded.imm = raw->imm;
+            ins = &decoded;
 
-        if((r1 & 8) || (r2 & 8)) {
-            zz_error("[ERROR] invalid register\n");
-            *stop_reason = ZZ_INVALID_REGISTER;
-            vm->state = ZZ_ST_SLEEP;
-            return ZZ_FAILED;
+            if((decoded.r1 & 8) || (decoded.r2 & 8)) {
+                zz_error(vm, "[ERROR] invalid register\n");
+                *stop_reason = ZZ_INVALID_REGISTER;
+                vm->state = ZZ_ST_SLEEP;
+                return ZZ_FAILED;
+            }
+        }
+
+        uint8_t r1 = ins->r1;
+        uint8_t r2 = ins->r2;
+        uint8_t r3 = ins->r3;
+
+        // anything writing IP is a jump, JMP is ADDI IP, IP, offset
+        if(r1 == ZZ_IP) {
+            entered = ins->op == ZZOP_ADDI && r2 == ZZ_IP && (int16_t)ins->imm < 0 ?
+                      ZZ_TIER_LOOP : ZZ_TIER_BLOCK;
+            if(ins->op == ZZOP_ADDI || ins->op == ZZOP_ADDR) {
+                ZZ_COUNT_JUMP();
+            }
         }
 
+        ZZ_COUNT_OP(ins->op);
+
         switch(ins->op) {
             case ZZOP_NOP:  break;
             case ZZOP_NEG:  rega[r1] = -rega[r2]; break;
@@ -269,8 +953,10 @@ int zz_execute(ZZVM *vm, int count, int *stop_reason)
             case ZZOP_SHRR: rega[r1] = ZZ_SHIFT(rega[r2], rega[r3]); break;
             case ZZOP_SHRI: rega[r1] = ZZ_SHIFT(rega[r2], ins->imm); break;
             case ZZOP_NOT:  rega[r1] = ~rega[r2]; break;
-            case ZZOP_LD:   rega[r1] = *ZZ_MEM(ctx, uint16_t, rega[r2] + ins->imm); break;
-            case ZZOP_ST:   *ZZ_MEM(ctx, uint16_t, rega[r2] + ins->imm) = rega[r1]; break;
+            case ZZOP_LD:   rega[r1] = zz_mem_read16(ctx, rega[r2] + ins->imm); break;
+            case ZZOP_ST:   ZZ_STORE16(rega[r2] + ins->imm, rega[r1]); break;
+            case ZZOP_LDR:  rega[r1] = zz_mem_read16(ctx, rega[r2] + rega[r3]); break;
+            case ZZOP_STR:  ZZ_STORE16(rega[r2] + rega[r3], rega[r1]); break;
 
             case ZZOP_HLT:
                 *stop_reason = ZZ_HALT;
@@ -283,55 +969,118 @@ int zz_execute(ZZVM *vm, int count, int *stop_reason)
             case ZZOP_JEI:
                 if(rega[r1] == rega[r2]) {
                     regs->IP += ins->imm;
+                    ZZ_TAKEN(ins->imm);
                 }
+                ZZ_COVER(regs->IP + sizeof(ZZ_INSTRUCTION));
                 break;
 
             case ZZOP_JNI:
                 if(rega[r1] != rega[r2]) {
                     regs->IP += ins->imm;
+                    ZZ_TAKEN(ins->imm);
                 }
+                ZZ_COVER(regs->IP + sizeof(ZZ_INSTRUCTION));
                 break;
 
             case ZZOP_JGI:
                 if(rega[r1] > rega[r2]) {
                     regs->IP += ins->imm;
+                    ZZ_TAKEN(ins->imm);
                 }
+                ZZ_COVER(regs->IP + sizeof(ZZ_INSTRUCTION));
                 break;
 
             case ZZOP_JZI:
                 if(rega[r1] == 0) {
                     regs->IP += ins->imm;
+                    ZZ_TAKEN(ins->imm);
+                }
+                ZZ_COVER(regs->IP + sizeof(ZZ_INSTRUCTION));
+                break;
+
+            case ZZOP_JSGI:
+                if((int16_t)rega[r1] > (int16_t)rega[r2]) {
+                    regs->IP += ins->imm;
+                    ZZ_TAKEN(ins->imm);
                 }
+                ZZ_COVER(regs->IP + sizeof(ZZ_INSTRUCTION));
+                break;
+
+            case ZZOP_JEC:
+                if(rega[r1] == ZZ_C_CONST(ins->imm)) {
+                    regs->IP += ZZ_C_OFFSET(ins->imm);
+                    ZZ_TAKEN(ZZ_C_OFFSET(ins->imm));
+                }
+                ZZ_COVER(regs->IP + sizeof(ZZ_INSTRUCTION));
+                break;
+
+            case ZZOP_JNC:
+                if(rega[r1] != ZZ_C_CONST(ins->imm)) {
+                    regs->IP += ZZ_C_OFFSET(ins->imm);
+                    ZZ_TAKEN(ZZ_C_OFFSET(ins->imm));
+                }
+                ZZ_COVER(regs->IP + sizeof(ZZ_INSTRUCTION));
+                break;
+
+            case ZZOP_JGC:
+                if(rega[r1] > ZZ_C_CONST(ins->imm)) {
+                    regs->IP += ZZ_C_OFFSET(ins->imm);
+                    ZZ_TAKEN(ZZ_C_OFFSET(ins->imm));
+                }
+                ZZ_COVER(regs->IP + sizeof(ZZ_INSTRUCTION));
+                break;
+
+            case ZZOP_LOOP:
+                if(--rega[r1] != 0) {
+                    regs->IP += ins->imm;
+                    ZZ_TAKEN(ins->imm);
+                }
+                ZZ_COVER(regs->IP + sizeof(ZZ_INSTRUCTION));
                 break;
 
             case ZZOP_CALL:
                 regs->SP -= sizeof(regs->RA);
-                *(uint16_t*)&ctx->memory[(uint64_t)regs->SP] = regs->IP + sizeof(ZZ_INSTRUCTION);
+                ZZ_STORE16(regs->SP, regs->IP + sizeof(ZZ_INSTRUCTION));
                 regs->IP += ins->imm;
+                ZZ_COVER(regs->IP + sizeof(ZZ_INSTRUCTION));
                 break;
 
             case ZZOP_RET:
-                regs->IP = *(uint16_t*)&ctx->memory[(uint64_t)regs->SP];
+                regs->IP = zz_mem_read16(ctx, regs->SP);
                 regs->SP += sizeof(regs->RA);
+                ZZ_COVER(regs->IP);
                 continue; // skip IP increment
 
             case ZZOP_POP:
-                rega[r1] = *(uint16_t*)&ctx->memory[(uint64_t)regs->SP];
+                rega[r1] = zz_mem_read16(ctx, regs->SP);
                 regs->SP += sizeof(regs->RA);
                 break;
 
             case ZZOP_PUSH:
                 regs->SP -= sizeof(regs->RA);
-                *(uint16_t*)&ctx->memory[(uint64_t)regs->SP] = rega[r1];
+                ZZ_STORE16(regs->SP, rega[r1]);
                 break;
 
             case ZZOP_PUSI:
                 regs->SP -= sizeof(regs->RA);
-                *(uint16_t*)&ctx->memory[(uint64_t)regs->SP] = ins->imm;
+                ZZ_STORE16(regs->SP, ins->imm);
                 break;
 
             case ZZOP_SYS:
+                if(regs->RA < 32 && (vm->async_syscalls & ZZ_SYS_MASK(regs->RA))) {
+                    vm->pending.number = regs->RA;
+                    vm->pending.args[0] = regs->R1;
+                    vm->pending.args[1] = regs->R2;
+                    vm->pending.args[2] = regs->R3;
+                    vm->count_left = count;
+                    regs->IP += sizeof(ZZ_INSTRUCTION);
+                    *stop_reason = ZZ_SYSCALL_PENDING;
+                    vm->state = ZZ_ST_WAIT;
+                    return ZZ_SUCCESS;
+                }
                 regs->RA = vm->syscall_handler(ctx);
+                // the handler may have rewritten code, so SYS ends a block
+                entered = ZZ_TIER_BLOCK;
                 break;
 
             case ZZOP_RAND:
@@ -349,6 +1098,12 @@ int zz_execute(ZZVM *vm, int count, int *stop_reason)
     *stop_reason = ZZ_SUCCESS;
     vm->state = ZZ_ST_SLEEP;
     return ZZ_SUCCESS;
+
+no_memory:
+    zz_error(vm, "[ERROR] out of memory for guest page\n");
+    *stop_reason = ZZ_NO_MEMORY;
+    vm->state = ZZ_ST_SLEEP;
+    return ZZ_FAILED;
 }
 
 int _zz_disasm_0(char *buffer, size_t limit, ZZ_ADDRESS ip, ZZ_INSTRUCTION *ins)
@@ -446,6 +1201,16 @@ int _zz_disasm_3j(char *buffer, size_t limit, ZZ_ADDRESS ip, ZZ_INSTRUCTION *ins
     return ZZ_SUCCESS;
 }
 
+int _zz_disasm_2c(char *buffer, size_t limit, ZZ_ADDRESS ip, ZZ_INSTRUCTION *ins)
+{
+    uint8_t r1 = ins->reg >> 4;
+
+    snprintf(buffer, limit, "%-5s %s, 0x%.4x, 0x%.4x", ZZ_OP_NAME[ins->op],
+             ZZ_REGISTER_NAME[r1], ZZ_C_CONST(ins->imm),
+             (ZZ_ADDRESS)(ZZ_C_OFFSET(ins->imm) + sizeof(ZZ_INSTRUCTION) + ip));
+    return ZZ_SUCCESS;
+}
+
 int zz_disasm(ZZ_ADDRESS ip, ZZ_INSTRUCTION *ins, char *buffer, size_t limit)
 {
     uint8_t r1 = ins->reg >> 4;
@@ -471,6 +1236,8 @@ int zz_disasm(ZZ_ADDRESS ip, ZZ_INSTRUCTION *ins, char *buffer, size_t limit)
         case ZZOP_ORR:
         case ZZOP_XORR:
         case ZZOP_SHRR:
+        case ZZOP_LDR:
+        case ZZOP_STR:
             return _zz_disasm_3r(buffer, limit, ip, ins);
 
         case ZZOP_ADDI:
@@ -487,11 +1254,18 @@ int zz_disasm(ZZ_ADDRESS ip, ZZ_INSTRUCTION *ins, char *buffer, size_t limit)
         case ZZOP_JEI:
         case ZZOP_JNI:
         case ZZOP_JGI:
+        case ZZOP_JSGI:
             return _zz_disasm_3j(buffer, limit, ip, ins);
 
         case ZZOP_JZI:
+        case ZZOP_LOOP:
             return _zz_disasm_2j(buffer, limit, ip, ins);
 
+        case ZZOP_JEC:
+        case ZZOP_JNC:
+        case ZZOP_JGC:
+            return _zz_disasm_2c(buffer, limit, ip, ins);
+
         case ZZOP_LD:
         case ZZOP_ST:
             return _zz_disasm_3i(buffer, limit, ip, ins);
@@ -525,3 +1299,65 @@ int zz_reg_syscall_handler(ZZVM *vm, ZZ_SYSCALL_HANDLER handler)
         return 1;
     }
 }
+
+int zz_set_async_syscalls(ZZVM *vm, uint32_t mask)
+{
+    if(vm->state != ZZ_ST_SLEEP) {
+        return ZZ_FAILED;
+    }
+    vm->async_syscalls = mask;
+    return ZZ_SUCCESS;
+}
+
+int zz_run(ZZVM *vm, int count, ZZ_EVENT *event)
+{
+    int status = zz_execute(vm, count, &event->stop_reason);
+    if(status == ZZ_SUCCESS && event->stop_reason == ZZ_SYSCALL_PENDING) {
+        event->syscall = vm->pending;
+        event->count_left = vm->count_left;
+    }
+    return status;
+}
+
+const ZZ_SYSCALL *zz_pending_syscall(ZZVM *vm)
+{
+    return vm->state == ZZ_ST_WAIT ? &vm->pending : NULL;
+}
+
+int zz_complete_syscall(ZZVM *vm, uint16_t result)
+{
+    if(vm->state != ZZ_ST_WAIT) {
+        return ZZ_FAILED;
+    }
+    vm->ctx.regs.RA = result;
+    vm->state = ZZ_ST_SLEEP;
+    return ZZ_SUCCESS;
+}
+
+int zz_dispatch_syscall(ZZVM *vm)
+{
+    if(vm->state != ZZ_ST_WAIT) {
+        return ZZ_FAILED;
+    }
+
+    // guest has not run since SYS, RA and R1-R3 still hold the request
+    return zz_complete_syscall(vm, vm->syscall_handler(&vm->ctx));
+}
+
+uint16_t *zz_registers(ZZVM *vm)
+{
+    return vm->ctx.registers;
+}
+
+uint8_t *zz_memory(ZZVM *vm)
+{
+#ifdef ZZ_PAGED_MEMORY
+    return NULL;
+#else
+    // writes through a raw view would not demote decoded code
+    if(vm->tier_threshold[0] || vm->tier_threshold[1]) {
+        return NULL;
+    }
+    return vm->ctx.memory;
+#endif
+}
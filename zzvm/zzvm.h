@@ -10,17 +10,37 @@
 #include <unistd.h>
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include "zzcode.h"
 
 #define ZZ_MEM_LIMIT 0x10000
 
+// guest memory page, the unit of sharing for ZZ_PAGED_MEMORY
+#ifndef ZZ_PAGE_SHIFT
+#define ZZ_PAGE_SHIFT 8
+#endif
+#define ZZ_PAGE_SIZE  (1 << ZZ_PAGE_SHIFT)
+#define ZZ_PAGE_MASK  (ZZ_PAGE_SIZE - 1)
+#define ZZ_PAGE_COUNT (ZZ_MEM_LIMIT >> ZZ_PAGE_SHIFT)
+
+// execution counters, make NOSTATS=1 compiles them out
+#ifndef ZZ_NO_STATS
+#define ZZ_STATS_ENABLED
+#endif
+
 typedef struct __attribute__((__packed__)) {
     uint8_t op;
     uint8_t reg;
     uint16_t imm;
 } ZZ_INSTRUCTION;
 
+// fields of C-type instruction
+#define ZZ_C_CONST(IMM)  ((uint16_t)(int8_t)((IMM) >> 8))
+#define ZZ_C_OFFSET(IMM) ((uint16_t)((int8_t)((IMM) & 0xff) * (int)sizeof(ZZ_INSTRUCTION)))
+
 typedef struct __attribute__((__packed__)) {
     uint16_t RA;
     uint16_t R1;
@@ -43,7 +63,18 @@ typedef struct __attribute__((__packed__)) {
 
 typedef struct {
     uint64_t random_seed;
+#ifdef ZZ_PAGED_MEMORY
+    // readable mapping of every page, untouched pages map the zero page
+    uint8_t *pages[ZZ_PAGE_COUNT];
+    // private pages owned by this vm, NULL until the first write
+    uint8_t *wpages[ZZ_PAGE_COUNT];
+    // set for writable pages which are host buffers from zz_map_host
+    uint8_t borrowed[ZZ_PAGE_COUNT];
+    // copy of an instruction which crosses a page boundary
+    ZZ_INSTRUCTION fetch_buffer;
+#else
     uint8_t memory[ZZ_MEM_LIMIT];
+#endif
     union {
         uint16_t registers[8];
         ZZ_REGISTERS regs;
@@ -52,12 +83,89 @@ typedef struct {
 
 typedef uint16_t (*ZZ_SYSCALL_HANDLER)(ZZVM_CTX *);
 
+// where messages of a vm go, each vm has its own
+typedef struct {
+    FILE *pipe;     // NULL discards every message
+    int level;      // messages below this level are dropped
+    int async;      // queue to the drain thread in zzlog.c instead of writing
+} ZZ_LOG;
+
+// syscall handed back to the host, registers at the SYS instruction
+typedef struct {
+    uint16_t number;    // RA
+    uint16_t args[3];   // R1, R2, R3
+} ZZ_SYSCALL;
+
+// what stopped zz_run
+typedef struct {
+    int stop_reason;    // ZZ_SUCCESS when count runs out
+    ZZ_SYSCALL syscall; // valid for ZZ_SYSCALL_PENDING
+    int count_left;     // unused part of count for ZZ_SYSCALL_PENDING
+} ZZ_EVENT;
+
+// allocator bookkeeping of the guest heap, zzheap.c
+typedef struct ZZ_HEAP ZZ_HEAP;
+// host store larger than guest memory, zzxmem.c
+typedef struct ZZ_XMEM ZZ_XMEM;
+// hotness counters and decoded blocks, zztier.c
+typedef struct ZZ_TIER ZZ_TIER;
+
 typedef struct {
     uint32_t state;
 	ZZ_SYSCALL_HANDLER syscall_handler;
+    // syscall numbers below 32 whose bit is set stop the vm instead of
+    // calling syscall_handler, see zz_set_async_syscalls
+    uint32_t async_syscalls;
+    ZZ_SYSCALL pending;
+    int count_left;
+    ZZ_LOG log;
+    void *userdata;     // owned by the embedder, not touched by zzvm
+#ifdef ZZ_STATS_ENABLED
+    // since the last zz_flush_stats, indexed by the raw opcode byte so
+    // counting needs no bound check
+    uint64_t op_count[256];
+    uint64_t taken_count;
+    uint64_t jump_count;    // ADD and ADDI writing IP, JMP among them
+    // tier transitions and instructions run from decoded blocks
+    uint64_t promoted_count;
+    uint64_t demoted_count;
+    uint64_t decoded_count;
+#endif
+    // edge coverage bitmap of ZZ_COVERAGE_SIZE bytes or NULL, see
+    // zz_set_coverage
+    uint8_t *coverage;
+    uint16_t coverage_prev;
+    // NULL until the first heap syscall or zz_set_heap
+    ZZ_HEAP *heap;
+    // attached by zz_set_xmem, offset of ZZ_SYS_XREAD and ZZ_SYS_XWRITE
+    ZZ_XMEM *xmem;
+    uint64_t xmem_offset;
+    // entries before a block is promoted, see zz_set_tiering, 0 and 0
+    // until it is called. The tier is allocated by the first zz_execute
+    uint16_t tier_threshold[2];
+    ZZ_TIER *tier;
     ZZVM_CTX ctx;
 } ZZVM;
 
+// saved memory and registers of a vm, see zz_snapshot
+typedef struct {
+    uint16_t registers[8];
+    uint64_t random_seed;
+#ifdef ZZ_PAGED_MEMORY
+    // mapping at snapshot time, private pages of the vm are moved into
+    // owned and shared from then on
+    uint8_t *pages[ZZ_PAGE_COUNT];
+    uint8_t *owned[ZZ_PAGE_COUNT];
+#else
+    uint8_t memory[ZZ_MEM_LIMIT];
+#endif
+    ZZ_HEAP *heap;
+    uint64_t xmem_offset;
+} ZZ_SNAPSHOT;
+
+// vm which owns ctx, for syscall handlers
+#define ZZ_CTX_VM(CTX) ((ZZVM *)((char *)(CTX) - offsetof(ZZVM, ctx)))
+
 typedef uint16_t ZZ_ADDRESS;
 
 // ZZVM.state
@@ -65,6 +173,7 @@ typedef uint16_t ZZ_ADDRESS;
 #define ZZ_ST_SLEEP 0xF2EE1111
 #define ZZ_ST_FREED 0xDEADC0DE
 #define ZZ_ST_EXEC  0x13136644
+#define ZZ_ST_WAIT  0x5C5CA11D // waiting for zz_complete_syscall
 
 // information level
 #define ZZ_MSGL_DEBUG 0
@@ -74,6 +183,8 @@ typedef uint16_t ZZ_ADDRESS;
 #define ZZ_MSGL_FATAL 4
 
 // ZZVM API status
+#define ZZ_SYSCALL_PENDING     -6
+#define ZZ_NO_MEMORY           -5
 #define ZZ_HALT                -4
 #define ZZ_INVALID_INSTRUCTION -3
 #define ZZ_INVALID_REGISTER    -2
@@ -81,16 +192,296 @@ typedef uint16_t ZZ_ADDRESS;
 #define ZZ_SUCCESS             0
 #define ZZ_FAILED              1
 
+// syscall numbers of the default syscall handler, selected by RA
+#define ZZ_SYS_READ   0 // RA = read a byte from stdin, 0xffff on EOF
+#define ZZ_SYS_WRITE  1 // write byte R1 to stdout
+#define ZZ_SYS_WRITEN 2 // RA = write R2 bytes at R1 to stdout
+#define ZZ_SYS_MEMCPY 3 // copy R3 bytes from R2 to R1, regions may overlap
+#define ZZ_SYS_MEMSET 4 // fill R3 bytes at R1 with byte R2
+#define ZZ_SYS_MEMCMP 5 // RA = compare R3 bytes at R1 and R2, -1, 0 or 1
+#define ZZ_SYS_STRLEN 6 // RA = length of string at R1
+#define ZZ_SYS_XOR    7 // xor R3 bytes at R1 with key at R2
+#define ZZ_SYS_MALLOC 8 // RA = R1 bytes from the guest heap, 0 when out of memory
+#define ZZ_SYS_FREE   9 // release block R1 of the guest heap, 0 is ignored
+#define ZZ_SYS_REALLOC 10 // RA = block R1 resized to R2 bytes, 0 on failure
+#define ZZ_SYS_XMAP   11 // map window R2 | R3 << 16 of extended memory at R1, 0xffff on failure
+#define ZZ_SYS_XUNMAP 12 // unmap the window at R1, it reads as zeros again
+#define ZZ_SYS_XSEEK  13 // move the copy offset to R1 | R2 << 16 | R3 << 32, 0xffff past the end
+#define ZZ_SYS_XREAD  14 // RA = copy up to R2 bytes at the offset to R1, 0 at the end
+#define ZZ_SYS_XWRITE 15 // RA = copy up to R2 bytes at R1 to the offset, 0 at the end
+
 // ZZVM API
 int zz_create(ZZVM **p_vm);
 int zz_destroy(ZZVM *vm);
+// clear memory and registers for the next guest, keeps handler, log and
+// userdata so pooled vms skip zz_create. The heap is back at the default
+// region
+int zz_reset(ZZVM *vm);
+
+// snapshots for running many short guests from one state, with
+// ZZ_PAGED_MEMORY a restore only drops pages written since the snapshot.
+// vms restored from a snapshot must be reset or destroyed before it is freed
+int zz_snapshot(ZZVM *vm, ZZ_SNAPSHOT **out_snapshot);
+int zz_restore(ZZVM *vm, const ZZ_SNAPSHOT *snapshot);
+void zz_free_snapshot(ZZ_SNAPSHOT *snapshot);
+// count edges between jumps, calls and returns into bitmap of
+// ZZ_COVERAGE_SIZE bytes (AFL layout), NULL turns it off
+#define ZZ_COVERAGE_SIZE 0x10000
+int zz_set_coverage(ZZVM *vm, uint8_t *bitmap);
 
+// host access to guest memory, allowed in every state but ZZ_ST_FREED so
+// syscall handlers and hosts of pending syscalls can use them.
+// addr + len may reach ZZ_MEM_LIMIT but not wrap past it
 int zz_write_mem(ZZVM *vm, ZZ_ADDRESS addr, void *data, size_t len);
 int zz_read_mem(ZZVM *vm, ZZ_ADDRESS addr, void *buffer, size_t len);
 int zz_put_code(ZZVM *vm, ZZ_ADDRESS addr, ZZ_INSTRUCTION *ins, size_t count);
 
+// scatter/gather between host buffers and guest ranges, len of a segment is
+// at most ZZ_MEM_LIMIT and its guest range wraps around like guest accesses
+typedef struct {
+    ZZ_ADDRESS addr;
+    void *base;
+    size_t len;
+} ZZ_IOVEC;
+
+int zz_readv(ZZVM *vm, const ZZ_IOVEC *iov, int count);
+int zz_writev(ZZVM *vm, const ZZ_IOVEC *iov, int count);
+
+// host memory backing a guest range, for filling guest buffers in place.
+// *count is the capacity of spans on entry and the number used on return,
+// flat memory needs one span (two when the range wraps), paged memory one
+// per page. Writable views fault private pages in first. A view is valid
+// until the vm runs, or until zz_reset, zz_restore or zz_destroy
+typedef struct {
+    uint8_t *ptr;
+    size_t len;
+} ZZ_SPAN;
+
+int zz_get_view(ZZVM *vm, ZZ_ADDRESS addr, size_t len, int writable, ZZ_SPAN *spans, int *count);
+
+// map read-only host data into guest memory, pages are copied on first write
+// with ZZ_PAGED_MEMORY addr and len must be page aligned and data must outlive vm
+int zz_map_shared(ZZVM *vm, ZZ_ADDRESS addr, const void *data, size_t len);
+// map a writable host buffer, guest loads and stores go straight to it until
+// zz_reset, zz_restore or zz_destroy. buffer NULL unmaps the range again.
+// Needs ZZ_PAGED_MEMORY and page aligned addr and len
+int zz_map_host(ZZVM *vm, ZZ_ADDRESS addr, void *buffer, size_t len);
+// the mapping behind both without a state check, for syscall handlers.
+// Read-only pages are copied on write, buffer NULL maps zeros
+int zz_map_pages(ZZVM_CTX *ctx, ZZ_ADDRESS addr, uint8_t *buffer, size_t len, int writable);
+// bytes of guest memory privately owned by vm
+size_t zz_mem_usage(ZZVM *vm);
+
+// bulk operations on guest memory, addresses wrap around at ZZ_MEM_LIMIT
+int zz_mem_copy(ZZVM_CTX *ctx, ZZ_ADDRESS dst, ZZ_ADDRESS src, size_t len);
+int zz_mem_fill(ZZVM_CTX *ctx, ZZ_ADDRESS dst, uint8_t value, size_t len);
+int zz_mem_compare(ZZVM_CTX *ctx, ZZ_ADDRESS a, ZZ_ADDRESS b, size_t len);
+size_t zz_mem_strlen(ZZVM_CTX *ctx, ZZ_ADDRESS addr);
+int zz_mem_xor(ZZVM_CTX *ctx, ZZ_ADDRESS dst, ZZ_ADDRESS key, size_t len);
+
+// guest heap behind ZZ_SYS_MALLOC, ZZ_SYS_FREE and ZZ_SYS_REALLOC, zzheap.c.
+// Blocks are ZZ_HEAP_ALIGN aligned and their sizes, free lists and size
+// classes live on the host, guest memory holds nothing but the data. A vm
+// gets the default region on its first heap syscall
+#define ZZ_HEAP_BASE  0x8000
+#define ZZ_HEAP_SIZE  0x6000
+#define ZZ_HEAP_ALIGN 8
+
+// move the heap to [base, base + size), every block is dropped. base must
+// not be 0 and both must be ZZ_HEAP_ALIGN aligned
+int zz_set_heap(ZZVM *vm, ZZ_ADDRESS base, size_t size);
+// the syscalls for the host, guest address or 0
+ZZ_ADDRESS zz_malloc(ZZVM *vm, size_t size);
+int zz_free(ZZVM *vm, ZZ_ADDRESS addr);
+ZZ_ADDRESS zz_realloc(ZZVM *vm, ZZ_ADDRESS addr, size_t size);
+// make *dst a copy of src for zz_snapshot and zz_restore, reusing *dst
+// when it has the same size. A NULL src frees *dst
+int zz_copy_heap(ZZ_HEAP **dst, const ZZ_HEAP *src);
+void zz_free_heap(ZZ_HEAP *heap);
+
+// extended memory, zzxmem.c. A host store of any size, zero filled or a
+// mapped file, which guests reach through windows of ZZ_XMEM_WINDOW bytes
+// (ZZ_PAGED_MEMORY only, guest accesses go straight to the store) or by
+// bulk copies from and to a 48-bit offset. One store may serve many vms and
+// must outlive them
+#define ZZ_XMEM_WINDOW 0x1000
+// modes of zz_xmem_open
+#define ZZ_XMEM_RDONLY  0   // xwrite fails, windows are copied on the first guest write
+#define ZZ_XMEM_SHARED  1   // writes reach the file
+#define ZZ_XMEM_PRIVATE 2   // the file is opened read-only, writes stay in this process
+
+int zz_xmem_create(uint64_t size, ZZ_XMEM **out_xmem);
+// map a file with a ZZ_XMEM_* mode
+int zz_xmem_open(const char *path, int mode, ZZ_XMEM **out_xmem);
+void zz_xmem_free(ZZ_XMEM *xmem);
+uint8_t *zz_xmem_data(ZZ_XMEM *xmem);
+uint64_t zz_xmem_size(ZZ_XMEM *xmem);
+// attach xmem to vm and rewind the offset, NULL detaches. Windows into the
+// previous store are unmapped, zz_reset keeps the store attached
+int zz_set_xmem(ZZVM *vm, ZZ_XMEM *xmem);
+// the syscalls behind ZZ_SYS_XMAP to ZZ_SYS_XWRITE
+int zz_xmem_map(ZZVM *vm, ZZ_ADDRESS addr, uint32_t window);
+int zz_xmem_unmap(ZZVM *vm, ZZ_ADDRESS addr);
+int zz_xmem_seek(ZZVM *vm, uint64_t offset);
+size_t zz_xmem_copy(ZZVM *vm, ZZ_ADDRESS addr, size_t len, int to_xmem);
+
+// tiered execution, zztier.c
+//
+// Off until zz_set_tiering turns it on, `zzvm run` uses the thresholds
+// below. zz_execute then interprets instructions straight from guest memory and counts
+// how often every block is entered: jump, call and return targets and the
+// instruction after a block. An address entered tier_threshold[0] times, or
+// tier_threshold[1] times by backward branches, is promoted: instructions up
+// to the next control transfer are decoded once into ZZ_DECODED and later
+// entries run them without fetching and checking each one again. A write to
+// a page holding decoded code demotes its blocks back to the interpreter.
+// Guest stores and host writes through zz_mem_span are tracked, zz_memory
+// hands out no raw view while tiering is on. Pages of zz_map_host buffers
+// are never promoted
+#define ZZ_TIER_BLOCK_THRESHOLD 64
+#define ZZ_TIER_LOOP_THRESHOLD  16
+#define ZZ_TIER_MAX_LENGTH      64      // instructions of one decoded block
+#define ZZ_TIER_MAX_BLOCKS      1024
+#define ZZ_TIER_CODE_SIZE       8192    // decoded instructions of every block
+
+// how zz_execute reached an address
+#define ZZ_TIER_RESUME 1    // look up only, a new zz_execute or a demotion
+#define ZZ_TIER_BLOCK  2    // jump, call, return or falling into a block
+#define ZZ_TIER_LOOP   3    // backward branch
+
+typedef struct {
+    uint8_t op;
+    uint8_t r1;
+    uint8_t r2;
+    uint8_t r3;
+    uint16_t imm;
+} ZZ_DECODED;
+
+typedef struct {
+    ZZ_ADDRESS addr;
+    uint16_t length;    // instructions, 0 once demoted
+    uint16_t code;      // index of the first one in code
+} ZZ_BLOCK;
+
+struct ZZ_TIER {
+    // per instruction slot: entries so far and block number + 1, or 0
+    uint16_t hot[ZZ_MEM_LIMIT / sizeof(ZZ_INSTRUCTION)];
+    uint16_t index[ZZ_MEM_LIMIT / sizeof(ZZ_INSTRUCTION)];
+    // set for pages holding decoded code
+    uint8_t code_pages[ZZ_PAGE_COUNT];
+    ZZ_BLOCK blocks[ZZ_TIER_MAX_BLOCKS];
+    int block_count;
+    int code_used;
+    ZZ_DECODED code[ZZ_TIER_CODE_SIZE];
+};
+
+// promote ip after block_threshold entries, or loop_threshold entries by
+// backward branches. 0 never promotes, both 0 turn tiering off, which is
+// the default. The tier takes about 120K once allocated
+int zz_set_tiering(ZZVM *vm, unsigned block_threshold, unsigned loop_threshold);
+// demote blocks on the pages of a range which is about to change
+void zz_tier_invalidate(ZZVM *vm, ZZ_ADDRESS addr, size_t len);
+// drop every block and counter, for zz_reset
+void zz_tier_reset(ZZVM *vm);
+void zz_tier_free(ZZVM *vm);
+// the slow paths of zz_tier_enter
+int zz_tier_create(ZZVM *vm);
+int zz_tier_promote(ZZVM *vm, ZZ_ADDRESS ip);
+
+// decoded block at ip for zz_execute, counts the entry and promotes ip once
+// it is hot. NULL when ip stays in the interpreter
+static inline const ZZ_BLOCK *zz_tier_enter(ZZVM *vm, ZZ_ADDRESS ip, int kind)
+{
+    ZZ_TIER *tier = vm->tier;
+    int slot = ip / sizeof(ZZ_INSTRUCTION);
+    int number;
+
+    if(tier == NULL || ip % sizeof(ZZ_INSTRUCTION)) {
+        return NULL;
+    }
+    if((number = tier->index[slot]) == 0) {
+        int threshold = kind == ZZ_TIER_RESUME ? 0 : vm->tier_threshold[kind - ZZ_TIER_BLOCK];
+        if(threshold == 0 || ++tier->hot[slot] < threshold) {
+            return NULL;
+        }
+        if((number = zz_tier_promote(vm, ip)) == 0) {
+            return NULL;
+        }
+    }
+    return &tier->blocks[number - 1];
+}
+
+// whether a 16-bit store at addr hits decoded code
+static inline int zz_tier_written(ZZ_TIER *tier, ZZ_ADDRESS addr)
+{
+    return tier->code_pages[addr >> ZZ_PAGE_SHIFT] |
+           tier->code_pages[(ZZ_ADDRESS)(addr + 1) >> ZZ_PAGE_SHIFT];
+}
+
+// guest memory accessors, keep them cheap for LD/ST
+uint8_t *zz_page_fault(ZZVM_CTX *ctx, ZZ_ADDRESS addr);
+size_t zz_mem_span(ZZVM_CTX *ctx, ZZ_ADDRESS addr, size_t len, int writable, uint8_t **out);
+
+static inline uint8_t zz_mem_read8(ZZVM_CTX *ctx, ZZ_ADDRESS addr)
+{
+#ifdef ZZ_PAGED_MEMORY
+    return ctx->pages[addr >> ZZ_PAGE_SHIFT][addr & ZZ_PAGE_MASK];
+#else
+    return ctx->memory[addr];
+#endif
+}
+
+static inline uint16_t zz_mem_read16(ZZVM_CTX *ctx, ZZ_ADDRESS addr)
+{
+#ifdef ZZ_PAGED_MEMORY
+    if((addr & ZZ_PAGE_MASK) != ZZ_PAGE_MASK) {
+        return *(uint16_t*)&ctx->pages[addr >> ZZ_PAGE_SHIFT][addr & ZZ_PAGE_MASK];
+    }
+    return zz_mem_read8(ctx, addr) | zz_mem_read8(ctx, addr + 1) << 8;
+#else
+    return *(uint16_t*)&ctx->memory[addr];
+#endif
+}
+
+static inline int zz_mem_write8(ZZVM_CTX *ctx, ZZ_ADDRESS addr, uint8_t value)
+{
+#ifdef ZZ_PAGED_MEMORY
+    uint8_t *page = ctx->wpages[addr >> ZZ_PAGE_SHIFT];
+    if(page == NULL && (page = zz_page_fault(ctx, addr)) == NULL) {
+        return ZZ_NO_MEMORY;
+    }
+    page[addr & ZZ_PAGE_MASK] = value;
+#else
+    ctx->memory[addr] = value;
+#endif
+    return ZZ_SUCCESS;
+}
+
+static inline int zz_mem_write16(ZZVM_CTX *ctx, ZZ_ADDRESS addr, uint16_t value)
+{
+#ifdef ZZ_PAGED_MEMORY
+    uint8_t *page = ctx->wpages[addr >> ZZ_PAGE_SHIFT];
+    if(page && (addr & ZZ_PAGE_MASK) != ZZ_PAGE_MASK) {
+        *(uint16_t*)&page[addr & ZZ_PAGE_MASK] = value;
+        return ZZ_SUCCESS;
+    }
+    if(zz_mem_write8(ctx, addr, value) != ZZ_SUCCESS) {
+        return ZZ_NO_MEMORY;
+    }
+    return zz_mem_write8(ctx, addr + 1, value >> 8);
+#else
+    *(uint16_t*)&ctx->memory[addr] = value;
+    return ZZ_SUCCESS;
+#endif
+}
+
 uint64_t zz_rand(ZZVM_CTX *ctx);
 
+// direct access for bindings, zz_memory is NULL with ZZ_PAGED_MEMORY or
+// while tiering is on
+uint16_t *zz_registers(ZZVM *vm);
+uint8_t *zz_memory(ZZVM *vm);
+
 // assistant API for exection
 ZZ_INSTRUCTION * zz_fetch(ZZVM_CTX *ctx);
 
@@ -99,21 +490,81 @@ int zz_execute(ZZVM *vm, int count, int *stop_reason);
 
 int zz_reg_syscall_handler(ZZVM *vm, ZZ_SYSCALL_HANDLER handler);
 
-extern FILE *zz_msg_pipe;
-extern int zz_msg_level;
-void zz_output_message(int level, char *msg, ...);
-
-#define zz_debug(MSG) zz_output_message(ZZ_MSGL_DEBUG, "%s", MSG)
-#define zz_msg(MSG)   zz_output_message(ZZ_MSGL_MSG,   "%s", MSG)
-#define zz_warn(MSG)  zz_output_message(ZZ_MSGL_WARN,  "%s", MSG)
-#define zz_error(MSG) zz_output_message(ZZ_MSGL_ERROR, "%s", MSG)
-#define zz_fatal(MSG) zz_output_message(ZZ_MSGL_FATAL, "%s", MSG)
-
-#define zz_debug_f(MSG, args...) zz_output_message(ZZ_MSGL_DEBUG, MSG, args)
-#define zz_msg_f(MSG, args...)   zz_output_message(ZZ_MSGL_MSG,   MSG, args)
-#define zz_warn_f(MSG, args...)  zz_output_message(ZZ_MSGL_WARN,  MSG, args)
-#define zz_error_f(MSG, args...) zz_output_message(ZZ_MSGL_ERROR, MSG, args)
-#define zz_fatal_f(MSG, args...) zz_output_message(ZZ_MSGL_FATAL, MSG, args)
+// event driven execution
+//
+// a SYS whose number is in mask stops zz_run with ZZ_SYSCALL_PENDING, IP
+// already points after SYS. The host performs the syscall whenever it likes,
+// calls zz_complete_syscall with the value for RA and runs the vm again.
+#define ZZ_SYS_MASK(NR) (1u << (NR))
+#define ZZ_SYS_MASK_IO  (ZZ_SYS_MASK(ZZ_SYS_READ) | ZZ_SYS_MASK(ZZ_SYS_WRITE) | ZZ_SYS_MASK(ZZ_SYS_WRITEN))
+
+int zz_set_async_syscalls(ZZVM *vm, uint32_t mask);
+int zz_run(ZZVM *vm, int count, ZZ_EVENT *event);
+const ZZ_SYSCALL *zz_pending_syscall(ZZVM *vm);
+int zz_complete_syscall(ZZVM *vm, uint16_t result);
+// complete the pending syscall synchronously with syscall_handler
+int zz_dispatch_syscall(ZZVM *vm);
+
+// logging, configured per vm
+void zz_set_log(ZZVM *vm, FILE *pipe, int level, int async);
+void zz_output_message(ZZVM *vm, int level, const char *msg, ...);
+
+#define zz_debug(VM, MSG) zz_output_message(VM, ZZ_MSGL_DEBUG, "%s", MSG)
+#define zz_msg(VM, MSG)   zz_output_message(VM, ZZ_MSGL_MSG,   "%s", MSG)
+#define zz_warn(VM, MSG)  zz_output_message(VM, ZZ_MSGL_WARN,  "%s", MSG)
+#define zz_error(VM, MSG) zz_output_message(VM, ZZ_MSGL_ERROR, "%s", MSG)
+#define zz_fatal(VM, MSG) zz_output_message(VM, ZZ_MSGL_FATAL, "%s", MSG)
+
+#define zz_debug_f(VM, MSG, args...) zz_output_message(VM, ZZ_MSGL_DEBUG, MSG, args)
+#define zz_msg_f(VM, MSG, args...)   zz_output_message(VM, ZZ_MSGL_MSG,   MSG, args)
+#define zz_warn_f(VM, MSG, args...)  zz_output_message(VM, ZZ_MSGL_WARN,  MSG, args)
+#define zz_error_f(VM, MSG, args...) zz_output_message(VM, ZZ_MSGL_ERROR, MSG, args)
+#define zz_fatal_f(VM, MSG, args...) zz_output_message(VM, ZZ_MSGL_FATAL, MSG, args)
+
+// asynchronous logging, zzlog.c
+//
+// every producing thread owns a lock-free ring of binary events, arguments
+// are captured without formatting and a drain thread formats them later.
+// format strings must stay valid until drained (string literals are fine),
+// `%s` arguments are copied. A full ring drops the message, execution
+// threads never wait for the drain thread.
+int zz_log_start(void);
+void zz_log_post(FILE *pipe, const char *msg, va_list args);
+void zz_log_flush(void);
+void zz_log_stop(void);
+size_t zz_log_dropped(void);
+
+// execution statistics, zzstats.c
+#define ZZ_OP_COUNT (ZZOP_STR + 1)
+
+typedef struct {
+    uint64_t instructions;
+    uint64_t syscalls;
+    uint64_t calls;
+    uint64_t branches;          // conditional jumps, LOOP and ADD IP, like JMP
+    uint64_t branches_taken;    // JMP is always taken
+    uint64_t mem_reads;         // LD, LDR, POP, RET
+    uint64_t mem_writes;        // ST, STR, PUSH, CALL
+    uint64_t promotions;        // blocks decoded by the tier
+    uint64_t demotions;         // decoded blocks dropped after a write
+    uint64_t decoded;           // instructions run from decoded blocks
+    uint64_t ops[ZZ_OP_COUNT];  // by opcode
+} ZZ_STATS;
+
+#define ZZ_STATS_JSON       0
+#define ZZ_STATS_PROMETHEUS 1
+
+extern const char * const ZZ_OP_NAME[];
+
+// counters of vm since its last flush, ZZ_FAILED when built with NOSTATS
+int zz_get_stats(ZZVM *vm, ZZ_STATS *stats);
+// move counters of vm into the process-wide totals, zz_reset and
+// zz_destroy do this too
+void zz_flush_stats(ZZVM *vm);
+// process-wide totals of every flushed vm
+int zz_get_global_stats(ZZ_STATS *stats);
+// text dump, returns the length it needs like snprintf
+int zz_format_stats(const ZZ_STATS *stats, int format, char *buffer, size_t size);
 
 int zz_disasm(ZZ_ADDRESS ip, ZZ_INSTRUCTION *ins, char *buffer, size_t limit);
 
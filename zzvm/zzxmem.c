@@ -0,0 +1,192 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zzvm.h"
+
+#ifdef ZZ_UNIX_ENV
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+struct ZZ_XMEM {
+    uint8_t *data;
+    uint64_t size;
+    int writable;
+    int mapped;     // data comes from mmap
+};
+
+int zz_xmem_create(uint64_t size, ZZ_XMEM **out_xmem)
+{
+    *out_xmem = NULL;
+    if(size != (size_t)size) {
+        return ZZ_FAILED;
+    }
+
+    ZZ_XMEM *xmem = malloc(sizeof(ZZ_XMEM));
+    if(xmem == NULL) {
+        return ZZ_FAILED;
+    }
+
+    xmem->size = size;
+    xmem->writable = 1;
+#ifdef ZZ_UNIX_ENV
+    // untouched parts of a large store cost nothing
+    xmem->mapped = size > 0;
+    xmem->data = size ? mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0) : NULL;
+    if(xmem->data == MAP_FAILED) {
+        free(xmem);
+        return ZZ_FAILED;
+    }
+#else
+    xmem->mapped = 0;
+    if((xmem->data = calloc(1, size)) == NULL && size) {
+        free(xmem);
+        return ZZ_FAILED;
+    }
+#endif
+
+    *out_xmem = xmem;
+    return ZZ_SUCCESS;
+}
+
+int zz_xmem_open(const char *path, int mode, ZZ_XMEM **out_xmem)
+{
+    *out_xmem = NULL;
+#ifdef ZZ_UNIX_ENV
+    struct stat st;
+    if(mode != ZZ_XMEM_RDONLY && mode != ZZ_XMEM_SHARED && mode != ZZ_XMEM_PRIVATE) {
+        return ZZ_FAILED;
+    }
+    int fd = open(path, mode == ZZ_XMEM_SHARED ? O_RDWR : O_RDONLY);
+    if(fd < 0) {
+        return ZZ_FAILED;
+    }
+    if(fstat(fd, &st) != 0 || (uint64_t)st.st_size != (size_t)st.st_size) {
+        close(fd);
+        return ZZ_FAILED;
+    }
+
+    ZZ_XMEM *xmem = malloc(sizeof(ZZ_XMEM));
+    if(xmem == NULL) {
+        close(fd);
+        return ZZ_FAILED;
+    }
+
+    xmem->size = st.st_size;
+    xmem->writable = mode != ZZ_XMEM_RDONLY;
+    xmem->mapped = xmem->size > 0;
+    xmem->data = NULL;
+    if(xmem->size) {
+        xmem->data = mmap(NULL, xmem->size, xmem->writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                          mode == ZZ_XMEM_PRIVATE ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if(xmem->data == MAP_FAILED) {
+        free(xmem);
+        return ZZ_FAILED;
+    }
+
+    *out_xmem = xmem;
+    return ZZ_SUCCESS;
+#else
+    return ZZ_FAILED;
+#endif
+}
+
+void zz_xmem_free(ZZ_XMEM *xmem)
+{
+    if(xmem == NULL) {
+        return;
+    }
+#ifdef ZZ_UNIX_ENV
+    if(xmem->mapped) {
+        munmap(xmem->data, xmem->size);
+    } else {
+        free(xmem->data);
+    }
+#else
+    free(xmem->data);
+#endif
+    free(xmem);
+}
+
+uint8_t *zz_xmem_data(ZZ_XMEM *xmem)
+{
+    return xmem->data;
+}
+
+uint64_t zz_xmem_size(ZZ_XMEM *xmem)
+{
+    return xmem->size;
+}
+
+int zz_set_xmem(ZZVM *vm, ZZ_XMEM *xmem)
+{
+    if(vm->state != ZZ_ST_SLEEP && vm->state != ZZ_ST_WAIT) {
+        return ZZ_FAILED;
+    }
+
+#ifdef ZZ_PAGED_MEMORY
+    // pages still pointing into the old store, private copies of read-only
+    // windows are guest memory by now and stay
+    ZZ_XMEM *old = vm->xmem;
+    for(int i = 0; old && old != xmem && i < ZZ_PAGE_COUNT; i++) {
+        uint8_t *page = vm->ctx.pages[i];
+        if(page >= old->data && page < old->data + old->size) {
+            zz_map_pages(&vm->ctx, i << ZZ_PAGE_SHIFT, NULL, ZZ_PAGE_SIZE, 0);
+        }
+    }
+#endif
+    vm->xmem = xmem;
+    vm->xmem_offset = 0;
+    return ZZ_SUCCESS;
+}
+
+int zz_xmem_map(ZZVM *vm, ZZ_ADDRESS addr, uint32_t window)
+{
+    ZZ_XMEM *xmem = vm->xmem;
+    uint64_t offset = (uint64_t)window * ZZ_XMEM_WINDOW;
+
+    if(xmem == NULL || addr % ZZ_XMEM_WINDOW || offset + ZZ_XMEM_WINDOW > xmem->size) {
+        return ZZ_FAILED;
+    }
+    return zz_map_pages(&vm->ctx, addr, xmem->data + offset, ZZ_XMEM_WINDOW, xmem->writable);
+}
+
+int zz_xmem_unmap(ZZVM *vm, ZZ_ADDRESS addr)
+{
+    if(addr % ZZ_XMEM_WINDOW) {
+        return ZZ_FAILED;
+    }
+    return zz_map_pages(&vm->ctx, addr, NULL, ZZ_XMEM_WINDOW, 0);
+}
+
+int zz_xmem_seek(ZZVM *vm, uint64_t offset)
+{
+    if(vm->xmem == NULL || offset > vm->xmem->size) {
+        return ZZ_FAILED;
+    }
+    vm->xmem_offset = offset;
+    return ZZ_SUCCESS;
+}
+
+size_t zz_xmem_copy(ZZVM *vm, ZZ_ADDRESS addr, size_t len, int to_xmem)
+{
+    ZZ_XMEM *xmem = vm->xmem;
+
+    if(xmem == NULL || (to_xmem && !xmem->writable) || vm->xmem_offset >= xmem->size) {
+        return 0;
+    }
+    if(len > xmem->size - vm->xmem_offset) {
+        len = xmem->size - vm->xmem_offset;
+    }
+
+    ZZ_IOVEC iov = { addr, xmem->data + vm->xmem_offset, len };
+    if((to_xmem ? zz_readv(vm, &iov, 1) : zz_writev(vm, &iov, 1)) != ZZ_SUCCESS) {
+        return 0;
+    }
+    vm->xmem_offset += len;
+    return len;
+}